@@ -0,0 +1,248 @@
+"""
+Loopback HTTP server for benchmarking the downloader without leaving the
+machine. Serves a directory with HEAD, GET, byte Range and
+conditional request (ETag/Last-Modified) support, and can
+generate a set of payload files together with a url_file listing them.
+
+    python3 loopback_server.py --generate 1,10,100 bench_files bench_urls.txt
+    python3 loopback_server.py bench_files
+
+Whole-file requests for text payloads (.csv, .json, .log, .txt) are gzip
+compressed when the client accepts it; --text generates such payloads.
+--fail-rate makes a fraction of range requests fail part way through, to
+exercise the handling of incomplete files. --slow-rate makes a fraction
+of range requests trickle at --slow-bps instead, like a congested path,
+to exercise hedging.
+
+--redirect /old/=http://127.0.0.2/ answers requests under /old/ with a
+302 to the same path under the target, like a CDN redirector.
+
+--certfile and --keyfile serve https instead, with session tickets so
+clients can resume, and generated url_files list https urls:
+
+    openssl req -x509 -newkey rsa:2048 -nodes -days 30 -subj /CN=127.0.0.1 \
+        -addext subjectAltName=IP:127.0.0.1 -keyout key.pem -out cert.pem
+    python3 loopback_server.py --port 443 --certfile cert.pem --keyfile key.pem bench_files
+    ./downloader --ca-file cert.pem bench_urls.txt 4 out
+"""
+import argparse
+import gzip
+import io
+import os
+import random
+import re
+import socket
+import ssl
+import time
+from http.server import SimpleHTTPRequestHandler, ThreadingHTTPServer
+
+RANGE = re.compile(r"bytes=(\d*)-(\d*)")
+COMPRESSIBLE = (".csv", ".json", ".log", ".txt")
+
+# Compressed payloads keyed by (path, mtime) so repeated benchmark runs do
+# not measure the server's compression.
+compressed = {}
+
+
+def gzipped(path, mtime):
+    key = (path, mtime)
+    if key not in compressed:
+        with open(path, "rb") as f:
+            compressed[key] = gzip.compress(f.read(), 6)
+    return compressed[key]
+
+
+class RangeHandler(SimpleHTTPRequestHandler):
+    # HTTP/1.0 so every response ends with the connection, as the
+    # downloader reads until EOF.
+    protocol_version = "HTTP/1.0"
+    fail_rate = 0.0
+    failures = random.Random(0)
+    slow_rate = 0.0
+    slow_bps = 262144
+    slowdowns = random.Random(1)
+    redirects = []
+
+    def log_message(self, format, *args):
+        pass
+
+    def setup(self):
+        # The handshake runs here on the handler's thread rather than in
+        # the accept loop, so one slow client does not hold up the rest.
+        if isinstance(self.request, ssl.SSLSocket):
+            self.request.do_handshake()
+        super().setup()
+
+    def send_head(self):
+        # Only range responses are ever sent slowly.
+        self.slow = False
+        for prefix, target in self.redirects:
+            if self.path.startswith(prefix):
+                self.send_response(302)
+                self.send_header("Location", target + self.path[len(prefix):])
+                self.send_header("Content-Length", "0")
+                self.end_headers()
+                return None
+
+        path = self.translate_path(self.path)
+        if not os.path.isfile(path):
+            self.send_error(404)
+            return None
+
+        stat = os.stat(path)
+        size = stat.st_size
+        etag = '"%x-%x"' % (stat.st_mtime_ns, size)
+        last_modified = self.date_time_string(int(stat.st_mtime))
+        encode = (path.endswith(COMPRESSIBLE) and "Range" not in self.headers and
+                  "gzip" in self.headers.get("Accept-Encoding", ""))
+        if encode:
+            # Each representation needs its own validator.
+            etag = etag[:-1] + '-gzip"'
+
+        # Conditional requests, If-None-Match takes precedence.
+        if_none_match = self.headers.get("If-None-Match")
+        if_modified_since = self.headers.get("If-Modified-Since")
+        if (if_none_match == etag or
+                (if_none_match is None and if_modified_since == last_modified)):
+            self.send_response(304)
+            self.send_header("ETag", etag)
+            self.send_header("Last-Modified", last_modified)
+            self.end_headers()
+            return None
+
+        if encode:
+            self.send_response(200)
+            self.send_header("Content-Encoding", "gzip")
+            self.send_header("Content-Type", "application/octet-stream")
+            self.send_header("ETag", etag)
+            self.send_header("Last-Modified", last_modified)
+            self.end_headers()
+            # The compressed length is only known once compressed, which a
+            # HEAD does not need. The connection end marks the body end.
+            if self.command == "HEAD":
+                return None
+            body = gzipped(path, stat.st_mtime_ns)
+            self.remaining = len(body)
+            return io.BytesIO(body)
+
+        start, end = 0, size - 1
+        match = RANGE.match(self.headers.get("Range", ""))
+        partial = match is not None and (match.group(1) or match.group(2))
+
+        if partial:
+            if match.group(1):
+                start = int(match.group(1))
+                if match.group(2):
+                    end = min(int(match.group(2)), size - 1)
+            else:
+                start = max(0, size - int(match.group(2)))
+            if start >= size:
+                self.send_error(416)
+                return None
+            self.send_response(206)
+            self.send_header("Content-Range", "bytes %d-%d/%d" % (start, end, size))
+        else:
+            self.send_response(200)
+
+        self.send_header("Accept-Ranges", "bytes")
+        self.send_header("ETag", etag)
+        self.send_header("Last-Modified", last_modified)
+        self.send_header("Content-Type", "application/octet-stream")
+        self.send_header("Content-Length", str(end - start + 1))
+        self.end_headers()
+
+        f = open(path, "rb")
+        f.seek(start)
+        self.remaining = end - start + 1
+        if partial and self.failures.random() < self.fail_rate:
+            # Drop the connection half way, leaving the response short.
+            self.remaining //= 2
+        self.slow = partial and self.slowdowns.random() < self.slow_rate
+        return f
+
+    def copyfile(self, source, outputfile):
+        chunk_size = 16384 if self.slow else 1 << 20
+        while self.remaining > 0:
+            chunk = source.read(min(self.remaining, chunk_size))
+            if not chunk:
+                break
+            outputfile.write(chunk)
+            self.remaining -= len(chunk)
+            if self.slow:
+                time.sleep(len(chunk) / self.slow_bps)
+
+
+def text_payload(size):
+    # CSV rows of sensor style readings, compressible like real logs.
+    rng = random.Random(size)
+    rows, length = [], 0
+    while length < size:
+        row = "%d,sensor-%03d,%.3f,%s\n" % (length, rng.randrange(100), rng.random() * 100,
+                                          rng.choice(("ok", "warn", "fail")))
+        rows.append(row)
+        length += len(row)
+    return "".join(rows).encode()[:size]
+
+
+class TLSServer(ThreadingHTTPServer):
+    context = None
+
+    def get_request(self):
+        sock, address = super().get_request()
+        return self.context.wrap_socket(sock, server_side=True, do_handshake_on_connect=False), address
+
+
+def generate(sizes, directory, url_file, host, text=False):
+    os.makedirs(directory, exist_ok=True)
+    with open(url_file, "w") as urls:
+        for size in sizes:
+            name = "%smb.%s" % (size, "csv" if text else "bin")
+            length = int(float(size) * 1024 * 1024)
+            with open(os.path.join(directory, name), "wb") as f:
+                f.write(text_payload(length) if text else os.urandom(length))
+            urls.write("%s/%s\n" % (host, name))
+
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser()
+    parser.add_argument("directory")
+    parser.add_argument("url_file", nargs="?")
+    parser.add_argument("--port", type=int, default=80)
+    parser.add_argument("--bind", default="127.0.0.1")
+    parser.add_argument("--generate", help="comma separated file sizes in MB")
+    parser.add_argument("--text", action="store_true",
+                        help="generate compressible CSV payloads instead of random bytes")
+    parser.add_argument("--fail-rate", type=float, default=0.0,
+                        help="fraction of range requests to cut short")
+    parser.add_argument("--slow-rate", type=float, default=0.0,
+                        help="fraction of range requests to send slowly")
+    parser.add_argument("--slow-bps", type=int, default=262144,
+                        help="bytes per second of the slow range requests")
+    parser.add_argument("--redirect", action="append", default=[], metavar="PREFIX=TARGET",
+                        help="redirect paths starting with PREFIX to TARGET followed by the rest of the path")
+    parser.add_argument("--certfile", help="serve https with this PEM certificate chain")
+    parser.add_argument("--keyfile", help="private key of --certfile, if not included in it")
+    args = parser.parse_args()
+
+    if args.generate:
+        host = args.bind if ":" not in args.bind else "[%s]" % args.bind
+        if args.certfile:
+            host = "https://" + host + ("" if args.port == 443 else ":%d" % args.port)
+        elif args.port != 80:
+            host += ":%d" % args.port
+        generate(args.generate.split(","), args.directory,
+                 args.url_file or "loopback_urls.txt", host, args.text)
+    else:
+        RangeHandler.fail_rate = args.fail_rate
+        RangeHandler.slow_rate = args.slow_rate
+        RangeHandler.slow_bps = args.slow_bps
+        RangeHandler.redirects = [tuple(r.split("=", 1)) for r in args.redirect]
+        server = ThreadingHTTPServer
+        if args.certfile:
+            server = TLSServer
+            server.context = ssl.SSLContext(ssl.PROTOCOL_TLS_SERVER)
+            server.context.load_cert_chain(args.certfile, args.keyfile)
+        os.chdir(args.directory)
+        if ":" in args.bind:
+            server.address_family = socket.AF_INET6
+        server((args.bind, args.port), RangeHandler).serve_forever()
@@ -0,0 +1,125 @@
+#include <stdlib.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "admission.h"
+#include "metrics.h"
+
+typedef struct AdmissionStruct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t released;
+
+    size_t tasks;
+    size_t bytes;
+    size_t max_tasks;
+    size_t max_bytes;
+} Admission;
+
+// Determine whether work fits within the budget. Must be called with the
+// lock held.
+static int fits(const Admission *admission, size_t tasks, size_t bytes)
+{
+    if (admission->tasks == 0)
+    {
+        return 1;
+    }
+
+    return (admission->max_tasks == 0 || admission->tasks + tasks <= admission->max_tasks) &&
+           (admission->max_bytes == 0 || admission->bytes + bytes <= admission->max_bytes);
+}
+
+/**
+ * Allocate an admission controller.
+ * @param max_tasks - Most range tasks in flight, 0 for no limit
+ * @param max_bytes - Most bytes of ranges in flight, 0 for no limit
+ * @return admission - Pointer to the allocated controller
+ */
+Admission *admission_alloc(size_t max_tasks, size_t max_bytes)
+{
+    Admission *admission = calloc(1, sizeof(Admission));
+
+    pthread_mutex_init(&admission->lock, NULL);
+    pthread_cond_init(&admission->released, NULL);
+    admission->max_tasks = max_tasks;
+    admission->max_bytes = max_bytes;
+
+    return admission;
+}
+
+/**
+ * Free an admission controller. Don't call this function while it is
+ * still in use.
+ * @param admission - Pointer to the controller to free
+ */
+void admission_free(Admission *admission)
+{
+    pthread_mutex_destroy(&admission->lock);
+    pthread_cond_destroy(&admission->released);
+    free(admission);
+}
+
+/**
+ * Change the budget, waking the planner if it now has room.
+ * @param admission - Pointer to the controller
+ * @param max_tasks - Most range tasks in flight, 0 for no limit
+ * @param max_bytes - Most bytes of ranges in flight, 0 for no limit
+ */
+void admission_limit(Admission *admission, size_t max_tasks, size_t max_bytes)
+{
+    pthread_mutex_lock(&admission->lock);
+    admission->max_tasks = max_tasks;
+    admission->max_bytes = max_bytes;
+    pthread_cond_broadcast(&admission->released);
+    pthread_mutex_unlock(&admission->lock);
+}
+
+/**
+ * Admit work, blocking until it fits within the budget. Work larger than
+ * the whole budget is admitted once nothing else is in flight.
+ * @param admission - Pointer to the controller
+ * @param tasks - Number of range tasks
+ * @param bytes - Total bytes of the ranges
+ */
+void admission_acquire(Admission *admission, size_t tasks, size_t bytes)
+{
+    pthread_mutex_lock(&admission->lock);
+
+    if (!fits(admission, tasks, bytes))
+    {
+        struct timespec start, end;
+
+        // Time spent here is time the planner could have spent probing.
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        while (!fits(admission, tasks, bytes))
+        {
+            pthread_cond_wait(&admission->released, &admission->lock);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        metrics_add(admission_waits, 1);
+        metrics_add(admission_wait_us, (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_nsec - start.tv_nsec) / 1000);
+    }
+
+    admission->tasks += tasks;
+    admission->bytes += bytes;
+    metrics_max(peak_tasks, admission->tasks);
+    metrics_max(peak_bytes, admission->bytes);
+
+    pthread_mutex_unlock(&admission->lock);
+}
+
+/**
+ * Release finished work, waking the planner if it is waiting for room.
+ * @param admission - Pointer to the controller
+ * @param tasks - Number of range tasks
+ * @param bytes - Total bytes of the ranges
+ */
+void admission_release(Admission *admission, size_t tasks, size_t bytes)
+{
+    pthread_mutex_lock(&admission->lock);
+    admission->tasks -= tasks;
+    admission->bytes -= bytes;
+    pthread_cond_signal(&admission->released);
+    pthread_mutex_unlock(&admission->lock);
+}
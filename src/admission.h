@@ -0,0 +1,61 @@
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <stddef.h>
+
+
+/*
+ * Admission - bounds the work planned ahead of the workers. The planner
+ * acquires a file's range tasks and bytes before queueing them and each
+ * is released as its task finishes, so probing runs ahead of the workers
+ * only as far as the budget allows.
+ */
+typedef struct AdmissionStruct Admission;
+
+
+/**
+ * Allocate an admission controller.
+ * @param max_tasks - Most range tasks in flight, 0 for no limit
+ * @param max_bytes - Most bytes of ranges in flight, 0 for no limit
+ * @return admission - Pointer to the allocated controller
+ */
+Admission *admission_alloc(size_t max_tasks, size_t max_bytes);
+
+
+/**
+ * Free an admission controller. Don't call this function while it is
+ * still in use.
+ * @param admission - Pointer to the controller to free
+ */
+void admission_free(Admission *admission);
+
+
+/**
+ * Change the budget, waking the planner if it now has room.
+ * @param admission - Pointer to the controller
+ * @param max_tasks - Most range tasks in flight, 0 for no limit
+ * @param max_bytes - Most bytes of ranges in flight, 0 for no limit
+ */
+void admission_limit(Admission *admission, size_t max_tasks, size_t max_bytes);
+
+
+/**
+ * Admit work, blocking until it fits within the budget. Work larger than
+ * the whole budget is admitted once nothing else is in flight.
+ * @param admission - Pointer to the controller
+ * @param tasks - Number of range tasks
+ * @param bytes - Total bytes of the ranges
+ */
+void admission_acquire(Admission *admission, size_t tasks, size_t bytes);
+
+
+/**
+ * Release finished work, waking the planner if it is waiting for room.
+ * @param admission - Pointer to the controller
+ * @param tasks - Number of range tasks
+ * @param bytes - Total bytes of the ranges
+ */
+void admission_release(Admission *admission, size_t tasks, size_t bytes);
+
+
+#endif
@@ -0,0 +1,332 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <libgen.h>
+#include <unistd.h>
+#include <dirent.h>
+
+#include "affinity.h"
+
+#define PATH_SIZE 256
+#define LINE_SIZE 4096
+
+// Append a CPU to the plan unless it is already present.
+static int plan_add_cpu(AffinityPlan *plan, int cpu)
+{
+    int *tmp;
+
+    for (int i = 0; i < plan->num_cpus; ++i)
+    {
+        if (plan->cpus[i] == cpu)
+        {
+            return 0;
+        }
+    }
+
+    tmp = realloc(plan->cpus, sizeof(int) * (plan->num_cpus + 1));
+    if (tmp == NULL)
+    {
+        fprintf(stderr, "realloc() did not return a pointer! Likely out of memory.\n");
+        return -1;
+    }
+
+    plan->cpus = tmp;
+    plan->cpus[plan->num_cpus++] = cpu;
+    return 0;
+}
+
+// Parse a kernel style list e.g. "0-3,8,10-11" into the plan. The same
+// format is used for both CPU and node lists.
+static int parse_list(AffinityPlan *plan, const char *list)
+{
+    const char *p = list;
+    char *end;
+
+    while (*p)
+    {
+        long first, last;
+
+        // Skip separators and trailing whitespace from sysfs files.
+        if (*p == ',' || isspace((unsigned char)*p))
+        {
+            ++p;
+            continue;
+        }
+
+        first = strtol(p, &end, 10);
+        if (end == p || first < 0)
+        {
+            fprintf(stderr, "could not parse list: %s\n", list);
+            return -1;
+        }
+
+        last = first;
+        if (*end == '-')
+        {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+            if (end == p || last < first)
+            {
+                fprintf(stderr, "could not parse list: %s\n", list);
+                return -1;
+            }
+        }
+
+        for (long i = first; i <= last; ++i)
+        {
+            if (plan_add_cpu(plan, (int)i) != 0)
+            {
+                return -1;
+            }
+        }
+        p = end;
+    }
+
+    return 0;
+}
+
+// Read the first line of a small sysfs/procfs file into line.
+static int read_line(const char *path, char *line, size_t size)
+{
+    FILE *fp = fopen(path, "r");
+
+    if (fp == NULL)
+    {
+        return -1;
+    }
+
+    if (fgets(line, size, fp) == NULL)
+    {
+        fclose(fp);
+        return -1;
+    }
+
+    fclose(fp);
+    return 0;
+}
+
+/**
+ * Build a plan from an explicit CPU list such as "0-3,8,10-11".
+ * @param plan - The plan to populate
+ * @param cpulist - Comma separated list of CPUs and CPU ranges
+ * @return 0 on success, -1 if the list could not be parsed
+ */
+int affinity_plan_cpus(AffinityPlan *plan, const char *cpulist)
+{
+    if (parse_list(plan, cpulist) != 0 || plan->num_cpus == 0)
+    {
+        affinity_plan_free(plan);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Build a plan from a list of NUMA nodes such as "0,1". The CPUs of each
+ * node are interleaved so consecutive workers alternate between nodes.
+ * @param plan - The plan to populate
+ * @param nodelist - Comma separated list of NUMA nodes and node ranges
+ * @return 0 on success, -1 if a node has no CPUs or does not exist
+ */
+int affinity_plan_nodes(AffinityPlan *plan, const char *nodelist)
+{
+    AffinityPlan nodes = {0}, *node_cpus;
+    char path[PATH_SIZE], line[LINE_SIZE];
+    int rc = -1, remaining, round = 0;
+
+    if (parse_list(&nodes, nodelist) != 0 || nodes.num_cpus == 0)
+    {
+        affinity_plan_free(&nodes);
+        return -1;
+    }
+
+    node_cpus = calloc(nodes.num_cpus, sizeof(AffinityPlan));
+
+    // Gather the CPUs belonging to each requested node.
+    for (int i = 0; i < nodes.num_cpus; ++i)
+    {
+        snprintf(path, PATH_SIZE, "/sys/devices/system/node/node%d/cpulist", nodes.cpus[i]);
+        if (read_line(path, line, LINE_SIZE) != 0 || parse_list(&node_cpus[i], line) != 0 || node_cpus[i].num_cpus == 0)
+        {
+            fprintf(stderr, "NUMA node %d has no CPUs or does not exist\n", nodes.cpus[i]);
+            goto cleanup;
+        }
+    }
+
+    // Interleave the node CPU lists so that workers 0, 1, 2... land on
+    // node a, node b, node a... spreading load evenly across sockets.
+    do
+    {
+        remaining = 0;
+        for (int i = 0; i < nodes.num_cpus; ++i)
+        {
+            if (round < node_cpus[i].num_cpus)
+            {
+                plan_add_cpu(plan, node_cpus[i].cpus[round]);
+                remaining = 1;
+            }
+        }
+        ++round;
+    } while (remaining);
+
+    rc = 0;
+
+cleanup:
+    for (int i = 0; i < nodes.num_cpus; ++i)
+    {
+        affinity_plan_free(&node_cpus[i]);
+    }
+    free(node_cpus);
+    affinity_plan_free(&nodes);
+
+    return rc;
+}
+
+// Determine whether an /proc/interrupts line belongs to the interface's
+// receive path. Drivers name their vectors differently e.g. "eth0-rx-0",
+// "eth0-TxRx-3" or "virtio0-input.0", so both the interface and device
+// names are accepted.
+static int irq_matches(const char *line, const char *ifname, const char *devname)
+{
+    const char *name = strrchr(line, ' ');
+
+    if (name == NULL)
+    {
+        return 0;
+    }
+    ++name;
+
+    if (strstr(name, ifname) == NULL && (devname[0] == '\0' || strstr(name, devname) == NULL))
+    {
+        return 0;
+    }
+
+    return strstr(name, "rx") || strstr(name, "Rx") || strstr(name, "RX") || strstr(name, "input");
+}
+
+/**
+ * Build a plan from the CPUs servicing a network interface's RX queue
+ * interrupts. Falls back to the CPUs local to the NIC's NUMA node when
+ * the interrupts cannot be found (e.g. virtual interfaces).
+ * @param plan - The plan to populate
+ * @param ifname - Name of the network interface e.g. eth0
+ * @return 0 on success, -1 if no CPUs could be associated with ifname
+ */
+int affinity_plan_nic(AffinityPlan *plan, const char *ifname)
+{
+    char path[PATH_SIZE], link[PATH_SIZE] = {0}, devname[PATH_SIZE] = {0}, line[LINE_SIZE];
+    FILE *fp;
+
+    // The device symlink names the bus device (e.g. virtio0) which some
+    // drivers use for their interrupt names instead of the interface.
+    snprintf(path, PATH_SIZE, "/sys/class/net/%s/device", ifname);
+    if (readlink(path, link, PATH_SIZE - 1) > 0)
+    {
+        strncpy(devname, basename(link), PATH_SIZE - 1);
+    }
+
+    if ((fp = fopen("/proc/interrupts", "r")) != NULL)
+    {
+        while (fgets(line, LINE_SIZE, fp) != NULL)
+        {
+            char affinity[LINE_SIZE];
+            int irq;
+
+            line[strcspn(line, "\n")] = '\0';
+            if (sscanf(line, " %d:", &irq) != 1 || !irq_matches(line, ifname, devname))
+            {
+                continue;
+            }
+
+            // Prefer the effective affinity, which reflects where the
+            // interrupt is actually delivered rather than where it may be.
+            snprintf(path, PATH_SIZE, "/proc/irq/%d/effective_affinity_list", irq);
+            if (read_line(path, affinity, LINE_SIZE) != 0)
+            {
+                snprintf(path, PATH_SIZE, "/proc/irq/%d/smp_affinity_list", irq);
+                if (read_line(path, affinity, LINE_SIZE) != 0)
+                {
+                    continue;
+                }
+            }
+            parse_list(plan, affinity);
+        }
+        fclose(fp);
+    }
+
+    if (plan->num_cpus > 0)
+    {
+        return 0;
+    }
+
+    // No RX interrupts were found, use the CPUs local to the NIC instead.
+    snprintf(path, PATH_SIZE, "/sys/class/net/%s/device/local_cpulist", ifname);
+    if (read_line(path, line, LINE_SIZE) == 0 && parse_list(plan, line) == 0 && plan->num_cpus > 0)
+    {
+        return 0;
+    }
+
+    fprintf(stderr, "could not find CPUs servicing interface %s\n", ifname);
+    affinity_plan_free(plan);
+    return -1;
+}
+
+/**
+ * Get the CPU a given worker should be pinned to.
+ * @param plan - The plan to consult
+ * @param worker - Index of the worker
+ * @return The CPU number or -1 if the worker should not be pinned
+ */
+int affinity_worker_cpu(const AffinityPlan *plan, int worker)
+{
+    if (plan == NULL || plan->num_cpus == 0)
+    {
+        return -1;
+    }
+
+    return plan->cpus[worker % plan->num_cpus];
+}
+
+/**
+ * Get the NUMA node that owns a CPU.
+ * @param cpu - The CPU number
+ * @return The node number or -1 if unknown
+ */
+int affinity_cpu_node(int cpu)
+{
+    char path[PATH_SIZE];
+    struct dirent *entry;
+    int node = -1;
+    DIR *dir;
+
+    // Each CPU directory contains a nodeN link to the node that owns it.
+    snprintf(path, PATH_SIZE, "/sys/devices/system/cpu/cpu%d", cpu);
+    if ((dir = opendir(path)) == NULL)
+    {
+        return -1;
+    }
+
+    while ((entry = readdir(dir)) != NULL)
+    {
+        if (sscanf(entry->d_name, "node%d", &node) == 1)
+        {
+            break;
+        }
+    }
+
+    closedir(dir);
+    return node;
+}
+
+/**
+ * Free the CPU list held by a plan. The plan may be reused afterwards.
+ * @param plan - The plan to free
+ */
+void affinity_plan_free(AffinityPlan *plan)
+{
+    free(plan->cpus);
+    plan->cpus = NULL;
+    plan->num_cpus = 0;
+}
@@ -0,0 +1,72 @@
+#ifndef AFFINITY_H
+#define AFFINITY_H
+
+
+/*
+ * AffinityPlan - the list of CPUs workers are placed on. Worker i is
+ * pinned to cpus[i % num_cpus]. An empty plan (num_cpus == 0) leaves
+ * placement to the kernel.
+ */
+typedef struct
+{
+    int *cpus;
+    int num_cpus;
+
+} AffinityPlan;
+
+
+/**
+ * Build a plan from an explicit CPU list such as "0-3,8,10-11".
+ * @param plan - The plan to populate
+ * @param cpulist - Comma separated list of CPUs and CPU ranges
+ * @return 0 on success, -1 if the list could not be parsed
+ */
+int affinity_plan_cpus(AffinityPlan *plan, const char *cpulist);
+
+
+/**
+ * Build a plan from a list of NUMA nodes such as "0,1". The CPUs of each
+ * node are interleaved so consecutive workers alternate between nodes.
+ * @param plan - The plan to populate
+ * @param nodelist - Comma separated list of NUMA nodes and node ranges
+ * @return 0 on success, -1 if a node has no CPUs or does not exist
+ */
+int affinity_plan_nodes(AffinityPlan *plan, const char *nodelist);
+
+
+/**
+ * Build a plan from the CPUs servicing a network interface's RX queue
+ * interrupts. Falls back to the CPUs local to the NIC's NUMA node when
+ * the interrupts cannot be found (e.g. virtual interfaces).
+ * @param plan - The plan to populate
+ * @param ifname - Name of the network interface e.g. eth0
+ * @return 0 on success, -1 if no CPUs could be associated with ifname
+ */
+int affinity_plan_nic(AffinityPlan *plan, const char *ifname);
+
+
+/**
+ * Get the CPU a given worker should be pinned to.
+ * @param plan - The plan to consult
+ * @param worker - Index of the worker
+ * @return The CPU number or -1 if the worker should not be pinned
+ */
+int affinity_worker_cpu(const AffinityPlan *plan, int worker);
+
+
+/**
+ * Get the NUMA node that owns a CPU.
+ * @param cpu - The CPU number
+ * @return The node number or -1 if unknown
+ */
+int affinity_cpu_node(int cpu);
+
+
+/**
+ * Free the CPU list held by a plan. The plan may be reused afterwards.
+ * @param plan - The plan to free
+ */
+void affinity_plan_free(AffinityPlan *plan);
+
+
+#endif
@@ -0,0 +1,108 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "arena.h"
+
+#define ALIGNMENT 16
+
+typedef struct Chunk
+{
+    struct Chunk *next;
+    size_t used;
+    size_t size;
+    _Alignas(ALIGNMENT) char data[];
+} Chunk;
+
+struct ArenaStruct
+{
+    Chunk *chunks;
+    size_t chunk_size;
+};
+
+/**
+ * Allocate an arena.
+ * @param chunk_size - Size in bytes of each chunk requested from malloc
+ * @return arena - Pointer to the allocated arena
+ */
+Arena *arena_alloc(size_t chunk_size)
+{
+    Arena *arena = malloc(sizeof(Arena));
+
+    arena->chunks = NULL;
+    arena->chunk_size = chunk_size;
+
+    return arena;
+}
+
+/**
+ * Allocate memory from an arena. The memory is suitably aligned for any
+ * type and is not zeroed.
+ * @param arena - The arena to allocate from
+ * @param size - Number of bytes required
+ * @return Pointer to the memory, valid until the arena is freed
+ */
+void *arena_push(Arena *arena, size_t size)
+{
+    Chunk *chunk = arena->chunks;
+    void *memory;
+
+    // Round up so every allocation starts aligned.
+    size = (size + ALIGNMENT - 1) & ~(size_t)(ALIGNMENT - 1);
+
+    if (chunk == NULL || chunk->size - chunk->used < size)
+    {
+        // Oversized requests get a chunk of their own.
+        size_t capacity = size > arena->chunk_size ? size : arena->chunk_size;
+
+        if ((chunk = malloc(sizeof(Chunk) + capacity)) == NULL)
+        {
+            fprintf(stderr, "malloc() did not return a pointer! Likely out of memory.\n");
+            exit(EXIT_FAILURE);
+        }
+
+        chunk->used = 0;
+        chunk->size = capacity;
+        chunk->next = arena->chunks;
+        arena->chunks = chunk;
+    }
+
+    memory = chunk->data + chunk->used;
+    chunk->used += size;
+
+    return memory;
+}
+
+/**
+ * Copy a string into an arena, NUL terminating the copy.
+ * @param arena - The arena to allocate from
+ * @param s - The string to copy, need not be NUL terminated
+ * @param length - Number of characters to copy
+ * @return Pointer to the copy
+ */
+char *arena_strndup(Arena *arena, const char *s, size_t length)
+{
+    char *copy = arena_push(arena, length + 1);
+
+    memcpy(copy, s, length);
+    copy[length] = '\0';
+
+    return copy;
+}
+
+/**
+ * Free an arena and every allocation made from it.
+ * @param arena - The arena to free
+ */
+void arena_free(Arena *arena)
+{
+    while (arena->chunks)
+    {
+        Chunk *next = arena->chunks->next;
+        free(arena->chunks);
+        arena->chunks = next;
+    }
+
+    free(arena);
+}
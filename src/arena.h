@@ -0,0 +1,50 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+
+/*
+ * Arena - a bump allocator. Memory is carved out of large chunks and is
+ * only released all at once by arena_free. Not thread-safe, give each
+ * thread its own arena.
+ */
+typedef struct ArenaStruct Arena;
+
+
+/**
+ * Allocate an arena.
+ * @param chunk_size - Size in bytes of each chunk requested from malloc
+ * @return arena - Pointer to the allocated arena
+ */
+Arena *arena_alloc(size_t chunk_size);
+
+
+/**
+ * Allocate memory from an arena. The memory is suitably aligned for any
+ * type and is not zeroed.
+ * @param arena - The arena to allocate from
+ * @param size - Number of bytes required
+ * @return Pointer to the memory, valid until the arena is freed
+ */
+void *arena_push(Arena *arena, size_t size);
+
+
+/**
+ * Copy a string into an arena, NUL terminating the copy.
+ * @param arena - The arena to allocate from
+ * @param s - The string to copy, need not be NUL terminated
+ * @param length - Number of characters to copy
+ * @return Pointer to the copy
+ */
+char *arena_strndup(Arena *arena, const char *s, size_t length);
+
+
+/**
+ * Free an arena and every allocation made from it.
+ * @param arena - The arena to free
+ */
+void arena_free(Arena *arena);
+
+
+#endif
@@ -0,0 +1,258 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "cache.h"
+
+#define INITIAL_SLOTS 1024
+#define LINE_SIZE 4096
+
+typedef struct
+{
+    char *url;
+    CacheEntry entry;
+} Record;
+
+struct CacheIndexStruct
+{
+    char *path;
+
+    // Open addressing hash table keyed by url, kept at most half full.
+    pthread_mutex_t lock;
+    Record **records;
+    size_t capacity;
+    size_t count;
+};
+
+// 64 bit FNV-1a.
+static uint64_t hash_url(const char *url)
+{
+    uint64_t hash = 14695981039346656037ULL;
+
+    for (; *url; ++url)
+    {
+        hash ^= (unsigned char)*url;
+        hash *= 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+// Find the slot a url occupies or would occupy. Must be called with the
+// lock held.
+static size_t find_slot(Record **records, size_t capacity, const char *url)
+{
+    size_t index = hash_url(url) & (capacity - 1);
+
+    while (records[index] && strcmp(records[index]->url, url) != 0)
+    {
+        index = (index + 1) & (capacity - 1);
+    }
+
+    return index;
+}
+
+// Insert or replace a record. Must be called with the lock held.
+static void insert(CacheIndex *index, const char *url, const CacheEntry *entry)
+{
+    size_t slot = find_slot(index->records, index->capacity, url);
+
+    if (index->records[slot])
+    {
+        index->records[slot]->entry = *entry;
+        return;
+    }
+
+    index->records[slot] = malloc(sizeof(Record));
+    index->records[slot]->url = strdup(url);
+    index->records[slot]->entry = *entry;
+
+    // Grow the table once it is half full.
+    if (++index->count * 2 > index->capacity)
+    {
+        size_t capacity = index->capacity * 2;
+        Record **records = calloc(capacity, sizeof(Record *));
+
+        for (size_t i = 0; i < index->capacity; ++i)
+        {
+            if (index->records[i])
+            {
+                records[find_slot(records, capacity, index->records[i]->url)] = index->records[i];
+            }
+        }
+
+        free(index->records);
+        index->records = records;
+        index->capacity = capacity;
+    }
+}
+
+// Copy a tab terminated field of a line, advancing past the tab.
+static char *next_field(char *line, char *out, size_t size)
+{
+    char *end = strchr(line, '\t');
+    size_t length;
+
+    if (end == NULL)
+    {
+        return NULL;
+    }
+
+    length = (size_t)(end - line) < size - 1 ? (size_t)(end - line) : size - 1;
+    memcpy(out, line, length);
+    out[length] = '\0';
+
+    return end + 1;
+}
+
+/**
+ * Load an index from disk. A missing file gives an empty index.
+ * @param path - Path of the index file
+ * @return index - Pointer to the loaded index or NULL if it could not be read
+ */
+CacheIndex *cache_load(const char *path)
+{
+    CacheIndex *index = malloc(sizeof(CacheIndex));
+    char line[LINE_SIZE], size[32];
+    FILE *fp;
+
+    index->path = strdup(path);
+    pthread_mutex_init(&index->lock, NULL);
+    index->records = calloc(INITIAL_SLOTS, sizeof(Record *));
+    index->capacity = INITIAL_SLOTS;
+    index->count = 0;
+
+    if ((fp = fopen(path, "r")) == NULL)
+    {
+        if (errno == ENOENT)
+        {
+            return index;
+        }
+        perror("ERROR open cache index");
+        cache_free(index);
+        return NULL;
+    }
+
+    // Each line is: size <tab> etag <tab> last-modified <tab> url
+    while (fgets(line, LINE_SIZE, fp) != NULL)
+    {
+        CacheEntry entry;
+        char *p = line;
+
+        line[strcspn(line, "\n")] = '\0';
+        if ((p = next_field(p, size, sizeof(size))) == NULL ||
+            (p = next_field(p, entry.etag, sizeof(entry.etag))) == NULL ||
+            (p = next_field(p, entry.last_modified, sizeof(entry.last_modified))) == NULL ||
+            *p == '\0')
+        {
+            // Skip damaged lines rather than discarding the whole index.
+            continue;
+        }
+
+        entry.size = strtoull(size, NULL, 10);
+        insert(index, p, &entry);
+    }
+
+    fclose(fp);
+    return index;
+}
+
+/**
+ * Look up the cached metadata of a url. Safe to call from several threads.
+ * @param index - The index to search
+ * @param url - The url to look up
+ * @param entry - Output for a copy of the metadata
+ * @return 0 if the url was found, -1 otherwise
+ */
+int cache_lookup(CacheIndex *index, const char *url, CacheEntry *entry)
+{
+    Record *record;
+
+    pthread_mutex_lock(&index->lock);
+    if ((record = index->records[find_slot(index->records, index->capacity, url)]) != NULL)
+    {
+        *entry = record->entry;
+    }
+    pthread_mutex_unlock(&index->lock);
+
+    return record ? 0 : -1;
+}
+
+/**
+ * Record the metadata of a url that has been completely downloaded,
+ * replacing any previous entry. Safe to call from several threads.
+ * @param index - The index to update
+ * @param url - The url that was downloaded
+ * @param entry - The metadata to record
+ */
+void cache_update(CacheIndex *index, const char *url, const CacheEntry *entry)
+{
+    pthread_mutex_lock(&index->lock);
+    insert(index, url, entry);
+    pthread_mutex_unlock(&index->lock);
+}
+
+/**
+ * Write the index back to the file it was loaded from. The file is
+ * replaced atomically so an interrupted save leaves the old index intact.
+ * @param index - The index to save
+ * @return 0 on success, -1 on failure
+ */
+int cache_save(CacheIndex *index)
+{
+    size_t length = strlen(index->path) + 5;
+    char temp[length];
+    FILE *fp;
+    int rc = 0;
+
+    snprintf(temp, length, "%s.tmp", index->path);
+    if ((fp = fopen(temp, "w")) == NULL)
+    {
+        perror("ERROR open cache index");
+        return -1;
+    }
+
+    pthread_mutex_lock(&index->lock);
+    for (size_t i = 0; i < index->capacity; ++i)
+    {
+        Record *record = index->records[i];
+        if (record)
+        {
+            fprintf(fp, "%llu\t%s\t%s\t%s\n", record->entry.size, record->entry.etag,
+                    record->entry.last_modified, record->url);
+        }
+    }
+    pthread_mutex_unlock(&index->lock);
+
+    if (fclose(fp) != 0 || rename(temp, index->path) != 0)
+    {
+        perror("ERROR save cache index");
+        rc = -1;
+    }
+
+    return rc;
+}
+
+/**
+ * Free an index without saving it.
+ * @param index - The index to free
+ */
+void cache_free(CacheIndex *index)
+{
+    for (size_t i = 0; i < index->capacity; ++i)
+    {
+        if (index->records[i])
+        {
+            free(index->records[i]->url);
+            free(index->records[i]);
+        }
+    }
+
+    pthread_mutex_destroy(&index->lock);
+    free(index->records);
+    free(index->path);
+    free(index);
+}
@@ -0,0 +1,68 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stddef.h>
+
+
+/*
+ * CacheIndex - the size and validators (ETag, Last-Modified) of every url
+ * downloaded by previous runs, persisted as a small tab separated file so
+ * a later run can ask the server whether anything has changed.
+ */
+typedef struct CacheIndexStruct CacheIndex;
+
+// The cached metadata of a single url.
+typedef struct
+{
+    unsigned long long size;
+    char etag[128];
+    char last_modified[64];
+
+} CacheEntry;
+
+
+/**
+ * Load an index from disk. A missing file gives an empty index.
+ * @param path - Path of the index file
+ * @return index - Pointer to the loaded index or NULL if it could not be read
+ */
+CacheIndex *cache_load(const char *path);
+
+
+/**
+ * Look up the cached metadata of a url. Safe to call from several threads.
+ * @param index - The index to search
+ * @param url - The url to look up
+ * @param entry - Output for a copy of the metadata
+ * @return 0 if the url was found, -1 otherwise
+ */
+int cache_lookup(CacheIndex *index, const char *url, CacheEntry *entry);
+
+
+/**
+ * Record the metadata of a url that has been completely downloaded,
+ * replacing any previous entry. Safe to call from several threads.
+ * @param index - The index to update
+ * @param url - The url that was downloaded
+ * @param entry - The metadata to record
+ */
+void cache_update(CacheIndex *index, const char *url, const CacheEntry *entry);
+
+
+/**
+ * Write the index back to the file it was loaded from. The file is
+ * replaced atomically so an interrupted save leaves the old index intact.
+ * @param index - The index to save
+ * @return 0 on success, -1 on failure
+ */
+int cache_save(CacheIndex *index);
+
+
+/**
+ * Free an index without saving it.
+ * @param index - The index to free
+ */
+void cache_free(CacheIndex *index);
+
+
+#endif
@@ -0,0 +1,359 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+
+#include "control.h"
+
+// Longest command line a client may send.
+#define LINE_SIZE 4096
+// Connections waiting to be accepted.
+#define BACKLOG 16
+// Output queued for a client that is not reading before it is disconnected.
+#define OUTBOX_SIZE (16 * LINE_SIZE)
+
+// Signalled whenever output is queued for a client, so the daemon polls
+// for the client becoming writable.
+static int wakeup = -1;
+
+struct ControlClientStruct
+{
+    int fd;
+    int refs;
+    int closed;
+    pthread_mutex_t lock;
+
+    // Received bytes not yet returned as lines. start is the offset of the
+    // first unreturned byte.
+    char buffer[LINE_SIZE];
+    size_t start;
+    size_t length;
+
+    // Output the socket would not take yet, sent once it is writable.
+    char outbox[OUTBOX_SIZE];
+    size_t queued;
+};
+
+/**
+ * Create a Unix domain socket listening at path, replacing any stale
+ * socket left there by a previous daemon.
+ * @param path - Filesystem path of the socket
+ * @return The listening socket or -1 on failure
+ */
+int control_listen(const char *path)
+{
+    struct sockaddr_un addr = {0};
+    int fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "control socket path is too long: %s\n", path);
+        return -1;
+    }
+
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+    {
+        perror("ERROR control socket");
+        return -1;
+    }
+
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, BACKLOG) != 0)
+    {
+        perror("ERROR bind control socket");
+        close(fd);
+        return -1;
+    }
+
+    if (wakeup < 0 && (wakeup = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+    {
+        perror("ERROR eventfd");
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/**
+ * Accept a pending connection on a listening control socket.
+ * @param listenfd - Socket from control_listen
+ * @return client - Pointer to the new client holding one reference, or NULL
+ */
+ControlClient *control_accept(int listenfd)
+{
+    ControlClient *client;
+    int fd;
+
+    // Clients are nonblocking so a client that stops reading can never
+    // stall the worker threads reporting to it.
+    if ((fd = accept4(listenfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) < 0)
+    {
+        perror("ERROR accept");
+        return NULL;
+    }
+
+    client = calloc(1, sizeof(ControlClient));
+    client->fd = fd;
+    client->refs = 1;
+    pthread_mutex_init(&client->lock, NULL);
+
+    return client;
+}
+
+/**
+ * Get the socket of a client, e.g. to poll it.
+ * @param client - The client
+ * @return The client's socket
+ */
+int control_fd(ControlClient *client)
+{
+    return client->fd;
+}
+
+/**
+ * Get a descriptor that becomes readable whenever output is queued for a
+ * client, so the caller can start polling that client for POLLOUT. Drain
+ * it with control_clear_wakeup.
+ * @return The descriptor, or -1 before control_listen
+ */
+int control_wakeup(void)
+{
+    return wakeup;
+}
+
+/**
+ * Reset the descriptor from control_wakeup after it became readable.
+ */
+void control_clear_wakeup(void)
+{
+    eventfd_t value;
+
+    eventfd_read(wakeup, &value);
+}
+
+/**
+ * Read whatever a client has sent into its line buffer. Call when its
+ * socket is readable.
+ * @param client - The client
+ * @return 0 on success, -1 once the client has disconnected or sent an
+ *         overlong line
+ */
+int control_receive(ControlClient *client)
+{
+    ssize_t bytes_read;
+
+    // Move the partial line left over to the front of the buffer.
+    memmove(client->buffer, client->buffer + client->start, client->length - client->start);
+    client->length -= client->start;
+    client->start = 0;
+
+    if (client->length == LINE_SIZE)
+    {
+        fprintf(stderr, "control client sent an overlong line\n");
+        return -1;
+    }
+
+    bytes_read = read(client->fd, client->buffer + client->length, LINE_SIZE - client->length);
+    if (bytes_read <= 0)
+    {
+        return bytes_read < 0 && (errno == EINTR || errno == EAGAIN) ? 0 : -1;
+    }
+
+    client->length += bytes_read;
+    return 0;
+}
+
+/**
+ * Take the next complete line received from a client.
+ * @param client - The client
+ * @return The line without its newline, valid until the next call to
+ *         control_receive, or NULL if no complete line is buffered
+ */
+char *control_next_line(ControlClient *client)
+{
+    char *line = client->buffer + client->start;
+    char *eol = memchr(line, '\n', client->length - client->start);
+
+    if (eol == NULL)
+    {
+        return NULL;
+    }
+
+    *eol = '\0';
+    if (eol > line && eol[-1] == '\r')
+    {
+        eol[-1] = '\0';
+    }
+    client->start = eol + 1 - client->buffer;
+
+    return line;
+}
+
+// Disconnect a client. Called with its lock held.
+static void disconnect(ControlClient *client)
+{
+    client->closed = 1;
+    client->queued = 0;
+    shutdown(client->fd, SHUT_RDWR);
+}
+
+// Send as much of a client's queued output as its socket takes without
+// blocking. Called with its lock held.
+static void send_queued(ControlClient *client)
+{
+    size_t sent = 0;
+
+    while (!client->closed && sent < client->queued)
+    {
+        ssize_t rc = send(client->fd, client->outbox + sent, client->queued - sent, MSG_NOSIGNAL);
+
+        if (rc >= 0)
+        {
+            sent += rc;
+        }
+        else if (errno == EAGAIN)
+        {
+            break;
+        }
+        else if (errno != EINTR)
+        {
+            disconnect(client);
+        }
+    }
+
+    if (!client->closed)
+    {
+        memmove(client->outbox, client->outbox + sent, client->queued - sent);
+        client->queued -= sent;
+    }
+}
+
+/**
+ * Queue a formatted line for a client and send what its socket takes
+ * without blocking. A client whose queued output would exceed its outbox
+ * has stopped reading and is disconnected. Safe to call from several
+ * threads.
+ * @param client - The client, or NULL to do nothing
+ * @param format - printf style format of the line, without the newline
+ */
+void control_send(ControlClient *client, const char *format, ...)
+{
+    char line[LINE_SIZE];
+    va_list args;
+    int length;
+
+    if (client == NULL)
+    {
+        return;
+    }
+
+    va_start(args, format);
+    length = vsnprintf(line, LINE_SIZE - 1, format, args);
+    va_end(args);
+
+    if (length > LINE_SIZE - 2)
+    {
+        length = LINE_SIZE - 2;
+    }
+    line[length++] = '\n';
+
+    // Whole lines are queued under the lock so events from different
+    // workers never interleave. A client that has gone away is ignored.
+    pthread_mutex_lock(&client->lock);
+    if (!client->closed && client->queued + length > OUTBOX_SIZE)
+    {
+        fprintf(stderr, "control client is not reading, disconnecting it\n");
+        disconnect(client);
+    }
+    if (!client->closed)
+    {
+        memcpy(client->outbox + client->queued, line, length);
+        client->queued += length;
+        send_queued(client);
+        if (client->queued > 0 && wakeup >= 0)
+        {
+            eventfd_write(wakeup, 1);
+        }
+    }
+    pthread_mutex_unlock(&client->lock);
+}
+
+/**
+ * Check whether a client has output waiting for its socket to become
+ * writable.
+ * @param client - The client
+ * @return 1 if output is queued, otherwise 0
+ */
+int control_pending(ControlClient *client)
+{
+    int pending;
+
+    pthread_mutex_lock(&client->lock);
+    pending = client->queued > 0;
+    pthread_mutex_unlock(&client->lock);
+
+    return pending;
+}
+
+/**
+ * Send a client's queued output. Call when its socket is writable.
+ * @param client - The client
+ */
+void control_flush(ControlClient *client)
+{
+    pthread_mutex_lock(&client->lock);
+    send_queued(client);
+    pthread_mutex_unlock(&client->lock);
+}
+
+/**
+ * Take an additional reference to a client.
+ * @param client - The client
+ */
+void control_retain(ControlClient *client)
+{
+    __atomic_add_fetch(&client->refs, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Drop a reference to a client, freeing it with the last one.
+ * @param client - The client, or NULL to do nothing
+ */
+void control_release(ControlClient *client)
+{
+    if (client == NULL || __atomic_sub_fetch(&client->refs, 1, __ATOMIC_ACQ_REL) != 0)
+    {
+        return;
+    }
+
+    close(client->fd);
+    pthread_mutex_destroy(&client->lock);
+    free(client);
+}
+
+/**
+ * Disconnect a client and drop the caller's reference. Output still
+ * queued is sent if the socket takes it now, later events are dropped.
+ * @param client - The client
+ */
+void control_close(ControlClient *client)
+{
+    // Give any last lines queued a final chance to go out.
+    pthread_mutex_lock(&client->lock);
+    send_queued(client);
+    disconnect(client);
+    pthread_mutex_unlock(&client->lock);
+
+    control_release(client);
+}
@@ -0,0 +1,127 @@
+#ifndef CONTROL_H
+#define CONTROL_H
+
+#include <stddef.h>
+
+
+/*
+ * ControlClient - a connection to the daemon's Unix domain control
+ * socket. Commands arrive as newline terminated lines and replies and
+ * events are sent back as lines. A client is reference counted so jobs
+ * it submitted can keep reporting to it from worker threads; once it has
+ * disconnected, events sent to it are dropped. Client sockets never block:
+ * output the socket will not take yet is queued, and a client that lets
+ * its queue fill up is disconnected.
+ */
+typedef struct ControlClientStruct ControlClient;
+
+
+/**
+ * Create a Unix domain socket listening at path, replacing any stale
+ * socket left there by a previous daemon.
+ * @param path - Filesystem path of the socket
+ * @return The listening socket or -1 on failure
+ */
+int control_listen(const char *path);
+
+
+/**
+ * Accept a pending connection on a listening control socket.
+ * @param listenfd - Socket from control_listen
+ * @return client - Pointer to the new client holding one reference, or NULL
+ */
+ControlClient *control_accept(int listenfd);
+
+
+/**
+ * Get the socket of a client, e.g. to poll it.
+ * @param client - The client
+ * @return The client's socket
+ */
+int control_fd(ControlClient *client);
+
+
+/**
+ * Get a descriptor that becomes readable whenever output is queued for a
+ * client, so the caller can start polling that client for POLLOUT. Drain
+ * it with control_clear_wakeup.
+ * @return The descriptor, or -1 before control_listen
+ */
+int control_wakeup(void);
+
+
+/**
+ * Reset the descriptor from control_wakeup after it became readable.
+ */
+void control_clear_wakeup(void);
+
+
+/**
+ * Read whatever a client has sent into its line buffer. Call when its
+ * socket is readable.
+ * @param client - The client
+ * @return 0 on success, -1 once the client has disconnected or sent an
+ *         overlong line
+ */
+int control_receive(ControlClient *client);
+
+
+/**
+ * Take the next complete line received from a client.
+ * @param client - The client
+ * @return The line without its newline, valid until the next call to
+ *         control_receive, or NULL if no complete line is buffered
+ */
+char *control_next_line(ControlClient *client);
+
+
+/**
+ * Queue a formatted line for a client and send what its socket takes
+ * without blocking. A client whose queued output would exceed its outbox
+ * has stopped reading and is disconnected. Safe to call from several
+ * threads.
+ * @param client - The client, or NULL to do nothing
+ * @param format - printf style format of the line, without the newline
+ */
+void control_send(ControlClient *client, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+
+/**
+ * Check whether a client has output waiting for its socket to become
+ * writable.
+ * @param client - The client
+ * @return 1 if output is queued, otherwise 0
+ */
+int control_pending(ControlClient *client);
+
+
+/**
+ * Send a client's queued output. Call when its socket is writable.
+ * @param client - The client
+ */
+void control_flush(ControlClient *client);
+
+
+/**
+ * Take an additional reference to a client.
+ * @param client - The client
+ */
+void control_retain(ControlClient *client);
+
+
+/**
+ * Drop a reference to a client, freeing it with the last one.
+ * @param client - The client, or NULL to do nothing
+ */
+void control_release(ControlClient *client);
+
+
+/**
+ * Disconnect a client and drop the caller's reference. Output still
+ * queued is sent if the socket takes it now, later events are dropped.
+ * @param client - The client
+ */
+void control_close(ControlClient *client);
+
+
+#endif
@@ -0,0 +1,178 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "decode.h"
+
+// Size in bytes of the buffer decoded data passes through (Default = 64KB)
+#define DECODE_BUFFER_BYTES 65536
+
+// zlib window bits selecting the wrapper to expect.
+#define WINDOW_GZIP (15 + 16)
+#define WINDOW_AUTO (15 + 32)
+
+struct DecoderStruct
+{
+    int fd;
+    off_t offset;
+
+    // identity codings are written through unchanged.
+    int inflating;
+    int finished;
+    z_stream stream;
+    unsigned char *out;
+};
+
+/**
+ * Determine whether a content coding can be decoded.
+ * @param encoding - Value of a Content-Encoding header, empty for none
+ * @return 1 if supported, 0 otherwise
+ */
+int decoder_supports(const char *encoding)
+{
+    return encoding[0] == '\0' || strcasecmp(encoding, "identity") == 0 || strcasecmp(encoding, "gzip") == 0 ||
+           strcasecmp(encoding, "x-gzip") == 0 || strcasecmp(encoding, "deflate") == 0;
+}
+
+// Write a whole buffer at the decoder's offset.
+static int write_all(Decoder *decoder, const void *data, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t written = pwrite(decoder->fd, data, length, decoder->offset);
+
+        if (written <= 0)
+        {
+            perror("ERROR pwrite");
+            return -1;
+        }
+        decoder->offset += written;
+        data = (const char *)data + written;
+        length -= written;
+    }
+
+    return 0;
+}
+
+/**
+ * Create a decoder writing to the start of a file.
+ * @param encoding - Value of the response's Content-Encoding header,
+ *                   empty or "identity" to copy the body unchanged
+ * @param fd - File descriptor to write the decoded bytes to
+ * @return decoder - Pointer to the decoder or NULL if the coding is not supported
+ */
+Decoder *decoder_alloc(const char *encoding, int fd)
+{
+    Decoder *decoder;
+
+    if (!decoder_supports(encoding))
+    {
+        fprintf(stderr, "unsupported content encoding: %s\n", encoding);
+        return NULL;
+    }
+
+    decoder = calloc(1, sizeof(Decoder));
+    decoder->fd = fd;
+
+    if (encoding[0] == '\0' || strcasecmp(encoding, "identity") == 0)
+    {
+        return decoder;
+    }
+
+    // Servers disagree on whether deflate means a zlib or raw stream, so
+    // let zlib detect the wrapper. gzip is always gzip.
+    decoder->inflating = 1;
+    decoder->out = malloc(DECODE_BUFFER_BYTES);
+    if (inflateInit2(&decoder->stream, strcasecmp(encoding, "deflate") == 0 ? WINDOW_AUTO : WINDOW_GZIP) != Z_OK)
+    {
+        fprintf(stderr, "could not initialise zlib\n");
+        free(decoder->out);
+        free(decoder);
+        return NULL;
+    }
+
+    return decoder;
+}
+
+/**
+ * Decode the next part of a body and write the result to the file.
+ * @param decoder - The decoder
+ * @param data - Encoded bytes, in order
+ * @param length - Number of encoded bytes
+ * @return 0 on success, -1 if the data is corrupt or could not be written
+ */
+int decoder_write(Decoder *decoder, const char *data, size_t length)
+{
+    if (!decoder->inflating)
+    {
+        return write_all(decoder, data, length);
+    }
+
+    decoder->stream.next_in = (unsigned char *)data;
+    decoder->stream.avail_in = length;
+
+    // Drain the input through the fixed size output buffer.
+    while (decoder->stream.avail_in > 0 && !decoder->finished)
+    {
+        int rc;
+
+        decoder->stream.next_out = decoder->out;
+        decoder->stream.avail_out = DECODE_BUFFER_BYTES;
+
+        rc = inflate(&decoder->stream, Z_NO_FLUSH);
+        if (rc != Z_OK && rc != Z_STREAM_END)
+        {
+            fprintf(stderr, "ERROR inflate: %s\n", decoder->stream.msg ? decoder->stream.msg : "corrupt data");
+            return -1;
+        }
+
+        if (write_all(decoder, decoder->out, DECODE_BUFFER_BYTES - decoder->stream.avail_out) != 0)
+        {
+            return -1;
+        }
+        decoder->finished = rc == Z_STREAM_END;
+    }
+
+    return 0;
+}
+
+/**
+ * Check the whole body was decoded and truncate the file to the decoded
+ * size, discarding anything left by an earlier attempt.
+ * @param decoder - The decoder
+ * @return The number of decoded bytes written, or -1 if the body was incomplete
+ */
+ssize_t decoder_finish(Decoder *decoder)
+{
+    if (decoder->inflating && !decoder->finished)
+    {
+        fprintf(stderr, "ERROR inflate: compressed body ended early\n");
+        return -1;
+    }
+
+    if (ftruncate(decoder->fd, decoder->offset) != 0)
+    {
+        perror("ERROR ftruncate");
+        return -1;
+    }
+
+    return decoder->offset;
+}
+
+/**
+ * Free a decoder. The file descriptor is not closed.
+ * @param decoder - The decoder to free
+ */
+void decoder_free(Decoder *decoder)
+{
+    if (decoder->inflating)
+    {
+        inflateEnd(&decoder->stream);
+        free(decoder->out);
+    }
+
+    free(decoder);
+}
@@ -0,0 +1,63 @@
+#ifndef DECODE_H
+#define DECODE_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+
+/*
+ * Decoder - streams the body of a response with a Content-Encoding into
+ * a file, decompressing it through a fixed size buffer so memory use does
+ * not grow with the size of the file.
+ */
+typedef struct DecoderStruct Decoder;
+
+// Content codings to list in Accept-Encoding, most preferred first.
+#define DECODE_ACCEPT "gzip, deflate"
+
+
+/**
+ * Determine whether a content coding can be decoded.
+ * @param encoding - Value of a Content-Encoding header, empty for none
+ * @return 1 if supported, 0 otherwise
+ */
+int decoder_supports(const char *encoding);
+
+
+/**
+ * Create a decoder writing to the start of a file.
+ * @param encoding - Value of the response's Content-Encoding header,
+ *                   empty or "identity" to copy the body unchanged
+ * @param fd - File descriptor to write the decoded bytes to
+ * @return decoder - Pointer to the decoder or NULL if the coding is not supported
+ */
+Decoder *decoder_alloc(const char *encoding, int fd);
+
+
+/**
+ * Decode the next part of a body and write the result to the file.
+ * @param decoder - The decoder
+ * @param data - Encoded bytes, in order
+ * @param length - Number of encoded bytes
+ * @return 0 on success, -1 if the data is corrupt or could not be written
+ */
+int decoder_write(Decoder *decoder, const char *data, size_t length);
+
+
+/**
+ * Check the whole body was decoded and truncate the file to the decoded
+ * size, discarding anything left by an earlier attempt.
+ * @param decoder - The decoder
+ * @return The number of decoded bytes written, or -1 if the body was incomplete
+ */
+ssize_t decoder_finish(Decoder *decoder);
+
+
+/**
+ * Free a decoder. The file descriptor is not closed.
+ * @param decoder - The decoder to free
+ */
+void decoder_free(Decoder *decoder);
+
+
+#endif
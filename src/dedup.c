@@ -0,0 +1,222 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "dedup.h"
+
+#define INITIAL_SLOTS 256
+
+typedef struct
+{
+    char *key;
+    const char *url;
+    int done;
+
+    // Files waiting for the object to finish downloading.
+    void **aliases;
+    int num_aliases;
+    int capacity;
+} Object;
+
+struct DedupTableStruct
+{
+    // Open addressing hash table keyed by identity, kept at most half full.
+    pthread_mutex_t lock;
+    Object **objects;
+    size_t capacity;
+    size_t count;
+};
+
+// 64 bit FNV-1a.
+static uint64_t hash_key(const char *key)
+{
+    uint64_t hash = 14695981039346656037ULL;
+
+    for (; *key; ++key)
+    {
+        hash ^= (unsigned char)*key;
+        hash *= 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+// Find the slot a key occupies or would occupy. Must be called with the
+// lock held.
+static size_t find_slot(Object **objects, size_t capacity, const char *key)
+{
+    size_t index = hash_key(key) & (capacity - 1);
+
+    while (objects[index] && strcmp(objects[index]->key, key) != 0)
+    {
+        index = (index + 1) & (capacity - 1);
+    }
+
+    return index;
+}
+
+// Insert a new object. Must be called with the lock held.
+static void insert(DedupTable *table, size_t slot, const char *key, const char *url)
+{
+    table->objects[slot] = calloc(1, sizeof(Object));
+    table->objects[slot]->key = strdup(key);
+    table->objects[slot]->url = url;
+
+    // Grow the table once it is half full.
+    if (++table->count * 2 > table->capacity)
+    {
+        size_t capacity = table->capacity * 2;
+        Object **objects = calloc(capacity, sizeof(Object *));
+
+        for (size_t i = 0; i < table->capacity; ++i)
+        {
+            if (table->objects[i])
+            {
+                objects[find_slot(objects, capacity, table->objects[i]->key)] = table->objects[i];
+            }
+        }
+
+        free(table->objects);
+        table->objects = objects;
+        table->capacity = capacity;
+    }
+}
+
+/**
+ * Create an empty table.
+ * @return table - Pointer to the new table
+ */
+DedupTable *dedup_alloc(void)
+{
+    DedupTable *table = malloc(sizeof(DedupTable));
+
+    pthread_mutex_init(&table->lock, NULL);
+    table->objects = calloc(INITIAL_SLOTS, sizeof(Object *));
+    table->capacity = INITIAL_SLOTS;
+    table->count = 0;
+
+    return table;
+}
+
+/**
+ * Claim an object identity for a file. Safe to call from several threads.
+ * @param table - The table to search
+ * @param key - Identity of the object
+ * @param url - Url naming the file, recorded if this is the first claim.
+ *              Must outlive the table.
+ * @param alias - Caller data queued for dedup_finish if the object is
+ *                still being downloaded
+ * @param primary - Output for the url of the file holding the object when
+ *                  DEDUP_DONE is returned
+ * @return DEDUP_UNIQUE, DEDUP_PENDING or DEDUP_DONE
+ */
+int dedup_claim(DedupTable *table, const char *key, const char *url, void *alias, const char **primary)
+{
+    Object *object;
+    size_t slot;
+    int rc;
+
+    pthread_mutex_lock(&table->lock);
+
+    slot = find_slot(table->objects, table->capacity, key);
+    if ((object = table->objects[slot]) == NULL)
+    {
+        insert(table, slot, key, url);
+        rc = DEDUP_UNIQUE;
+    }
+    else if (object->done)
+    {
+        *primary = object->url;
+        rc = DEDUP_DONE;
+    }
+    else
+    {
+        if (object->num_aliases == object->capacity)
+        {
+            object->capacity = object->capacity ? object->capacity * 2 : 4;
+            object->aliases = realloc(object->aliases, sizeof(void *) * object->capacity);
+        }
+        object->aliases[object->num_aliases++] = alias;
+        rc = DEDUP_PENDING;
+    }
+
+    pthread_mutex_unlock(&table->lock);
+    return rc;
+}
+
+/**
+ * Record the outcome of downloading a claimed object. On failure the
+ * identity is forgotten so a later file with it is downloaded again.
+ * @param table - The table to update
+ * @param key - Identity of the object
+ * @param ok - Non-zero if the object was downloaded completely
+ * @param aliases - Output for the array of queued aliases, to be freed
+ *                  by the caller
+ * @return The number of queued aliases
+ */
+int dedup_finish(DedupTable *table, const char *key, int ok, void ***aliases)
+{
+    Object *object;
+    size_t slot;
+    int count;
+
+    pthread_mutex_lock(&table->lock);
+
+    slot = find_slot(table->objects, table->capacity, key);
+    if ((object = table->objects[slot]) == NULL)
+    {
+        pthread_mutex_unlock(&table->lock);
+        *aliases = NULL;
+        return 0;
+    }
+
+    *aliases = object->aliases;
+    count = object->num_aliases;
+    object->aliases = NULL;
+    object->num_aliases = object->capacity = 0;
+    object->done = 1;
+
+    if (!ok)
+    {
+        // Removing from a linear probing table requires re-inserting the
+        // rest of the cluster so later lookups still find their keys.
+        free(object->key);
+        free(object);
+        table->objects[slot] = NULL;
+        --table->count;
+
+        for (size_t i = (slot + 1) & (table->capacity - 1); table->objects[i]; i = (i + 1) & (table->capacity - 1))
+        {
+            Object *moved = table->objects[i];
+
+            table->objects[i] = NULL;
+            table->objects[find_slot(table->objects, table->capacity, moved->key)] = moved;
+        }
+    }
+
+    pthread_mutex_unlock(&table->lock);
+    return count;
+}
+
+/**
+ * Free a table. Any aliases still queued are not freed.
+ * @param table - The table to free
+ */
+void dedup_free(DedupTable *table)
+{
+    for (size_t i = 0; i < table->capacity; ++i)
+    {
+        if (table->objects[i])
+        {
+            free(table->objects[i]->key);
+            free(table->objects[i]->aliases);
+            free(table->objects[i]);
+        }
+    }
+
+    pthread_mutex_destroy(&table->lock);
+    free(table->objects);
+    free(table);
+}
@@ -0,0 +1,67 @@
+#ifndef DEDUP_H
+#define DEDUP_H
+
+#include <stddef.h>
+
+
+/*
+ * DedupTable - the objects downloaded during a run, keyed by their
+ * identity (e.g. a digest listed in the url_file, or the size and ETag
+ * of the resource a url resolved to). The
+ * first file claiming an identity is downloaded, every later file with
+ * the same identity is materialized from it instead.
+ */
+typedef struct DedupTableStruct DedupTable;
+
+// Outcomes of dedup_claim.
+enum
+{
+    DEDUP_UNIQUE,  // First claim, the caller downloads the object
+    DEDUP_PENDING, // The object is being downloaded, the alias was queued
+    DEDUP_DONE,    // The object has already been downloaded
+};
+
+
+/**
+ * Create an empty table.
+ * @return table - Pointer to the new table
+ */
+DedupTable *dedup_alloc(void);
+
+
+/**
+ * Claim an object identity for a file. Safe to call from several threads.
+ * @param table - The table to search
+ * @param key - Identity of the object
+ * @param url - Url naming the file, recorded if this is the first claim.
+ *              Must outlive the table.
+ * @param alias - Caller data queued for dedup_finish if the object is
+ *                still being downloaded
+ * @param primary - Output for the url of the file holding the object when
+ *                  DEDUP_DONE is returned
+ * @return DEDUP_UNIQUE, DEDUP_PENDING or DEDUP_DONE
+ */
+int dedup_claim(DedupTable *table, const char *key, const char *url, void *alias, const char **primary);
+
+
+/**
+ * Record the outcome of downloading a claimed object. On failure the
+ * identity is forgotten so a later file with it is downloaded again.
+ * @param table - The table to update
+ * @param key - Identity of the object
+ * @param ok - Non-zero if the object was downloaded completely
+ * @param aliases - Output for the array of queued aliases, to be freed
+ *                  by the caller
+ * @return The number of queued aliases
+ */
+int dedup_finish(DedupTable *table, const char *key, int ok, void ***aliases);
+
+
+/**
+ * Free a table. Any aliases still queued are not freed.
+ * @param table - The table to free
+ */
+void dedup_free(DedupTable *table);
+
+
+#endif
@@ -1,3 +1,5 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
@@ -7,324 +9,576 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <sched.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <getopt.h>
+#include <poll.h>
+#include <time.h>
 
 #include "http.h"
-#include "queue.h"
-
-#define FILE_SIZE 256
-
-typedef struct
-{
-    char *url;
-    int min_range;
-    int max_range;
-    Buffer *result;
-    int fd;
-    char *id;
-} Task;
-
-typedef struct
-{
-    Queue *todo;
-
-    pthread_t *threads;
-    int num_workers;
-
-} Context;
-
-void create_directory(const char *dir)
+#include "affinity.h"
+#include "metrics.h"
+#include "mirror.h"
+#include "control.h"
+#include "tls.h"
+#include "libdownloader.h"
+
+// The most control connections a daemon serves at once
+#define MAX_CLIENTS 64
+// The most jobs listed in reply to a status command
+#define MAX_STATUS 256
+// How often a daemon that is shutting down checks whether its jobs are done
+#define SHUTDOWN_POLL_MS 100
+// How long a daemon that has shut down waits for clients to read their output
+#define DRAIN_TIMEOUT_MS 5000
+
+static const char *outcome_names[DOWNLOAD_NUM_OUTCOMES] = {"ok", "failed", "unchanged", "duplicate", "cancelled"};
+static const char *sync_names[] = {"none", "file", "range"};
+
+// Find a name in a table, returning its index or -1.
+int find_name(const char **names, int count, const char *name)
 {
-    struct stat st = {0};
-
-    if (stat(dir, &st) == -1)
+    for (int i = 0; i < count; ++i)
     {
-        int rc = mkdir(dir, 0700);
-        if (rc == -1)
+        if (strcmp(names[i], name) == 0)
         {
-            perror("ERROR mkdir");
-            exit(EXIT_FAILURE);
+            return i;
         }
     }
+    return -1;
 }
 
-void free_task(Task *task)
+void usage(void)
 {
+    fprintf(stderr, "usage: ./downloader [options] url_file num_workers download_dir\n"
+                    "       ./downloader [options] --daemon SOCKET num_workers\n"
+                    "  -c, --cpus LIST     pin workers to the CPUs in LIST e.g. 0-3,8\n"
+                    "  -n, --nodes LIST    pin workers to the CPUs of the NUMA nodes in LIST\n"
+                    "  -i, --nic IFNAME    pin workers to the CPUs servicing IFNAME's RX queues\n"
+                    "  -p, --profile NAME  socket profile preset: default or wan (high bandwidth, high latency)\n"
+                    "  --rcvbuf BYTES      socket receive buffer size, 0 for kernel autotuning\n"
+                    "  --read-size BYTES   maximum bytes per read from a socket\n"
+                    "  --no-nodelay        do not set TCP_NODELAY on requests\n"
+                    "  --quickack          set TCP_QUICKACK while receiving\n"
+                    "  --connect-timeout MS, --read-timeout MS\n"
+                    "                      give up on unresponsive servers, 0 waits forever\n"
+                    "  --congestion NAME   TCP congestion control algorithm e.g. bbr\n"
+                    "  --ca-file PATH      trust the PEM certificates in PATH for https urls instead of the system store\n"
+                    "  --insecure          do not verify the certificates of https servers\n"
+                    "  --ktls              offload TLS record encryption to the kernel when it supports it\n"
+                    "  --cache-dir DIR     keep completed files in DIR and link them into download_dir\n"
+                    "  --no-cache          always download every file, ignoring previous runs\n"
+                    "  --dedup             download identical files (same digest, or same location, size and ETag) once\n"
+                    "  --compress          accept gzip/deflate for whole files and decompress them on the fly\n"
+                    "  --inflight-tasks N, --inflight-bytes BYTES\n"
+                    "                      plan at most N range tasks or BYTES ahead of the workers, 0 for no limit\n"
+                    "                      (default 256 tasks, 1GB)\n"
+                    "  --hedge PERCENT     request the tail of a slow range again on a fresh connection once every range\n"
+                    "                      of its file has started, re-requesting at most PERCENT of each file's size\n"
+                    "  --fsync POLICY      flush files to disk: none (default), file once complete, or range after every write\n"
+                    "  --daemon SOCKET     keep the workers running and take jobs from a Unix socket:\n"
+                    "                        submit URL_FILE DOWNLOAD_DIR, cancel JOB, status, metrics, shutdown\n"
+                    "each url_file line: URL [MIRROR...] [ALGO:DIGEST] [priority=high|normal|bulk] [deadline=SECONDS]\n"
+                    "  where each URL is [http://|https://]HOST[:PORT]/PATH[?QUERY], HOST may be an [IPv6] literal\n");
+    exit(1);
+}
 
-    if (task->result)
+// Socket options without a short form.
+enum
+{
+    OPT_RCVBUF = 256,
+    OPT_READ_SIZE,
+    OPT_NO_NODELAY,
+    OPT_QUICKACK,
+    OPT_CONNECT_TIMEOUT,
+    OPT_READ_TIMEOUT,
+    OPT_CONGESTION,
+    OPT_CACHE_DIR,
+    OPT_NO_CACHE,
+    OPT_DEDUP,
+    OPT_COMPRESS,
+    OPT_DAEMON,
+    OPT_INFLIGHT_TASKS,
+    OPT_INFLIGHT_BYTES,
+    OPT_FSYNC,
+    OPT_CA_FILE,
+    OPT_INSECURE,
+    OPT_KTLS,
+    OPT_HEDGE,
+};
+
+// Apply a named socket profile preset on top of the defaults.
+int set_profile_preset(SocketProfile *profile, const char *name)
+{
+    if (strcmp(name, "default") == 0)
     {
-        free(task->result->data);
-        free(task->result);
+        return 0;
     }
 
-    free(task->id);
-    free(task->url);
-    free(task);
+    if (strcmp(name, "wan") == 0)
+    {
+        // Long fat networks need a window of at least the bandwidth-delay
+        // product and a congestion control that does not collapse on the
+        // occasional loss.
+        profile->rcvbuf = 16 * 1048576;
+        profile->read_size = 262144;
+        profile->quickack = 1;
+        profile->connect_timeout_ms = 30000;
+        profile->read_timeout_ms = 60000;
+        strcpy(profile->congestion, "bbr");
+        return 0;
+    }
+
+    return -1;
+}
+
+// Report each finished file of a daemon job to the client that submitted it.
+void report_file(void *arg, int job, const char *url, int outcome)
+{
+    control_send((ControlClient *)arg, "file %d %s %s", job, outcome_names[outcome], url);
+}
+
+// Report a finished daemon job and drop its reference to the client.
+void report_done(void *arg, int job, const int *counts)
+{
+    ControlClient *client = (ControlClient *)arg;
+
+    control_send(client, "done %d %d ok %d failed %d unchanged %d duplicate %d cancelled", job,
+                 counts[DOWNLOAD_OK], counts[DOWNLOAD_FAILED], counts[DOWNLOAD_UNCHANGED],
+                 counts[DOWNLOAD_DUPLICATE], counts[DOWNLOAD_CANCELLED]);
+    control_release(client);
 }
 
-void *worker_thread(void *arg)
+// Run one command from a control client. Returns 1 if the daemon should
+// shut down.
+int run_command(Downloader *downloader, const DownloadOptions *settings, ControlClient *client, char *line)
 {
-    Context *context = (Context *)arg;
+    char *command = strtok(line, " \t"), *arg1 = strtok(NULL, " \t"), *arg2 = strtok(NULL, " \t");
 
-    Task *task = (Task *)queue_get(context->todo);
-    char *range = (char *)malloc(1024);
+    if (command == NULL)
+    {
+        return 0;
+    }
 
-    while (task)
+    if (strcmp(command, "submit") == 0 && arg1 && arg2)
     {
-        snprintf(range, 1024, "%d-%d", task->min_range, task->max_range);
-        task->result = http_url(task->url, range);
+        DownloadCallbacks callbacks = {.complete = report_file, .done = report_done, .arg = client};
+        int job;
 
-        if (task->result)
+        // Each job holds a reference to its client until it is done.
+        control_retain(client);
+        if ((job = downloader_submit_file(downloader, arg1, arg2, settings, &callbacks)) < 0)
         {
-            // Strip the header information from the Buffer.
-            char *data = http_get_content(task->result);
-            if (data)
-            {
-                size_t length = task->result->length - (data - task->result->data);
-                printf("[%s] downloaded %zu bytes from %s\n", task->id, length, task->url);
-
-                // Write the Buffer to the provided file descriptor. pwrite() is thread-safe
-                // and can write to a file with an offset. This task has downloaded the bytes
-                // for its byte range, therefore, its byte range is unique. The minimum of the
-                // byte range is the offset to start writing at which will not confict with other
-                // concurrent write requests to the file.
-                ssize_t written_bytes = pwrite(task->fd, data, length, task->min_range);
-                if (written_bytes == -1)
-                {
-                    // The operating system did not allow the bytes to be written into the buffer for the
-                    // file descriptor.
-                    perror("ERROR pwrite");
-                    fprintf(stderr, "[%s] ERROR | could not write bytes to file for: %s\n", task->id, task->url);
-                }
-                else if (written_bytes != length)
-                {
-                    // Not all downloaded bytes were written to the file. This will likely result in file corruption
-                    fprintf(stderr, "[%s] CORRUPTION | only %zd of %zu bytes were written to file for: %s\n", task->id, written_bytes, length, task->url);
-                }
-            }
-            else
-            {
-                fprintf(stderr, "ERROR | downloading: %s\n", task->url);
-            }
+            control_release(client);
+            control_send(client, "error could not open %s for %s", arg1, arg2);
+            return 0;
+        }
+        control_send(client, "queued %d", job);
+    }
+    else if (strcmp(command, "cancel") == 0 && arg1)
+    {
+        if (downloader_cancel(downloader, atoi(arg1)) == 0)
+        {
+            control_send(client, "cancelling %d", atoi(arg1));
         }
         else
         {
-            fprintf(stderr, "ERROR | downloading: %s\n", task->url);
+            control_send(client, "error no job %s", arg1);
         }
-
-        free_task(task);
-        task = (Task *)queue_get(context->todo);
     }
+    else if (strcmp(command, "status") == 0)
+    {
+        DownloadStatus status[MAX_STATUS];
+        int count = downloader_jobs(downloader, status, MAX_STATUS);
 
-    free(range);
-    return NULL;
-}
-
-Context *spawn_workers(int num_workers)
-{
-    Context *context = malloc(sizeof(Context));
-
-    context->todo = queue_alloc(num_workers * 2);
-    context->num_workers = num_workers;
-    context->threads = (pthread_t *)malloc(sizeof(pthread_t) * num_workers);
-
-    for (int i = 0; i < num_workers; ++i)
+        for (int i = 0; i < count && i < MAX_STATUS; ++i)
+        {
+            control_send(client, "job %d %zu files %zu pending", status[i].job, status[i].files, status[i].pending);
+        }
+        control_send(client, "end");
+    }
+    else if (strcmp(command, "metrics") == 0)
     {
-        if (pthread_create(&context->threads[i], NULL, worker_thread, context) != 0)
+        char *report = NULL, *saveptr = NULL;
+        size_t size;
+        FILE *out = open_memstream(&report, &size);
+
+        metrics_report(out);
+        fclose(out);
+        for (char *l = strtok_r(report, "\n", &saveptr); l; l = strtok_r(NULL, "\n", &saveptr))
         {
-            perror("ERROR pthread_create");
-            exit(EXIT_FAILURE);
+            control_send(client, "%s", l);
         }
+        free(report);
+        control_send(client, "end");
+    }
+    else if (strcmp(command, "shutdown") == 0)
+    {
+        return 1;
+    }
+    else
+    {
+        control_send(client, "error unknown command: %s", command);
     }
 
-    return context;
+    return 0;
 }
 
-void free_workers(Context *context)
+// Serve the control socket until a client asks the daemon to shut down,
+// then let the jobs in progress finish. The worker pool and mirror
+// statistics stay warm between jobs, as do hostname resolutions until
+// they expire.
+int run_daemon(Downloader *downloader, const DownloadOptions *settings, const char *path)
 {
-    for (int i = 0; i < context->num_workers; ++i)
+    // The listening socket and the wakeup for queued output come before
+    // the clients.
+    struct pollfd fds[MAX_CLIENTS + 2];
+    ControlClient *clients[MAX_CLIENTS + 2] = {NULL}, *requester = NULL;
+    int nfds = 2, stop = 0;
+
+    if ((fds[0].fd = control_listen(path)) < 0)
     {
-        queue_put(context->todo, NULL);
+        return EXIT_FAILURE;
     }
+    fds[0].events = POLLIN;
+    fds[1].fd = control_wakeup();
+    fds[1].events = POLLIN;
+    printf("listening on %s\n", path);
+    fflush(stdout);
 
-    for (int i = 0; i < context->num_workers; ++i)
+    while (!stop)
     {
-        if (pthread_join(context->threads[i], NULL) != 0)
+        // Wait for a client to become writable only while it has output
+        // queued, which workers signal through the wakeup.
+        for (int i = 2; i < nfds; ++i)
         {
-            perror("ERROR pthread_join");
-            exit(EXIT_FAILURE);
+            fds[i].events = POLLIN | (control_pending(clients[i]) ? POLLOUT : 0);
         }
-    }
 
-    queue_free(context->todo);
+        if (poll(fds, nfds, -1) < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            perror("ERROR poll");
+            break;
+        }
 
-    free(context->threads);
-    free(context);
-}
+        if (fds[1].revents & POLLIN)
+        {
+            control_clear_wakeup();
+        }
 
-Task *new_task(char *url, int min_range, int max_range, int fd, char *id)
-{
-    Task *task = malloc(sizeof(Task));
-    task->result = NULL;
+        // Serve existing clients first, a new client is added at the end.
+        for (int i = 2; i < nfds && !stop; ++i)
+        {
+            char *line;
 
-    task->url = malloc(strlen(url) + 1);
-    strcpy(task->url, url);
+            if (fds[i].revents & POLLOUT)
+            {
+                control_flush(clients[i]);
+            }
 
-    task->id = malloc(strlen(id) + 1);
-    strcpy(task->id, id);
+            if ((fds[i].revents & ~POLLOUT) == 0)
+            {
+                continue;
+            }
 
-    task->min_range = min_range;
-    task->max_range = max_range;
+            if (control_receive(clients[i]) != 0)
+            {
+                // The client has gone. Its jobs keep running, their events
+                // are dropped.
+                control_close(clients[i]);
+                clients[i] = clients[--nfds];
+                fds[i--] = fds[nfds];
+                continue;
+            }
 
-    // The tasks unique access to the file to write the
-    // downloaded bytes to.
-    task->fd = fd;
+            while (!stop && (line = control_next_line(clients[i])) != NULL)
+            {
+                if ((stop = run_command(downloader, settings, clients[i], line)))
+                {
+                    requester = clients[i];
+                }
+            }
+        }
 
-    return task;
-}
+        if ((fds[0].revents & POLLIN) && !stop)
+        {
+            ControlClient *client = control_accept(fds[0].fd);
 
-int open_file_output_fd(const char *url, const char *output_dir)
-{
-    char file_path[FILE_SIZE], *cwd, *current, *prev, *context;
-    int fd;
+            if (client && nfds == MAX_CLIENTS + 2)
+            {
+                control_send(client, "error too many clients");
+                control_close(client);
+            }
+            else if (client)
+            {
+                clients[nfds] = client;
+                fds[nfds].fd = control_fd(client);
+                fds[nfds++].events = POLLIN;
+            }
+        }
+    }
 
-    // Prefix the download path with the user specified directory
-    snprintf(file_path, FILE_SIZE, "%s/%s", output_dir, url);
+    // Stop accepting clients and commands. The jobs in progress still
+    // report to their clients, so keep sending the clients their queued
+    // output until the jobs have finished and it has drained, or the
+    // clients have had DRAIN_TIMEOUT_MS to read it.
+    close(fds[0].fd);
+    unlink(path);
+    fds[0].fd = -1;
 
-    // Get the current working directory so it can be returned to
-    // after the directory tree is created.
-    if ((cwd = getcwd(NULL, 0)) == NULL)
+    for (long drained_ms = -1; drained_ms < DRAIN_TIMEOUT_MS;)
     {
-        perror("ERROR getcwd");
-        return -1;
-    }
+        struct timespec start, end;
+        int pending = 0;
 
-    // While the file url still contains '/' characters, there must
-    // be more subdirectories.
-    current = strtok_r(file_path, "/", &context);
-    while (current != NULL)
-    {
-        prev = current;
-        current = strtok_r(NULL, "/", &context);
-        if (current != NULL)
+        // Job events are not signalled, so check on the jobs regularly.
+        if (drained_ms < 0 && downloader_jobs(downloader, NULL, 0) == 0)
         {
-            // There is atleast another level directory level below this one
-            // so create this one and enter it.
-            create_directory(prev);
-            chdir(prev);
+            downloader_wait(downloader, 0);
+            control_send(requester, "bye");
+            drained_ms = 0;
         }
-    }
 
-    // Reset back to the working directory the program was prevously
-    // executing within.
-    chdir(cwd);
-    free(cwd);
+        for (int i = 2; i < nfds; ++i)
+        {
+            fds[i].events = control_pending(clients[i]) ? POLLOUT : 0;
+            pending |= fds[i].events;
+        }
+        if (drained_ms >= 0 && !pending)
+        {
+            break;
+        }
 
-    // Reset the file_url back to the full path. strtok_r placed '\0' in the
-    // previous copy to aid in creating the directory tree.
-    if (snprintf(file_path, FILE_SIZE, "%s/%s", output_dir, url) < 0)
-    {
-        perror("ERROR snprintf file_path");
-        return -1;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (poll(fds, nfds, SHUTDOWN_POLL_MS) < 0 && errno != EINTR)
+        {
+            perror("ERROR poll");
+            break;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        if (drained_ms >= 0)
+        {
+            drained_ms += (end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000;
+        }
+
+        if (fds[1].revents & POLLIN)
+        {
+            control_clear_wakeup();
+        }
+        for (int i = 2; i < nfds; ++i)
+        {
+            if (fds[i].revents & POLLOUT)
+            {
+                control_flush(clients[i]);
+            }
+            else if (fds[i].revents & (POLLHUP | POLLERR))
+            {
+                // The client has gone, its events are dropped.
+                requester = requester == clients[i] ? NULL : requester;
+                control_close(clients[i]);
+                clients[i] = clients[--nfds];
+                fds[i--] = fds[nfds];
+            }
+        }
     }
 
-    // // Open a file descriptor to the desired file.
-    if ((fd = open(file_path, O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR)) < 0)
+    for (int i = 2; i < nfds; ++i)
     {
-        perror("ERROR creat output file");
-        return -1;
+        control_close(clients[i]);
     }
 
-    return fd;
+    return 0;
 }
 
 int main(int argc, char **argv)
 {
-    if (argc != 4)
-    {
-        fprintf(stderr, "usage: ./downloader url_file num_workers download_dir\n");
-        exit(1);
-    }
-
-    char *url_file = argv[1];
-    int num_workers = atoi(argv[2]);
-    char *download_dir = argv[3];
-
-    // create_directory(download_dir);
-    FILE *fp = fopen(url_file, "r");
-    char *line = NULL;
-    size_t len = 0;
-
-    if (fp == NULL)
-    {
-        exit(EXIT_FAILURE);
-    }
-    // spawn threads and create work queue(s)
-    Context *context = spawn_workers(num_workers);
-
-    // Foreach url within the file that contains a list of urls to download.
-    int x = 0;
-    while ((len = getline(&line, &len, fp)) != -1)
+    static const struct option options[] = {
+        {"cpus", required_argument, NULL, 'c'},
+        {"nodes", required_argument, NULL, 'n'},
+        {"nic", required_argument, NULL, 'i'},
+        {"profile", required_argument, NULL, 'p'},
+        {"rcvbuf", required_argument, NULL, OPT_RCVBUF},
+        {"read-size", required_argument, NULL, OPT_READ_SIZE},
+        {"no-nodelay", no_argument, NULL, OPT_NO_NODELAY},
+        {"quickack", no_argument, NULL, OPT_QUICKACK},
+        {"connect-timeout", required_argument, NULL, OPT_CONNECT_TIMEOUT},
+        {"read-timeout", required_argument, NULL, OPT_READ_TIMEOUT},
+        {"congestion", required_argument, NULL, OPT_CONGESTION},
+        {"cache-dir", required_argument, NULL, OPT_CACHE_DIR},
+        {"no-cache", no_argument, NULL, OPT_NO_CACHE},
+        {"dedup", no_argument, NULL, OPT_DEDUP},
+        {"compress", no_argument, NULL, OPT_COMPRESS},
+        {"daemon", required_argument, NULL, OPT_DAEMON},
+        {"inflight-tasks", required_argument, NULL, OPT_INFLIGHT_TASKS},
+        {"inflight-bytes", required_argument, NULL, OPT_INFLIGHT_BYTES},
+        {"fsync", required_argument, NULL, OPT_FSYNC},
+        {"ca-file", required_argument, NULL, OPT_CA_FILE},
+        {"insecure", no_argument, NULL, OPT_INSECURE},
+        {"ktls", no_argument, NULL, OPT_KTLS},
+        {"hedge", required_argument, NULL, OPT_HEDGE},
+        {NULL, 0, NULL, 0}};
+
+    AffinityPlan plan = {0};
+    SocketProfile profile = *http_get_socket_profile();
+    TlsSettings tls = {NULL, 0, 0};
+    DownloadOptions settings = {.use_cache = 1};
+    const char *daemon_path = NULL;
+    long long inflight_tasks = DOWNLOAD_INFLIGHT_TASKS, inflight_bytes = DOWNLOAD_INFLIGHT_BYTES;
+    int opt, rc = 0;
+
+    while ((opt = getopt_long(argc, argv, "c:n:i:p:", options, NULL)) != -1)
     {
-        int bytes, num_tasks, fd;
-
-        if (line[len - 1] == '\n')
+        // Only a single placement policy may be used.
+        if (plan.num_cpus > 0 && (opt == 'c' || opt == 'n' || opt == 'i'))
         {
-            line[len - 1] = '\0';
+            fprintf(stderr, "only one of --cpus, --nodes and --nic may be given\n");
+            usage();
         }
 
-        // Determine the number of downloads required to completely retrieve the
-        // specified file. Validates the returned value.
-        if ((num_tasks = get_num_tasks(line, num_workers)) < 1)
+        switch (opt)
         {
-            // The number of required downloads could not be determined.
-            fprintf(stderr, "could not determine the number of downloads for : %s\n", line);
-            continue;
+        case 'p':
+            if (set_profile_preset(&profile, optarg) != 0)
+            {
+                fprintf(stderr, "unknown socket profile: %s\n", optarg);
+                usage();
+            }
+            break;
+        case OPT_RCVBUF:
+            profile.rcvbuf = atoi(optarg);
+            break;
+        case OPT_READ_SIZE:
+            profile.read_size = atoi(optarg);
+            break;
+        case OPT_NO_NODELAY:
+            profile.nodelay = 0;
+            break;
+        case OPT_QUICKACK:
+            profile.quickack = 1;
+            break;
+        case OPT_CONNECT_TIMEOUT:
+            profile.connect_timeout_ms = atoi(optarg);
+            break;
+        case OPT_READ_TIMEOUT:
+            profile.read_timeout_ms = atoi(optarg);
+            break;
+        case OPT_CONGESTION:
+            strncpy(profile.congestion, optarg, sizeof(profile.congestion) - 1);
+            break;
+        case OPT_CACHE_DIR:
+            settings.cache_dir = optarg;
+            break;
+        case OPT_NO_CACHE:
+            settings.use_cache = 0;
+            break;
+        case OPT_DEDUP:
+            settings.dedup = 1;
+            break;
+        case OPT_COMPRESS:
+            settings.compress = 1;
+            break;
+        case OPT_DAEMON:
+            daemon_path = optarg;
+            break;
+        case OPT_INFLIGHT_TASKS:
+            inflight_tasks = atoll(optarg);
+            break;
+        case OPT_INFLIGHT_BYTES:
+            inflight_bytes = atoll(optarg);
+            break;
+        case OPT_FSYNC:
+            if ((settings.sync = find_name(sync_names, 3, optarg)) < 0)
+            {
+                fprintf(stderr, "unknown fsync policy: %s\n", optarg);
+                usage();
+            }
+            break;
+        case OPT_CA_FILE:
+            tls.ca_file = optarg;
+            break;
+        case OPT_INSECURE:
+            tls.insecure = 1;
+            break;
+        case OPT_KTLS:
+            tls.ktls = 1;
+            break;
+        case OPT_HEDGE:
+            if ((settings.hedge = atoi(optarg)) < 0)
+            {
+                fprintf(stderr, "hedge budget must be a percentage: %s\n", optarg);
+                usage();
+            }
+            break;
+        case 'c':
+            rc = affinity_plan_cpus(&plan, optarg);
+            break;
+        case 'n':
+            rc = affinity_plan_nodes(&plan, optarg);
+            break;
+        case 'i':
+            rc = affinity_plan_nic(&plan, optarg);
+            break;
+        default:
+            usage();
         }
-        // As the above call must of returned a valid number of downloads, get
-        // the determined chunk size.
-        bytes = get_max_chunk_size();
 
-        // Open a file descriptor for the given url where the downlaoded bytes can be
-        // written.
-        if ((fd = open_file_output_fd(line, download_dir)) <= 0)
+        if (rc != 0)
         {
-            // The file descriptor was never created/assigned.
-            fprintf(stderr, "Failed to open output file for writing\n");
-            continue;
+            fprintf(stderr, "could not build worker placement from: %s\n", optarg);
+            exit(EXIT_FAILURE);
         }
+    }
 
-        // For each download required for a given url, create a new task with the required
-        // byte range. fcntl is used to duplicate the file descriptor so each task has
-        // its own unique reference to the file.
-        // F_DUPFD_CLOEXEC ensures once a task writes to the file descriptor it is automatically closed.
-        for (int i = 0; i < num_tasks; i++)
-        {
-            char id[8];
-            int nfd;
+    // A daemon takes its jobs from the control socket instead.
+    if (argc - optind != (daemon_path ? 1 : 3))
+    {
+        usage();
+    }
 
-            snprintf(id, 8, "%03d-%03d", x, i);
+    int num_workers = atoi(argv[daemon_path ? optind : optind + 1]);
 
-            nfd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
-            if (nfd == -1)
-            {
-                perror("ERROR fcntl");
-                break;
-            }
-            queue_put(context->todo, new_task(line, i * bytes, (i + 1) * bytes, nfd, id));
-        }
-        x++;
+    http_set_socket_profile(&profile);
+    if (tls_configure(&tls) != 0)
+    {
+        exit(EXIT_FAILURE);
+    }
+    metrics_start();
+
+    // spawn threads and create work queue(s)
+    Downloader *downloader = downloader_create(num_workers, &plan);
+    if (downloader == NULL)
+    {
+        exit(EXIT_FAILURE);
+    }
+    downloader_limit(downloader, inflight_tasks, inflight_bytes);
 
-        // Cleanup
-        close(fd);
+    if (daemon_path)
+    {
+        rc = run_daemon(downloader, &settings, daemon_path);
+    }
+    else
+    {
+        // Read and parse the whole url_file up front, then wait for every
+        // file to finish.
+        settings.verbose = 1;
+        if (downloader_submit_file(downloader, argv[optind], argv[optind + 2], &settings, NULL) < 0)
+        {
+            exit(EXIT_FAILURE);
+        }
     }
 
-    //cleanup
-    fclose(fp);
-    free(line);
+    // Every job has finished once the workers exit.
+    downloader_destroy(downloader);
+    affinity_plan_free(&plan);
 
-    free_workers(context);
+    metrics_report(stderr);
+    http_cleanup();
+    mirror_cleanup();
 
-    return 0;
-}
\ No newline at end of file
+    return rc;
+}
@@ -1,272 +1,1455 @@
 #include <stdio.h>
 #include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/uio.h>
 #include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <stdlib.h>
 #include <netdb.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
 #include <assert.h>
 
 #include "http.h"
+#include "metrics.h"
+#include "decode.h"
+#include "tls.h"
+#include "url.h"
 
 #define BUF_SIZE 1024
+// The most addresses of a single host that will be raced.
+#define MAX_ADDRESSES 16
+// The most redirects followed when probing a url.
+#define MAX_REDIRECTS 5
+// Delay before racing the next address (RFC 8305 recommends 250ms)
+#define CONNECT_STAGGER_MS 250
+// How long a hostname's addresses are used before resolving it again.
+// getaddrinfo() does not report the records' TTLs, so a fixed one is used.
+#define RESOLVE_TTL_SECONDS 60
 // The maximum chunk size in bytes (Default = 40MB)
 #define CHUNKING_MAX_BYTES 41943040
+// The most parts a request is gathered from.
+#define REQUEST_PARTS 16
 
-int resolve_hostname(struct sockaddr_in *out, const char *host)
+int max_chunk_size;
+
+// An open connection, encrypted for https urls.
+typedef struct
+{
+    int fd;
+    Tls *tls;
+    Transfer *transfer; // Progress published to other threads, or NULL
+
+} Connection;
+
+// A request gathered from constant header lines and views into the url,
+// so nothing is formatted or copied before it is sent.
+typedef struct
+{
+    struct iovec parts[REQUEST_PARTS];
+    int count;
+    size_t length;
+
+} Request;
+
+// Append a string literal to a request.
+#define ADD_LITERAL(request, literal) add_part(request, literal, sizeof(literal) - 1)
+
+static SocketProfile socket_profile = {
+    .rcvbuf = 0,
+    .read_size = 65536,
+    .nodelay = 1,
+    .quickack = 0,
+    .connect_timeout_ms = 10000,
+    .read_timeout_ms = 30000,
+    .congestion = "",
+};
+
+/**
+ * Replace the socket profile used for all subsequent connections.
+ * Not thread-safe, call before spawning workers.
+ * @param profile - The profile to copy
+ */
+void http_set_socket_profile(const SocketProfile *profile)
+{
+    socket_profile = *profile;
+
+    // A read must always make progress.
+    if (socket_profile.read_size < BUF_SIZE)
+    {
+        socket_profile.read_size = BUF_SIZE;
+    }
+}
+
+/**
+ * Get the socket profile currently in use.
+ * @return Pointer to the active profile
+ */
+const SocketProfile *http_get_socket_profile(void)
+{
+    return &socket_profile;
+}
+
+// Every address a hostname resolved to, in the order getaddrinfo()
+// preferred them (RFC 6724), cached for RESOLVE_TTL_SECONDS so a long
+// running process follows hosts that are renumbered.
+typedef struct AddressList
+{
+    char *host;
+    int count;
+    struct sockaddr_storage addrs[MAX_ADDRESSES];
+    socklen_t lengths[MAX_ADDRESSES];
+    time_t expires; // CLOCK_MONOTONIC second the host is resolved again at
+
+    struct AddressList *next;
+} AddressList;
+
+static AddressList *resolved = NULL;
+static pthread_mutex_t resolved_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Where a url prefix was redirected to, so that the other urls under the
+// prefix are probed at the new location directly.
+typedef struct Redirect
+{
+    char *from; // e.g. old.example.com/files/
+    char *to;   // e.g. https://cdn.example.com/mirror/files/
+
+    struct Redirect *next;
+} Redirect;
+
+struct RedirectCacheStruct
+{
+    Redirect *redirects;
+    pthread_mutex_t lock;
+};
+
+// Guards the socket of every Transfer, so http_cancel never shuts down a
+// descriptor that has been closed and reused.
+static pthread_mutex_t transfers_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Resolve a hostname to all of its IPv4 and IPv6 addresses. The families
+// are interleaved so a connection race alternates between them.
+static AddressList *resolve_addresses(const char *host)
+{
+    struct addrinfo hints, *results, *addr;
+    struct addrinfo *families[2][MAX_ADDRESSES];
+    int counts[2] = {0, 0};
+    char name[NI_MAXHOST];
+    AddressList *list;
+    size_t length = strlen(host);
+    int rc;
+
+    // IPv6 literals are written in brackets e.g. [::1]
+    if (length > 1 && host[0] == '[' && host[length - 1] == ']' && length - 2 < NI_MAXHOST)
+    {
+        memcpy(name, host + 1, length - 2);
+        name[length - 2] = '\0';
+    }
+    else
+    {
+        strncpy(name, host, NI_MAXHOST - 1);
+        name[NI_MAXHOST - 1] = '\0';
+    }
+
+    // Zero out then populate the hints for getaddrinfo().
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_ADDRCONFIG;
+
+    // Attempt to resolve the hostname to both A and AAAA records.
+    if ((rc = getaddrinfo(name, NULL, &hints, &results)) != 0)
+    {
+        fprintf(stderr, "ERROR getaddrinfo %s: %s\n", name, gai_strerror(rc));
+        return NULL;
+    }
+
+    // Split the results by family keeping the resolver's preference order.
+    for (addr = results; addr != NULL; addr = addr->ai_next)
+    {
+        int family = addr->ai_family == AF_INET6 ? 0 : 1;
+        if (counts[family] < MAX_ADDRESSES)
+        {
+            families[family][counts[family]++] = addr;
+        }
+    }
+
+    list = calloc(1, sizeof(AddressList));
+    list->host = strdup(host);
+
+    // Interleave the families, starting with whichever was preferred.
+    int first = results->ai_family == AF_INET6 ? 0 : 1;
+    for (int i = 0; list->count < MAX_ADDRESSES && (i < counts[0] || i < counts[1]); ++i)
+    {
+        for (int f = 0; f < 2 && list->count < MAX_ADDRESSES; ++f)
+        {
+            int family = (first + f) % 2;
+            if (i < counts[family])
+            {
+                memcpy(&list->addrs[list->count], families[family][i]->ai_addr, families[family][i]->ai_addrlen);
+                list->lengths[list->count++] = families[family][i]->ai_addrlen;
+            }
+        }
+    }
+
+    freeaddrinfo(results);
+    return list;
+}
+
+static time_t monotonic_seconds(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec;
+}
+
+// Look up a hostname in the cache, resolving it on a miss or once its
+// entry has expired. The addresses are copied out, as the entry may be
+// replaced at any time. Returns 0 on success.
+static int lookup_addresses(const char *host, AddressList *addresses)
+{
+    AddressList *list, **link;
+    time_t now = monotonic_seconds();
+
+    pthread_mutex_lock(&resolved_lock);
+    for (list = resolved; list != NULL; list = list->next)
+    {
+        if (strcmp(list->host, host) == 0 && now < list->expires)
+        {
+            *addresses = *list;
+            pthread_mutex_unlock(&resolved_lock);
+            return 0;
+        }
+    }
+    pthread_mutex_unlock(&resolved_lock);
+
+    // Resolve without holding the lock so a slow lookup does not block
+    // workers connecting to other hosts. Two workers may race to resolve
+    // the same host, in which case the later result replaces the earlier.
+    if ((list = resolve_addresses(host)) == NULL)
+    {
+        return -1;
+    }
+    list->expires = now + RESOLVE_TTL_SECONDS;
+    *addresses = *list;
+
+    pthread_mutex_lock(&resolved_lock);
+    for (link = &resolved; *link != NULL; link = &(*link)->next)
+    {
+        if (strcmp((*link)->host, host) == 0)
+        {
+            AddressList *stale = *link;
+
+            *link = stale->next;
+            free(stale->host);
+            free(stale);
+            break;
+        }
+    }
+    list->next = resolved;
+    resolved = list;
+    pthread_mutex_unlock(&resolved_lock);
+
+    return 0;
+}
+
+// Expire a hostname's cached addresses once none of them could be
+// connected to, so the next connection resolves it again.
+static void forget_addresses(const char *host)
+{
+    pthread_mutex_lock(&resolved_lock);
+    for (AddressList *list = resolved; list != NULL; list = list->next)
+    {
+        if (strcmp(list->host, host) == 0)
+        {
+            list->expires = 0;
+        }
+    }
+    pthread_mutex_unlock(&resolved_lock);
+}
+
+/**
+ * Get the number of addresses a host resolved to.
+ * @param host - The host name e.g. www.canterbury.ac.nz
+ * @return The number of addresses, 0 if the host could not be resolved
+ */
+int http_num_addresses(const char *host)
+{
+    AddressList list;
+
+    return lookup_addresses(host, &list) == 0 ? list.count : 0;
+}
+
+/**
+ * Free the cached hostname resolutions and TLS sessions.
+ */
+void http_cleanup(void)
+{
+    pthread_mutex_lock(&resolved_lock);
+    while (resolved)
+    {
+        AddressList *next = resolved->next;
+        free(resolved->host);
+        free(resolved);
+        resolved = next;
+    }
+    pthread_mutex_unlock(&resolved_lock);
+
+    tls_cleanup();
+}
+
+// setsockopt() wrapper that counts options the kernel refuses, e.g. an
+// unavailable congestion control module, rather than failing the query.
+static void set_option(int sockfd, int level, int name, const void *value, socklen_t length)
+{
+    if (setsockopt(sockfd, level, name, value, length) != 0)
+    {
+        metrics_add(sockopt_failures, 1);
+    }
+}
+
+// Apply the parts of the socket profile that must be set before connect().
+// The receive buffer determines the window scale negotiated in the SYN.
+static void apply_profile(int sockfd)
+{
+    const SocketProfile *profile = &socket_profile;
+    int on = 1;
+
+    if (profile->rcvbuf > 0)
+    {
+        set_option(sockfd, SOL_SOCKET, SO_RCVBUF, &profile->rcvbuf, sizeof(int));
+    }
+    if (profile->congestion[0])
+    {
+        set_option(sockfd, IPPROTO_TCP, TCP_CONGESTION, profile->congestion, strlen(profile->congestion));
+    }
+    if (profile->nodelay)
+    {
+        set_option(sockfd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(int));
+    }
+    if (profile->read_timeout_ms > 0)
+    {
+        struct timeval timeout = {
+            .tv_sec = profile->read_timeout_ms / 1000,
+            .tv_usec = (profile->read_timeout_ms % 1000) * 1000};
+        set_option(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    }
+}
+
+// Record what the kernel actually applied for the first connection.
+static void sample_profile(int sockfd)
+{
+    socklen_t length = sizeof(int);
+
+    getsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &metrics.effective_rcvbuf, &length);
+    length = sizeof(metrics.effective_congestion) - 1;
+    getsockopt(sockfd, IPPROTO_TCP, TCP_CONGESTION, metrics.effective_congestion, &length);
+}
+
+static long elapsed_ms(const struct timespec *since)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) * 1000 + (now.tv_nsec - since->tv_nsec) / 1000000;
+}
+
+// Start a non-blocking connect to one address. Returns the socket, which
+// may still be connecting, or -1 if the attempt failed immediately.
+static int start_connect(const AddressList *list, int index, int port)
+{
+    struct sockaddr_storage addr = list->addrs[index];
+    int sockfd;
+
+    if (addr.ss_family == AF_INET6)
+    {
+        ((struct sockaddr_in6 *)&addr)->sin6_port = htons(port);
+    }
+    else
+    {
+        ((struct sockaddr_in *)&addr)->sin_port = htons(port);
+    }
+
+    if ((sockfd = socket(addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0)
+    {
+        return -1;
+    }
+    apply_profile(sockfd);
+
+    if (connect(sockfd, (struct sockaddr *)&addr, list->lengths[index]) != 0 && errno != EINPROGRESS)
+    {
+        close(sockfd);
+        return -1;
+    }
+
+    return sockfd;
+}
+
+// Race connections to the host's addresses (Happy Eyeballs, RFC 8305).
+// The first attempt goes to address `first`, and while no attempt has
+// succeeded another is started every CONNECT_STAGGER_MS or as soon as an
+// attempt fails. The first to complete wins and the rest are abandoned.
+static int connect_race(const AddressList *list, int first, int port)
+{
+    struct pollfd pending[MAX_ADDRESSES];
+    int started = 0, active = 0, winner = -1, timeout = socket_profile.connect_timeout_ms;
+    struct timespec start;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    while (winner < 0)
+    {
+        int wait = CONNECT_STAGGER_MS, ready;
+
+        // Start the next attempt. Immediately failing addresses are
+        // skipped without waiting out the stagger delay.
+        while (started < list->count)
+        {
+            int sockfd = start_connect(list, (first + started++) % list->count, port);
+            if (sockfd >= 0)
+            {
+                pending[active].fd = sockfd;
+                pending[active].events = POLLOUT;
+                pending[active++].revents = 0;
+                break;
+            }
+        }
+
+        if (active == 0)
+        {
+            errno = ECONNREFUSED;
+            break;
+        }
+
+        // Once every address is in flight there is nothing left to
+        // stagger, so wait for the remainder of the connect timeout.
+        if (started == list->count)
+        {
+            wait = -1;
+        }
+        if (timeout > 0)
+        {
+            long remaining = timeout - elapsed_ms(&start);
+            if (remaining <= 0)
+            {
+                metrics_add(timeouts, 1);
+                errno = ETIMEDOUT;
+                break;
+            }
+            if (wait < 0 || remaining < wait)
+            {
+                wait = remaining;
+            }
+        }
+
+        if ((ready = poll(pending, active, wait)) < 0 && errno != EINTR)
+        {
+            break;
+        }
+
+        for (int i = 0; i < active && ready > 0; ++i)
+        {
+            int error = 0;
+            socklen_t length = sizeof(int);
+
+            if (pending[i].revents == 0)
+            {
+                continue;
+            }
+
+            getsockopt(pending[i].fd, SOL_SOCKET, SO_ERROR, &error, &length);
+            if (error == 0)
+            {
+                winner = pending[i].fd;
+                if (started > 1)
+                {
+                    metrics_add(connect_fallbacks, 1);
+                }
+            }
+            else
+            {
+                close(pending[i].fd);
+                errno = error;
+            }
+
+            // Remove the completed attempt from the pending set.
+            pending[i--] = pending[--active];
+            if (winner >= 0)
+            {
+                break;
+            }
+        }
+    }
+
+    // Abandon the attempts that lost the race.
+    for (int i = 0; i < active; ++i)
+    {
+        close(pending[i].fd);
+    }
+
+    if (winner >= 0)
+    {
+        // Return to blocking mode for the request and response.
+        fcntl(winner, F_SETFL, fcntl(winner, F_GETFL, 0) & ~O_NONBLOCK);
+    }
+
+    return winner;
+}
+
+/**
+ * Open a TCP connection to host:port with the socket profile applied.
+ * All of the host's IPv4 and IPv6 addresses are raced with staggered
+ * starts, beginning with the address selected by addr_hint.
+ * @param host - The host name e.g. www.canterbury.ac.nz
+ * @param port - e.g. 80
+ * @param addr_hint - Index of the address to try first, wraps around the
+ *                    number of addresses. Used to spread connections.
+ * @return The connected socket or -1 on failure
+ */
+int http_connect(const char *host, int port, int addr_hint)
+{
+    AddressList list;
+    int sockfd;
+
+    // Resolve the hostname to all of its addresses.
+    if (lookup_addresses(host, &list) != 0 || list.count == 0)
+    {
+        return -1;
+    }
+
+    // Attempt to connect to the server. If every address failed the host
+    // may have moved, so it is resolved again next time.
+    if ((sockfd = connect_race(&list, addr_hint % list.count, port)) < 0)
+    {
+        fprintf(stderr, "ERROR connect %s: %s\n", host, strerror(errno));
+        metrics_add(connect_failures, 1);
+        forget_addresses(host);
+        return -1;
+    }
+
+    if (metrics_add(connections, 1) == 1)
+    {
+        sample_profile(sockfd);
+    }
+
+    return sockfd;
+}
+
+// Close a connection's socket, withdrawing it from its transfer first.
+static void close_socket(Connection *connection)
+{
+    if (connection->transfer)
+    {
+        pthread_mutex_lock(&transfers_lock);
+        connection->transfer->fd = -1;
+        pthread_mutex_unlock(&transfers_lock);
+    }
+    close(connection->fd);
+}
+
+// Connect to the host of a url, performing the TLS handshake for https.
+// A transfer that was cancelled before the socket was published fails.
+static int open_connection(Connection *connection, const Url *url, int addr_hint, Transfer *transfer)
+{
+    char host[NI_MAXHOST];
+    int cancelled = 0;
+
+    connection->tls = NULL;
+    connection->transfer = transfer;
+    if (url->host_length >= sizeof(host))
+    {
+        fprintf(stderr, "ERROR | host name is too long: %.*s\n", (int)url->host_length, url->host);
+        return -1;
+    }
+    memcpy(host, url->host, url->host_length);
+    host[url->host_length] = '\0';
+
+    if ((connection->fd = http_connect(host, url->port, addr_hint)) < 0)
+    {
+        return -1;
+    }
+
+    if (transfer)
+    {
+        pthread_mutex_lock(&transfers_lock);
+        if (!(cancelled = transfer->cancelled))
+        {
+            transfer->fd = connection->fd;
+        }
+        pthread_mutex_unlock(&transfers_lock);
+    }
+    if (cancelled)
+    {
+        close(connection->fd);
+        return -1;
+    }
+
+    if (url->tls && (connection->tls = tls_connect(connection->fd, host, url->port)) == NULL)
+    {
+        close_socket(connection);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void close_connection(Connection *connection)
+{
+    if (connection->tls)
+    {
+        tls_close(connection->tls);
+    }
+    close_socket(connection);
+}
+
+// Append bytes to a request. They must outlive the request.
+static void add_part(Request *request, const char *data, size_t length)
+{
+    assert(request->count < REQUEST_PARTS);
+
+    request->parts[request->count].iov_base = (void *)data;
+    request->parts[request->count].iov_len = length;
+    request->count++;
+    request->length += length;
+}
+
+// Start a request for the url's page with the header lines sent to every
+// host. The method includes the leading '/' of the path e.g. "GET /".
+static void start_request(Request *request, const char *method, size_t method_length, const Url *url)
+{
+    request->count = 0;
+    request->length = 0;
+
+    add_part(request, method, method_length);
+    add_part(request, url->page, url->page_length);
+    ADD_LITERAL(request, " HTTP/1.0\r\nHost: ");
+    add_part(request, url->authority, url->authority_length);
+    ADD_LITERAL(request, "\r\nUser-Agent: getter\r\n");
+}
+
+// Send a request over a connection. Plain connections send the parts with
+// one gathered write, TLS joins them first so they go out as one record.
+static int send_request(Connection *connection, Request *request)
+{
+    struct msghdr message = {.msg_iov = request->parts, .msg_iovlen = request->count};
+    ssize_t sent;
+
+    if (connection->tls)
+    {
+        char small[BUF_SIZE], *joined = request->length <= sizeof(small) ? small : malloc(request->length);
+        size_t length = 0;
+        int rc;
+
+        if (joined == NULL)
+        {
+            return -1;
+        }
+        for (int i = 0; i < request->count; ++i)
+        {
+            memcpy(joined + length, request->parts[i].iov_base, request->parts[i].iov_len);
+            length += request->parts[i].iov_len;
+        }
+        rc = tls_write(connection->tls, joined, length);
+
+        if (joined != small)
+        {
+            free(joined);
+        }
+        return rc;
+    }
+
+    // A short send leaves the rest of the parts to send again.
+    while (message.msg_iovlen > 0)
+    {
+        if ((sent = sendmsg(connection->fd, &message, MSG_NOSIGNAL)) < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            perror("ERROR sendmsg");
+            return -1;
+        }
+        while (message.msg_iovlen > 0 && (size_t)sent >= message.msg_iov->iov_len)
+        {
+            sent -= message.msg_iov->iov_len;
+            message.msg_iov++;
+            message.msg_iovlen--;
+        }
+        if (message.msg_iovlen > 0)
+        {
+            message.msg_iov->iov_base = (char *)message.msg_iov->iov_base + sent;
+            message.msg_iov->iov_len -= sent;
+        }
+    }
+
+    return 0;
+}
+
+// Read once from a connection, counting receive timeouts. Quick ACK mode
+// is not permanent, the kernel may fall back to delayed ACKs so it has to
+// be re-armed after every read.
+static ssize_t read_some(Connection *connection, char *data, size_t size)
+{
+    ssize_t bytes_read = connection->tls ? tls_read(connection->tls, data, size) : read(connection->fd, data, size);
+    int on = 1;
+
+    if (bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    {
+        // SO_RCVTIMEO expired, the server has stalled.
+        metrics_add(timeouts, 1);
+    }
+
+    if (socket_profile.quickack)
+    {
+        set_option(connection->fd, IPPROTO_TCP, TCP_QUICKACK, &on, sizeof(int));
+    }
+
+    return bytes_read;
+}
+
+/**
+ * Allocate an empty buffer with the given capacity. The memory is touched
+ * by the calling thread so it is placed on that thread's NUMA node.
+ * @param capacity - Initial size in bytes of the data array
+ * @return Buffer - Pointer to the allocated buffer or NULL on failure
+ */
+Buffer *buffer_alloc(size_t capacity)
+{
+    Buffer *buffer = malloc(sizeof(Buffer));
+    size_t page_size = sysconf(_SC_PAGESIZE);
+
+    if (buffer == NULL)
+    {
+        return NULL;
+    }
+
+    if ((buffer->data = calloc(capacity, 1)) == NULL)
+    {
+        free(buffer);
+        return NULL;
+    }
+
+    // A large calloc() is a fresh mapping of zero pages that are only
+    // placed when first written. Write each page here on the calling thread
+    // rather than later on whichever CPU reads into it. The writes are
+    // volatile so they are not optimised away as storing zero over zero.
+    for (size_t i = 0; i < capacity; i += page_size)
+    {
+        ((volatile char *)buffer->data)[i] = 0;
+    }
+
+    buffer->length = 0;
+    buffer->capacity = capacity;
+    return buffer;
+}
+
+static int read_into(Buffer *dst, Connection *connection)
+{
+    size_t read_size = socket_profile.read_size, header = 0;
+    ssize_t bytes_read;
+    int partial = 0;
+    char *tmp;
+
+    dst->length = 0;
+
+    // While bytes can be read from the socket, read directly into the free
+    // space at the end of the Buffer. One byte is always kept spare so the
+    // data can be NUL terminated for the string based header parsing.
+    do
+    {
+        // Check if the Buffer needs to be extended.
+        if (dst->capacity - dst->length < read_size + 1)
+        {
+            // Double the length of the current buffer and reallocate.
+            size_t capacity = dst->capacity < read_size ? 2 * read_size : dst->capacity * 2;
+            tmp = realloc(dst->data, capacity);
+
+            // Check realloc() did not return NULL. tmp prevents realloc() creating
+            // a memory leak if it returns a NULL pointer as access to the original
+            // memory is lost.
+            if (tmp)
+            {
+                dst->data = tmp;
+                dst->capacity = capacity;
+            }
+            else
+            {
+                fprintf(stderr, "realloc() did not return a pointer! Likely out of memory.\n");
+                return -1;
+            }
+        }
+
+        bytes_read = read_some(connection, dst->data + dst->length, read_size);
+        if (bytes_read > 0)
+        {
+            dst->length += bytes_read;
+        }
+
+        // Publish how much of the body has arrived, once the header shows
+        // that it is the requested range.
+        if (bytes_read > 0 && connection->transfer && header == 0)
+        {
+            char *end;
+
+            dst->data[dst->length] = '\0';
+            if ((end = strstr(dst->data, "\r\n\r\n")) != NULL)
+            {
+                header = end + 4 - dst->data;
+                partial = http_status(dst->data) == 206;
+            }
+        }
+        if (partial)
+        {
+            __atomic_store_n(&connection->transfer->body, dst->length - header, __ATOMIC_RELAXED);
+        }
+    } while (bytes_read > 0);
+
+    dst->data[dst->length] = '\0';
+    return bytes_read < 0 ? -1 : 0;
+}
+
+static int read_response(Buffer **dst, Connection *connection)
+{
+    // Initialise the Buffer that will hold the response data.
+    if (((*dst) = buffer_alloc(BUF_SIZE)) == NULL)
+    {
+        return -1;
+    }
+
+    return read_into(*dst, connection);
+}
+
+// Perform a ranged GET of a url, see http_query_into and http_url_transfer.
+static int query_url(Buffer *dst, const Url *url, const char *range, int addr_hint, Transfer *transfer)
+{
+    Connection connection;
+    Request request;
+
+    // Only the page, host and range differ between range requests.
+    start_request(&request, "GET /", 5, url);
+    ADD_LITERAL(&request, "Range: bytes=");
+    add_part(&request, range, strlen(range));
+    ADD_LITERAL(&request, "\r\n\r\n");
+
+    if (open_connection(&connection, url, addr_hint, transfer) < 0)
+    {
+        return -1;
+    }
+
+    if (send_request(&connection, &request) != 0)
+    {
+        close_connection(&connection);
+        return -1;
+    }
+
+    // Read the response from the server into the Buffer. A cancelled
+    // transfer reads to the end of its shut down socket.
+    if (read_into(dst, &connection) != 0 && !(transfer && __atomic_load_n(&transfer->cancelled, __ATOMIC_RELAXED)))
+    {
+        perror("ERROR read_response");
+        close_connection(&connection);
+        return -1;
+    }
+
+    close_connection(&connection);
+    return transfer && __atomic_load_n(&transfer->cancelled, __ATOMIC_RELAXED) ? -1 : 0;
+}
+
+/**
+ * Perform an HTTP 1.0 query to a given host and page and port number.
+ * host is a hostname and page is a path on the remote server. The query
+ * will attempt to retrievev content in the given byte range.
+ * User is responsible for freeing the memory.
+ * 
+ * @param host - The host name e.g. www.canterbury.ac.nz
+ * @param page - e.g. /index.html
+ * @param range - Byte range e.g. 0-500. NOTE: A server may not respect this
+ * @param port - e.g. 80
+ * @return Buffer - Pointer to a buffer holding response data from query
+ *                  NULL is returned on failure.
+ */
+Buffer *http_query(char *host, char *page, const char *range, int port)
+{
+    Buffer *data = buffer_alloc(BUF_SIZE);
+
+    if (data && http_query_into(data, host, page, range, port, 0) != 0)
+    {
+        buffer_free(data);
+        return NULL;
+    }
+
+    return data;
+}
+
+/**
+ * Perform the same query as http_query but read the response into an
+ * existing buffer, growing it if required. Lets a worker reuse one
+ * receive buffer for every task instead of allocating per response.
+ * 
+ * @param dst - Buffer to read the response into. Existing content is discarded
+ * @param host - The host name e.g. www.canterbury.ac.nz
+ * @param page - e.g. /index.html
+ * @param range - Byte range e.g. 0-500. NOTE: A server may not respect this
+ * @param port - e.g. 80
+ * @param addr_hint - Index of the host's address to connect to first
+ * @return 0 on success, -1 on failure
+ */
+int http_query_into(Buffer *dst, char *host, char *page, const char *range, int port, int addr_hint)
+{
+    Url url = {
+        .authority = host,
+        .authority_length = strlen(host),
+        .host = host,
+        .host_length = strlen(host),
+        .page = page,
+        .page_length = strlen(page),
+        .port = port,
+    };
+
+    return query_url(dst, &url, range, addr_hint, NULL);
+}
+
+/**
+ * Separate the content from the header of an http request.
+ * NOTE: returned string is an offset into the response, so
+ * should not be freed by the user. Do not copy the data.
+ * @param response - Buffer containing the HTTP response to separate 
+ *                   content from
+ * @return string response or NULL on failure (buffer is not HTTP response)
+ */
+char *http_get_content(Buffer *response)
+{
+
+    char *header_end = strstr(response->data, "\r\n\r\n");
+
+    if (header_end)
+    {
+        return header_end + 4;
+    }
+    else
+    {
+        return response->data;
+    }
+}
+
+// Parse a url, reporting why it could not be.
+static int parse_url(const char *url, Url *parsed)
+{
+    if (url_parse(url, strlen(url), parsed) != 0)
+    {
+        fprintf(stderr, "could not parse url %s\n", url);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Find a header in an HTTP response and copy its value, without leading
+ * or trailing whitespace. Header names are matched case-insensitively.
+ * @param response - NUL terminated response, only the header is searched
+ * @param name - Header name without the colon e.g. Content-Length
+ * @param value - Output buffer for the value
+ * @param size - Size of the value buffer
+ * @return 0 if the header was found, -1 otherwise
+ */
+int http_header(const char *response, const char *name, char *value, size_t size)
+{
+    size_t name_length = strlen(name);
+    const char *line = strstr(response, "\r\n");
+
+    // Headers start on the line after the status line and end at the
+    // first empty line.
+    while (line && line[2] != '\r' && line[2] != '\0')
+    {
+        line += 2;
+
+        if (strncasecmp(line, name, name_length) == 0 && line[name_length] == ':')
+        {
+            const char *start = line + name_length + 1, *end = strstr(start, "\r\n");
+            size_t length;
+
+            if (end == NULL)
+            {
+                end = start + strlen(start);
+            }
+            while (start < end && (*start == ' ' || *start == '\t'))
+            {
+                ++start;
+            }
+            while (end > start && (end[-1] == ' ' || end[-1] == '\t'))
+            {
+                --end;
+            }
+
+            length = (size_t)(end - start) < size - 1 ? (size_t)(end - start) : size - 1;
+            memcpy(value, start, length);
+            value[length] = '\0';
+            return 0;
+        }
+
+        line = strstr(line, "\r\n");
+    }
+
+    return -1;
+}
+
+/**
+ * Get the status code of an HTTP response.
+ * @param response - NUL terminated response
+ * @return The status code e.g. 200, or -1 if the status line is invalid
+ */
+int http_status(const char *response)
+{
+    int status;
+
+    if (sscanf(response, "HTTP/%*d.%*d %d", &status) != 1)
+    {
+        return -1;
+    }
+
+    return status;
+}
+
+int calc_chunking(size_t total_bytes, int accepts_ranges, int threads)
+{
+    if (total_bytes == 0)
+    {
+        // Invalid content length to download.
+        return 0;
+    }
+
+    if (accepts_ranges && threads > 1)
+    {
+        int chunk_size, additional_downloads = 0;
+        // The server indicated it respects ranges so partial downloads
+        // can occur.
+        do
+        {
+            // (dividend + (divisor - 1)) / divisor is a method to perform
+            // round up integer divison.
+            chunk_size = (total_bytes + (threads + additional_downloads - 1)) / threads + additional_downloads;
+            // Make sure the chunk size does not exceed the defined max.
+            if (chunk_size > CHUNKING_MAX_BYTES)
+            {
+                // The current chunk size exceeds the maximum so there
+                // must be atleast 1 additional download required.
+                ++additional_downloads;
+            }
+        } while (chunk_size > CHUNKING_MAX_BYTES);
+
+        max_chunk_size = chunk_size;
+        return threads + additional_downloads;
+    }
+    // The server does not accept byte ranges. Therefore
+    // only a single download may occur.
+    max_chunk_size = total_bytes;
+    return 1;
+}
+
+// Make a single HEAD request, see http_probe. Any Location header is left
+// in probe->location as sent.
+static int probe_once(const char *url, const char *etag, const char *last_modified, int compressed, Probe *probe)
 {
-    struct addrinfo hints, *addr;
+    Buffer *response;
+    char value[64];
+    Connection connection;
+    Request request;
+    Url parsed;
+
+    // Try to split the url into its parts.
+    if (parse_url(url, &parsed) < 0)
+    {
+        return -1;
+    }
+
+    // Create the HTTP HEAD message to send to the server, conditional on
+    // the resource having changed when validators are known.
+    start_request(&request, "HEAD /", 6, &parsed);
+    if (etag && etag[0])
+    {
+        ADD_LITERAL(&request, "If-None-Match: ");
+        add_part(&request, etag, strlen(etag));
+        ADD_LITERAL(&request, "\r\n");
+    }
+    if (last_modified && last_modified[0])
+    {
+        ADD_LITERAL(&request, "If-Modified-Since: ");
+        add_part(&request, last_modified, strlen(last_modified));
+        ADD_LITERAL(&request, "\r\n");
+    }
+    if (compressed)
+    {
+        ADD_LITERAL(&request, "Accept-Encoding: " DECODE_ACCEPT "\r\n");
+    }
+    ADD_LITERAL(&request, "\r\n");
 
-    // Zero out then populate the hints for getaddrinfo().
-    memset(&hints, 0, sizeof(struct addrinfo));
-    hints.ai_family = AF_INET;
-    hints.ai_socktype = SOCK_STREAM;
+    // Resolve the hostname and connect using the same socket
+    // profile as the range queries.
+    if (open_connection(&connection, &parsed, 0, NULL) < 0)
+    {
+        // The hostname could not be resolved or connected to.
+        return -1;
+    }
+
+    if (send_request(&connection, &request) != 0)
+    {
+        close_connection(&connection);
+        return -1;
+    }
 
-    // Attempt to resolve the hostname to an IPv4 address.
-    if (getaddrinfo(host, NULL, &hints, &addr) != 0)
+    // Read the server response into a Buffer.
+    if (read_response(&response, &connection) != 0)
     {
-        perror("ERROR getaddrinfo");
+        // Server response couldn't be parsed into
+        // a Buffer.
+        perror("ERROR read_response");
+        if (response)
+        {
+            buffer_free(response);
+        }
+        close_connection(&connection);
         return -1;
     }
 
-    // Copy the first result returned
-    memcpy(out, addr->ai_addr, addr->ai_addrlen);
-    freeaddrinfo(addr);
+    close_connection(&connection);
+
+    memset(probe, 0, sizeof(Probe));
+    probe->status = http_status(response->data);
+
+    // Extract the content length from the server response.
+    if (http_header(response->data, "Content-Length", value, sizeof(value)) == 0)
+    {
+        probe->content_length = strtoull(value, NULL, 10);
+    }
+
+    // The server may mention Accept-Ranges but still explicitly
+    // disallow them with "none".
+    probe->accepts_ranges = http_header(response->data, "Accept-Ranges", value, sizeof(value)) == 0 &&
+                            strcasecmp(value, "bytes") == 0;
+
+    http_header(response->data, "ETag", probe->etag, sizeof(probe->etag));
+    http_header(response->data, "Last-Modified", probe->last_modified, sizeof(probe->last_modified));
+    http_header(response->data, "Content-Encoding", probe->content_encoding, sizeof(probe->content_encoding));
+    http_header(response->data, "Location", probe->location, sizeof(probe->location));
+
+    buffer_free(response);
     return 0;
 }
 
-int read_response(Buffer **dst, int *sockfd)
+static int is_redirect(int status)
 {
-    size_t bytes_read, length = BUF_SIZE;
-    char received[BUF_SIZE], *tmp;
+    return status == 301 || status == 302 || status == 303 || status == 307 || status == 308;
+}
 
-    // Initialise the Buffer that will hold the response data.
-    (*dst) = malloc(sizeof(Buffer));
-    (*dst)->data = calloc(BUF_SIZE, 1);
-    (*dst)->length = 0;
+// Resolve a Location header against the url it was received for. Returns
+// -1 if the result does not fit in size.
+static int resolve_location(const char *base, const char *location, char *dst, size_t size)
+{
+    size_t prefix, length = strlen(location);
+    Url parsed;
 
-    // While bytes can be read from the socket, read at most BUF_SIZE and append
-    // them to the Buffer.
-    while (bytes_read = read(*sockfd, received, BUF_SIZE), bytes_read > 0)
+    if (strncasecmp(location, "http://", 7) == 0 || strncasecmp(location, "https://", 8) == 0)
     {
-        // Check if the Buffer needs to be extended.
-        if ((*dst)->length + bytes_read > length)
-        {
-            // Double the length of the current buffer and reallocate.
-            length *= 2;
-            tmp = realloc((*dst)->data, length);
+        // Absolute.
+        prefix = 0;
+    }
+    else if (url_parse(base, strlen(base), &parsed) != 0)
+    {
+        return -1;
+    }
+    else if (strncmp(location, "//", 2) == 0)
+    {
+        // Relative to the scheme, which is implied by urls without one.
+        base = parsed.tls ? "https:" : "http:";
+        prefix = strlen(base);
+    }
+    else if (location[0] == '/')
+    {
+        // Relative to the host.
+        prefix = parsed.authority + parsed.authority_length - base;
+    }
+    else
+    {
+        // Relative to the directory of the page.
+        const char *page_end = parsed.query ? parsed.query - 1 : parsed.page + parsed.page_length;
+        const char *slash = page_end;
 
-            // Check realloc() did not return NULL. tmp prevents realloc() creating
-            // a memory leak if it returns a NULL pointer as access to the original
-            // memory is lost.
-            if (tmp)
-            {
-                (*dst)->data = tmp;
-            }
-            else
+        while (slash > parsed.page && slash[-1] != '/')
+        {
+            --slash;
+        }
+        prefix = slash - base;
+        if (slash == parsed.page && (parsed.page == base || parsed.page[-1] != '/'))
+        {
+            // A url without a path, e.g. example.com?x
+            if (prefix + 1 + length >= size)
             {
-                fprintf(stderr, "realloc() did not return a pointer! Likely out of memory.\n");
                 return -1;
             }
+            memcpy(dst, base, prefix);
+            dst[prefix] = '/';
+            memcpy(dst + prefix + 1, location, length + 1);
+            return 0;
         }
-        // Append the new bytes and update the length of the Buffer.
-        memcpy((*dst)->data + (*dst)->length, received, bytes_read);
-        (*dst)->length += bytes_read;
     }
 
+    if (prefix + length >= size)
+    {
+        return -1;
+    }
+    memcpy(dst, base, prefix);
+    memcpy(dst + prefix, location, length + 1);
     return 0;
 }
 
-/**
- * Perform an HTTP 1.0 query to a given host and page and port number.
- * host is a hostname and page is a path on the remote server. The query
- * will attempt to retrievev content in the given byte range.
- * User is responsible for freeing the memory.
- * 
- * @param host - The host name e.g. www.canterbury.ac.nz
- * @param page - e.g. /index.html
- * @param range - Byte range e.g. 0-500. NOTE: A server may not respect this
- * @param port - e.g. 80
- * @return Buffer - Pointer to a buffer holding response data from query
- *                  NULL is returned on failure.
- */
-Buffer *http_query(char *host, char *page, const char *range, int port)
+// Get the length of a url's directory, up to and including the last '/'
+// before any query. 0 if the url has no path.
+static size_t directory_length(const char *url)
 {
-    Buffer *data = NULL;
-    char request[BUF_SIZE];
-    int sockfd;
-
-    struct sockaddr_in addr;
-
-    sockfd = socket(AF_INET, SOCK_STREAM, 0);
-
-    // Zero out the array then create the
-    // required HTTP/1.0 GET Request packet.
-    memset(request, '\0', BUF_SIZE);
-    snprintf(request, BUF_SIZE,
-             "GET /%s HTTP/1.0\r\n"
-             "Host: %s\r\n"
-             "Range: bytes=%s\r\n"
-             "User-Agent: getter\r\n\r\n",
-             page, host, range);
-
-    // Resolve the hostname to an IPv4 address
-    if (resolve_hostname(&addr, host) != 0)
-    {
-        return NULL;
-    }
+    size_t length = strcspn(url, "?#");
+    Url parsed;
 
-    addr.sin_port = htons(port);
-
-    // Attempt to connect to the server.
-    if (connect(sockfd, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+    if (url_parse(url, length, &parsed) != 0 || parsed.page_length == 0 ||
+        parsed.page == parsed.authority + parsed.authority_length)
     {
-        perror("ERROR connect");
-        return NULL;
+        return 0;
     }
-
-    write(sockfd, request, sizeof(request));
-
-    // Read the response from the server into a Buffer.
-    if (read_response(&data, &sockfd) != 0)
+    while (length > 0 && url[length - 1] != '/')
     {
-        perror("ERROR read_response");
+        --length;
     }
-
-    close(sockfd);
-    return data;
+    return length;
 }
 
 /**
- * Separate the content from the header of an http request.
- * NOTE: returned string is an offset into the response, so
- * should not be freed by the user. Do not copy the data.
- * @param response - Buffer containing the HTTP response to separate 
- *                   content from
- * @return string response or NULL on failure (buffer is not HTTP response)
+ * Create an empty cache of redirected directories.
+ * @return cache - Pointer to the new cache
  */
-char *http_get_content(Buffer *response)
+RedirectCache *http_redirects_alloc(void)
 {
+    RedirectCache *cache = calloc(1, sizeof(RedirectCache));
 
-    char *header_end = strstr(response->data, "\r\n\r\n");
+    pthread_mutex_init(&cache->lock, NULL);
+    return cache;
+}
 
-    if (header_end)
+/**
+ * Free a cache of redirected directories.
+ * @param cache - The cache to free, or NULL to do nothing
+ */
+void http_redirects_free(RedirectCache *cache)
+{
+    if (cache == NULL)
     {
-        return header_end + 4;
+        return;
     }
-    else
+
+    while (cache->redirects)
     {
-        return response->data;
+        Redirect *next = cache->redirects->next;
+        free(cache->redirects->from);
+        free(cache->redirects->to);
+        free(cache->redirects);
+        cache->redirects = next;
     }
+    pthread_mutex_destroy(&cache->lock);
+    free(cache);
 }
 
-int split_url(const char *url, char **host, char **page)
+// Remember the directory mapping of a redirect that kept the file's name,
+// e.g. old.example.com/files/a.bin to cdn.example.com/files/a.bin.
+// Redirects that rename the file apply only to that file.
+static void remember_redirect(RedirectCache *cache, const char *from, const char *to)
 {
-    *host = calloc(BUF_SIZE, 1);
-    strncpy(*host, url, BUF_SIZE);
-
-    // Find the '/' as this splits the host and page.
-    *page = strchr(*host, '/');
+    size_t from_length = directory_length(from), to_length = directory_length(to);
+    Redirect *redirect;
 
-    if (*page)
+    if (from_length == 0 || to_length == 0 || strcmp(from + from_length, to + to_length) != 0)
     {
-        *page[0] = '\0';
+        return;
+    }
 
-        ++*page;
-        return 0;
+    pthread_mutex_lock(&cache->lock);
+    for (redirect = cache->redirects; redirect != NULL; redirect = redirect->next)
+    {
+        if (strlen(redirect->from) == from_length && strncmp(redirect->from, from, from_length) == 0)
+        {
+            break;
+        }
+    }
+    if (redirect == NULL)
+    {
+        redirect = calloc(1, sizeof(Redirect));
+        redirect->from = strndup(from, from_length);
+        redirect->next = cache->redirects;
+        cache->redirects = redirect;
     }
     else
     {
-        fprintf(stderr, "could not split url into host/page %s\n", url);
-        return -1;
+        free(redirect->to);
     }
+    redirect->to = strndup(to, to_length);
+    pthread_mutex_unlock(&cache->lock);
 }
 
-int server_accepts_ranges(const char *response)
+// Rewrite a url under a prefix that was redirected earlier in the batch,
+// choosing the longest matching prefix. Returns 0 if it was rewritten.
+static int lookup_redirect(RedirectCache *cache, const char *url, char *dst, size_t size)
 {
-    char *start, *end, range[10];
+    const Redirect *best = NULL;
+    size_t best_length = 0;
+    int rc = -1;
 
-    // Determine if the server response contains the
-    // required field.
-    start = strstr(response, "Accept-Ranges:");
-    if (start)
+    pthread_mutex_lock(&cache->lock);
+    for (const Redirect *redirect = cache->redirects; redirect != NULL; redirect = redirect->next)
     {
-        // The server mentions Accept-Ranges. However,
-        // may still explicitly disallow them.
-        // Find the start and end of the server response
-        // reguarding ranges.
-        start = strchr(start, ' ');
-        end = strchr(start, '\n');
+        size_t length = strlen(redirect->from);
 
-        strncpy(range, start, end - start);
-
-        if (strncmp("bytes", range, 10))
+        if (length > best_length && strncmp(url, redirect->from, length) == 0)
         {
-            // The server respects byte ranges
-            return 1;
+            best = redirect;
+            best_length = length;
         }
     }
-    // The server either implicitly or explicitly
-    // does not allow ranges.
-    return 0;
+    if (best && snprintf(dst, size, "%s%s", best->to, url + best_length) < (int)size)
+    {
+        rc = 0;
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    return rc;
 }
 
-size_t remote_content_length(Buffer *response)
+// Probe a url, following up to MAX_REDIRECTS redirects. The url the
+// resource was found at is left in final, and permanent is cleared unless
+// every redirect followed was permanent (301 or 308).
+static int follow_redirects(const char *url, const char *etag, const char *last_modified, int compressed,
+                            Probe *probe, char *final, int *permanent)
 {
-    char *prefix;
-    int content_length;
+    char next[HTTP_URL_SIZE];
 
-    // Extract the content length from the server response.
-    prefix = strstr(response->data, "Content-Length:");
-    if (prefix)
+    if (strlen(url) >= HTTP_URL_SIZE)
     {
-        sscanf(prefix, "Content-Length: %d\r\n", &content_length);
+        fprintf(stderr, "url is too long: %s\n", url);
+        return -1;
     }
-    else
+    strcpy(final, url);
+    *permanent = 1;
+
+    for (int hops = 0;; ++hops)
     {
-        // The server did not provide a content length.
-        return 0;
+        if (probe_once(final, etag, last_modified, compressed, probe) != 0)
+        {
+            return -1;
+        }
+        if (!is_redirect(probe->status) || probe->location[0] == '\0')
+        {
+            return 0;
+        }
+        if (hops == MAX_REDIRECTS)
+        {
+            fprintf(stderr, "ERROR | more than %d redirects for: %s\n", MAX_REDIRECTS, url);
+            return -1;
+        }
+        if (resolve_location(final, probe->location, next, sizeof(next)) != 0)
+        {
+            fprintf(stderr, "ERROR | could not follow redirect to %s from: %s\n", probe->location, final);
+            return -1;
+        }
+        strcpy(final, next);
+        *permanent &= probe->status == 301 || probe->status == 308;
+        metrics_add(redirects_followed, 1);
     }
-
-    return content_length;
 }
 
-int calc_chunking(Buffer *response, int threads)
+/**
+ * Makes a HEAD request to a given URL and records the resource's status,
+ * size, range support and validators. If a validator is given the request
+ * is conditional and an unchanged resource is reported with status 304.
+ * Redirects are followed. Permanent ones are remembered in a cache so the
+ * other urls under a redirected directory are probed at its new location
+ * directly.
+ * @param url - The URL of the resource to probe
+ * @param etag - ETag from a previous download to send as If-None-Match, or NULL
+ * @param last_modified - Last-Modified from a previous download to send as
+ *                        If-Modified-Since, or NULL
+ * @param compressed - Non-zero to ask whether the server would compress
+ *                     the resource, see http_url_decode
+ * @param redirects - Cache of redirected directories, or NULL for none
+ * @param probe - Output for the probed metadata
+ * @return 0 if the server responded, -1 on failure
+ */
+int http_probe(const char *url, const char *etag, const char *last_modified, int compressed, RedirectCache *redirects,
+               Probe *probe)
 {
-    size_t total_bytes;
+    char mapped[HTTP_URL_SIZE], final[HTTP_URL_SIZE];
+    int rc = -1, permanent;
 
-    if ((total_bytes = remote_content_length(response)) == 0)
+    // A sibling of a redirected url most likely moved with it. If not,
+    // fall back to the url itself.
+    if (redirects && lookup_redirect(redirects, url, mapped, sizeof(mapped)) == 0)
     {
-        // Invalid content length to download.
-        return 0;
+        rc = follow_redirects(mapped, etag, last_modified, compressed, probe, final, &permanent);
+        if (rc == 0 && probe->status < 400)
+        {
+            metrics_add(redirects_cached, 1);
+        }
+        else
+        {
+            rc = -1;
+        }
     }
 
-    if (server_accepts_ranges(response->data) && threads > 1)
+    if (rc != 0)
     {
-        int chunk_size, additional_downloads = 0;
-        // The server indicated it respects ranges so partial downloads
-        // can occur.
-        do
+        if ((rc = follow_redirects(url, etag, last_modified, compressed, probe, final, &permanent)) != 0)
         {
-            // (dividend + (divisor - 1)) / divisor is a method to perform
-            // round up integer divison.
-            chunk_size = (total_bytes + (threads + additional_downloads - 1)) / threads + additional_downloads;
-            // Make sure the chunk size does not exceed the defined max.
-            if (chunk_size > CHUNKING_MAX_BYTES)
-            {
-                // The current chunk size exceeds the maximum so there
-                // must be atleast 1 additional download required.
-                ++additional_downloads;
-            }
-        } while (chunk_size > CHUNKING_MAX_BYTES);
+            return -1;
+        }
+        // Temporary redirects may change on the next request, only
+        // permanent ones describe where a directory now lives.
+        if (redirects && permanent && strcmp(final, url) != 0)
+        {
+            remember_redirect(redirects, url, final);
+        }
+    }
 
-        max_chunk_size = chunk_size;
-        return threads + additional_downloads;
+    // Report where the resource was found only if it moved.
+    probe->location[0] = '\0';
+    if (strcmp(final, url) != 0)
+    {
+        strcpy(probe->location, final);
     }
-    // The server does not accept byte ranges. Therefore
-    // only a single download may occur.
-    max_chunk_size = total_bytes;
-    return 1;
+
+    return 0;
+}
+
+/**
+ * Determine the number of downloads needed to fetch a probed resource
+ * and set max_chunk_size accordingly.
+ * @param probe - Metadata from http_probe
+ * @param threads - The number of threads to be used for the download
+ * @return int  The number of downloads needed satisfying max_chunk_size,
+ *              0 if the resource has no usable content length
+ */
+int http_plan_tasks(const Probe *probe, int threads)
+{
+    if (probe->status < 200 || probe->status >= 300)
+    {
+        return 0;
+    }
+
+    return calc_chunking(probe->content_length, probe->accepts_ranges, threads);
 }
 
 /**
@@ -279,89 +1462,192 @@ int calc_chunking(Buffer *response, int threads)
  */
 int get_num_tasks(char *url, int threads)
 {
-    Buffer *response;
-    char *host, *page, request[BUF_SIZE] = {0};
-    struct sockaddr_in addr;
-    int sockfd, downloads;
+    Probe probe;
 
-    // Try to split the url into 2 parts. Host and page.
-    if (split_url(url, &host, &page) < 0)
+    if (http_probe(url, NULL, NULL, 0, NULL, &probe) != 0)
     {
-        // The url did not conform to host/page, so could
-        // not be split.
-        free(host);
         return -1;
     }
 
-    // Create the HTTP HEAD message to send to the server.
-    snprintf(request, BUF_SIZE,
-             "HEAD /%s HTTP/1.0\r\n"
-             "Host: %s\r\n"
-             "User-Agent: getter\r\n\r\n",
-             page, host);
+    return http_plan_tasks(&probe, threads);
+}
+
+/**
+ * Splits an HTTP url into host, page. On success, queries the url as
+ * http_query does, over TLS for https urls.
+ * @param url - Webpage url e.g. learn.canterbury.ac.nz/profile or
+ *              https://learn.canterbury.ac.nz:8443/profile
+ * @param range - The desired byte range of data to retrieve from the page
+ * @return Buffer pointer holding raw string data or NULL on failure
+ */
+Buffer *http_url(const char *url, const char *range)
+{
+    Buffer *data = buffer_alloc(BUF_SIZE);
 
-    // // Resolve the hostname to an IPv4 address
-    if (resolve_hostname(&addr, host) != 0)
+    if (data && http_url_into(data, url, range, 0) != 0)
     {
-        // The hostname could not be resolved.
-        perror("ERROR resolve_hostname");
-        return -1;
+        buffer_free(data);
+        return NULL;
     }
 
-    free(host);
-    addr.sin_port = htons(80);
+    return data;
+}
+
+/**
+ * Splits an HTTP url into host, page and reads the response into an
+ * existing buffer. See http_query_into, https urls are queried over TLS.
+ * @param dst - Buffer to read the response into
+ * @param url - Webpage url e.g. learn.canterbury.ac.nz/profile
+ * @param range - The desired byte range of data to retrieve from the page
+ * @param addr_hint - Index of the host's address to connect to first
+ * @return 0 on success, -1 on failure
+ */
+int http_url_into(Buffer *dst, const char *url, const char *range, int addr_hint)
+{
+    Url parsed;
 
-    // // Attempt to connect to the server.
-    sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (connect(sockfd, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+    if (parse_url(url, &parsed) < 0)
     {
-        perror("ERROR connect");
         return -1;
     }
 
-    write(sockfd, request, sizeof(request));
+    return query_url(dst, &parsed, range, addr_hint, NULL);
+}
+
+/**
+ * Query a url as http_url_into does while publishing the progress of the
+ * response, so another thread can watch it and cancel it.
+ * @param dst - Buffer to read the response into, holds whatever was
+ *              received even on failure
+ * @param url - Webpage url e.g. learn.canterbury.ac.nz/profile
+ * @param range - The desired byte range of data to retrieve from the page
+ * @param addr_hint - Index of the host's address to connect to first
+ * @param transfer - Progress of the response, see Transfer, or NULL
+ * @return 0 on success, -1 on failure or once cancelled
+ */
+int http_url_transfer(Buffer *dst, const char *url, const char *range, int addr_hint, Transfer *transfer)
+{
+    Url parsed;
 
-    // Read the server response into a Buffer.
-    if (read_response(&response, &sockfd) != 0)
+    dst->length = 0;
+    dst->data[0] = '\0';
+    if (parse_url(url, &parsed) < 0)
     {
-        // Server response couldn't be parsed into
-        // a Buffer.
-        perror("ERROR read_response");
-        close(sockfd);
         return -1;
     }
 
-    close(sockfd);
-
-    downloads = calc_chunking(response, threads);
-
-    free(response->data);
-    free(response);
+    return query_url(dst, &parsed, range, addr_hint, transfer);
+}
 
-    return downloads;
+/**
+ * Stop a transfer from another thread. Its connection is shut down so a
+ * read blocked on a stalled server returns at once, and a transfer that
+ * has not connected yet fails as soon as it does.
+ * @param transfer - The transfer to stop
+ */
+void http_cancel(Transfer *transfer)
+{
+    pthread_mutex_lock(&transfers_lock);
+    transfer->cancelled = 1;
+    if (transfer->fd >= 0)
+    {
+        shutdown(transfer->fd, SHUT_RDWR);
+    }
+    pthread_mutex_unlock(&transfers_lock);
 }
 
 /**
- * Splits an HTTP url into host, page. On success, calls http_query
- * to execute the query against the url. 
- * @param url - Webpage url e.g. learn.canterbury.ac.nz/profile
- * @param range - The desired byte range of data to retrieve from the page
- * @return Buffer pointer holding raw string data or NULL on failure
+ * Download a whole resource into a file, accepting compressed content
+ * codings and decoding them as the body arrives. Only a buffer's worth of
+ * the response is held in memory at once.
+ * @param url - The URL of the resource to download
+ * @param fd - File descriptor to write the decoded resource to, from offset 0
+ * @param scratch - Buffer to receive into, its capacity bounds memory use
+ *                  and must hold the whole response header
+ * @param addr_hint - Preference for which resolved address to connect to
+ * @param received - Output for the number of bytes received, header included
+ * @return The decoded size in bytes, or -1 on failure
  */
-Buffer *http_url(const char *url, const char *range)
+ssize_t http_url_decode(const char *url, int fd, Buffer *scratch, int addr_hint, size_t *received)
 {
-    char *host, *page;
+    char *header_end = NULL, encoding[64] = "";
+    Decoder *decoder = NULL;
+    ssize_t bytes_read, decoded = -1;
+    Connection connection;
+    Request request;
+    Url parsed;
 
-    if (split_url(url, &host, &page) < 0)
+    *received = 0;
+    if (parse_url(url, &parsed) < 0)
     {
-        free(host);
-        return NULL;
+        return -1;
     }
 
-    Buffer *data = http_query(host, page, range, 80);
+    start_request(&request, "GET /", 5, &parsed);
+    ADD_LITERAL(&request, "Accept-Encoding: " DECODE_ACCEPT "\r\n\r\n");
 
-    free(host);
-    return data;
+    if (open_connection(&connection, &parsed, addr_hint, NULL) < 0)
+    {
+        return -1;
+    }
+
+    if (send_request(&connection, &request) != 0)
+    {
+        close_connection(&connection);
+        return -1;
+    }
+
+    // Read until the whole header has arrived.
+    scratch->length = 0;
+    while (header_end == NULL && scratch->length + 1 < scratch->capacity)
+    {
+        if ((bytes_read = read_some(&connection, scratch->data + scratch->length, scratch->capacity - scratch->length - 1)) <= 0)
+        {
+            break;
+        }
+        scratch->length += bytes_read;
+        scratch->data[scratch->length] = '\0';
+        header_end = strstr(scratch->data, "\r\n\r\n");
+    }
+    *received = scratch->length;
+
+    if (header_end == NULL || http_status(scratch->data) != 200)
+    {
+        fprintf(stderr, "ERROR | unexpected response for: %s\n", url);
+        close_connection(&connection);
+        return -1;
+    }
+
+    http_header(scratch->data, "Content-Encoding", encoding, sizeof(encoding));
+    if ((decoder = decoder_alloc(encoding, fd)) == NULL)
+    {
+        close_connection(&connection);
+        return -1;
+    }
+
+    // Decode whatever of the body arrived with the header, then the rest
+    // of the body a buffer at a time.
+    header_end += 4;
+    bytes_read = scratch->length - (header_end - scratch->data);
+    if (decoder_write(decoder, header_end, bytes_read) == 0)
+    {
+        while ((bytes_read = read_some(&connection, scratch->data, scratch->capacity)) > 0)
+        {
+            *received += bytes_read;
+            if (decoder_write(decoder, scratch->data, bytes_read) != 0)
+            {
+                break;
+            }
+        }
+        if (bytes_read == 0)
+        {
+            decoded = decoder_finish(decoder);
+        }
+    }
+
+    decoder_free(decoder);
+    close_connection(&connection);
+    return decoded;
 }
 
 int get_max_chunk_size()
@@ -1,15 +1,92 @@
 #ifndef HTTP_H
 #define HTTP_H
 
+#include <stddef.h>
+#include <sys/types.h>
 
-// A buffer object with data, and a length
+// A buffer object with data, a length and the allocated capacity
 typedef struct {
     char *data;
     size_t length;
+    size_t capacity;
 
 } Buffer;
 
 
+// A range download that other threads can watch and stop, see
+// http_url_transfer. Set fd to -1 and the rest to 0 before starting it.
+typedef struct {
+    size_t body;   // Bytes of a 206 response's body received so far, read atomically
+    int fd;        // Socket of the open connection, -1 otherwise
+    int cancelled; // Set once http_cancel has been called
+
+} Transfer;
+
+
+// Options applied to every socket opened for a query or probe.
+typedef struct {
+    int rcvbuf;             // SO_RCVBUF in bytes, 0 leaves the kernel default (autotuning)
+    int read_size;          // Maximum bytes requested per read()
+    int nodelay;            // Set TCP_NODELAY so requests are sent immediately
+    int quickack;           // Set TCP_QUICKACK to disable delayed ACKs while receiving
+    int connect_timeout_ms; // Give up connecting after this long, 0 waits forever
+    int read_timeout_ms;    // Give up on a stalled response after this long, 0 waits forever
+    char congestion[16];    // TCP_CONGESTION algorithm e.g. "bbr", empty for the default
+
+} SocketProfile;
+
+
+/**
+ * Replace the socket profile used for all subsequent connections.
+ * Not thread-safe, call before spawning workers.
+ * @param profile - The profile to copy
+ */
+void http_set_socket_profile(const SocketProfile *profile);
+
+
+/**
+ * Get the socket profile currently in use.
+ * @return Pointer to the active profile
+ */
+const SocketProfile *http_get_socket_profile(void);
+
+
+/**
+ * Allocate an empty buffer with the given capacity. The memory is touched
+ * by the calling thread so it is placed on that thread's NUMA node.
+ * @param capacity - Initial size in bytes of the data array
+ * @return Buffer - Pointer to the allocated buffer or NULL on failure
+ */
+Buffer *buffer_alloc(size_t capacity);
+
+
+/**
+ * Open a TCP connection to host:port with the socket profile applied.
+ * All of the host's IPv4 and IPv6 addresses are raced with staggered
+ * starts, beginning with the address selected by addr_hint.
+ * @param host - The host name e.g. www.canterbury.ac.nz
+ * @param port - e.g. 80
+ * @param addr_hint - Index of the address to try first, wraps around the
+ *                    number of addresses. Used to spread connections.
+ * @return The connected socket or -1 on failure
+ */
+int http_connect(const char *host, int port, int addr_hint);
+
+
+/**
+ * Get the number of addresses a host resolved to.
+ * @param host - The host name e.g. www.canterbury.ac.nz
+ * @return The number of addresses, 0 if the host could not be resolved
+ */
+int http_num_addresses(const char *host);
+
+
+/**
+ * Free the cached hostname resolutions and TLS sessions.
+ */
+void http_cleanup(void);
+
+
 /**
  * Perform an HTTP 1.0 query to a given host and page and port number.
  * host is a hostname and page is a path on the remote server. The query
@@ -26,6 +103,22 @@ typedef struct {
 Buffer* http_query(char *host, char *page, const char *range, int port);
 
 
+/**
+ * Perform the same query as http_query but read the response into an
+ * existing buffer, growing it if required. Lets a worker reuse one
+ * receive buffer for every task instead of allocating per response.
+ * 
+ * @param dst - Buffer to read the response into. Existing content is discarded
+ * @param host - The host name e.g. www.canterbury.ac.nz
+ * @param page - e.g. /index.html
+ * @param range - Byte range e.g. 0-500. NOTE: A server may not respect this
+ * @param port - e.g. 80
+ * @param addr_hint - Index of the host's address to connect to first
+ * @return 0 on success, -1 on failure
+ */
+int http_query_into(Buffer *dst, char *host, char *page, const char *range, int port, int addr_hint);
+
+
 /**
  * Separate the content from the header of an http request.
  * NOTE: returned string is an offset into the response, so
@@ -38,15 +131,66 @@ char* http_get_content(Buffer *response);
 
 
 /**
- * Splits an HTTP url into host, page. On success, calls http_query
- * to execute the query against the url. 
- * @param url - Webpage url e.g. learn.canterbury.ac.nz/profile
+ * Splits an HTTP url into host, page. On success, queries the url as
+ * http_query does, over TLS for https urls.
+ * @param url - Webpage url e.g. learn.canterbury.ac.nz/profile or
+ *              https://learn.canterbury.ac.nz:8443/profile
  * @param range - The desired byte range of data to retrieve from the page
  * @return Buffer pointer holding raw string data or NULL on failure
  */
 Buffer *http_url(const char *url, const char *range);
 
 
+/**
+ * Splits an HTTP url into host, page and reads the response into an
+ * existing buffer. See http_query_into, https urls are queried over TLS.
+ * @param dst - Buffer to read the response into
+ * @param url - Webpage url e.g. learn.canterbury.ac.nz/profile
+ * @param range - The desired byte range of data to retrieve from the page
+ * @param addr_hint - Index of the host's address to connect to first
+ * @return 0 on success, -1 on failure
+ */
+int http_url_into(Buffer *dst, const char *url, const char *range, int addr_hint);
+
+
+/**
+ * Query a url as http_url_into does while publishing the progress of the
+ * response, so another thread can watch it and cancel it.
+ * @param dst - Buffer to read the response into, holds whatever was
+ *              received even on failure
+ * @param url - Webpage url e.g. learn.canterbury.ac.nz/profile
+ * @param range - The desired byte range of data to retrieve from the page
+ * @param addr_hint - Index of the host's address to connect to first
+ * @param transfer - Progress of the response, see Transfer, or NULL
+ * @return 0 on success, -1 on failure or once cancelled
+ */
+int http_url_transfer(Buffer *dst, const char *url, const char *range, int addr_hint, Transfer *transfer);
+
+
+/**
+ * Stop a transfer from another thread. Its connection is shut down so a
+ * read blocked on a stalled server returns at once, and a transfer that
+ * has not connected yet fails as soon as it does.
+ * @param transfer - The transfer to stop
+ */
+void http_cancel(Transfer *transfer);
+
+
+/**
+ * Download a whole resource into a file, accepting compressed content
+ * codings and decoding them as the body arrives. Only a buffer's worth of
+ * the response is held in memory at once.
+ * @param url - The URL of the resource to download
+ * @param fd - File descriptor to write the decoded resource to, from offset 0
+ * @param scratch - Buffer to receive into, its capacity bounds memory use
+ *                  and must hold the whole response header
+ * @param addr_hint - Preference for which resolved address to connect to
+ * @param received - Output for the number of bytes received, header included
+ * @return The decoded size in bytes, or -1 on failure
+ */
+ssize_t http_url_decode(const char *url, int fd, Buffer *scratch, int addr_hint, size_t *received);
+
+
 /**
  * Free a buffer
  * @param buffer - Pointer to a buffer to free
@@ -57,6 +201,96 @@ inline static void buffer_free(Buffer *buffer) {
 }
 
 
+// Longest url followed by a redirect.
+#define HTTP_URL_SIZE 2048
+
+// Metadata about a remote resource returned by a HEAD request.
+typedef struct {
+    int status;                // HTTP status code e.g. 200, or 304 when unchanged
+    size_t content_length;     // Size in bytes, 0 if unknown
+    int accepts_ranges;        // The server accepts byte range requests
+    char etag[128];            // ETag validator, empty if not sent
+    char last_modified[64];    // Last-Modified validator, empty if not sent
+    char content_encoding[64]; // Content-Encoding the server would apply, empty if none
+    char location[HTTP_URL_SIZE]; // Url the resource was found at after redirects, empty if not redirected
+
+} Probe;
+
+
+/*
+ * RedirectCache - directories that were permanently redirected (301 or
+ * 308) while probing, so the other urls under them are probed at their
+ * new location directly. Kept for one batch of downloads.
+ */
+typedef struct RedirectCacheStruct RedirectCache;
+
+
+/**
+ * Create an empty cache of redirected directories.
+ * @return cache - Pointer to the new cache
+ */
+RedirectCache *http_redirects_alloc(void);
+
+
+/**
+ * Free a cache of redirected directories.
+ * @param cache - The cache to free, or NULL to do nothing
+ */
+void http_redirects_free(RedirectCache *cache);
+
+
+/**
+ * Makes a HEAD request to a given URL and records the resource's status,
+ * size, range support and validators. If a validator is given the request
+ * is conditional and an unchanged resource is reported with status 304.
+ * Redirects are followed. Permanent ones are remembered in a cache so the
+ * other urls under a redirected directory are probed at its new location
+ * directly.
+ * @param url - The URL of the resource to probe
+ * @param etag - ETag from a previous download to send as If-None-Match, or NULL
+ * @param last_modified - Last-Modified from a previous download to send as
+ *                        If-Modified-Since, or NULL
+ * @param compressed - Non-zero to ask whether the server would compress
+ *                     the resource, see http_url_decode
+ * @param redirects - Cache of redirected directories, or NULL for none
+ * @param probe - Output for the probed metadata
+ * @return 0 if the server responded, -1 on failure
+ */
+int http_probe(const char *url, const char *etag, const char *last_modified, int compressed, RedirectCache *redirects,
+               Probe *probe);
+
+
+/**
+ * Determine the number of downloads needed to fetch a probed resource
+ * and set max_chunk_size accordingly.
+ * @param probe - Metadata from http_probe
+ * @param threads - The number of threads to be used for the download
+ * @return int  The number of downloads needed satisfying max_chunk_size,
+ *              0 if the resource has no usable content length
+ */
+int http_plan_tasks(const Probe *probe, int threads);
+
+
+/**
+ * Find a header in an HTTP response and copy its value, without leading
+ * or trailing whitespace. Header names are matched case-insensitively.
+ * @param response - NUL terminated response, only the header is searched
+ * @param name - Header name without the colon e.g. Content-Length
+ * @param value - Output buffer for the value
+ * @param size - Size of the value buffer
+ * @return 0 if the header was found, -1 otherwise
+ */
+int http_header(const char *response, const char *name, char *value, size_t size);
+
+
+/**
+ * Get the status code of an HTTP response.
+ * @param response - NUL terminated response
+ * @return The status code e.g. 200, or -1 if the status line is invalid
+ */
+int http_status(const char *response);
+
+
 /**
  * Makes a HEAD request to a given URL and gets the content length
  * maxByteSize is set from this, and number of split downloads determined
@@ -67,7 +301,7 @@ inline static void buffer_free(Buffer *buffer) {
  */
 int get_num_tasks(char *url, int threads);
 
-int max_chunk_size; // The maximum size in bytes of a chunk to download
+extern int max_chunk_size; // The maximum size in bytes of a chunk to download
 
 int get_max_chunk_size(void);
 
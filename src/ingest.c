@@ -0,0 +1,383 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "ingest.h"
+#include "scheduler.h"
+#include "url.h"
+
+// Slices smaller than this are not worth a thread of their own (Default = 1MB)
+#define MIN_SLICE_BYTES 1048576
+// Size in bytes of the chunks each parser allocates sets from (Default = 1MB)
+#define SET_CHUNK_BYTES 1048576
+// The most mirrors a single line may list.
+#define MAX_MIRRORS 64
+// Longest host:port a mirror's statistics are kept under
+#define HOST_KEY_SIZE 1100
+
+// A contiguous run of whole lines parsed by one thread.
+typedef struct
+{
+    const char *start;
+    const char *end;
+
+    InternTable *strings;
+    Arena *arena;
+
+    MirrorSet **entries;
+    size_t count;
+    size_t capacity;
+} Slice;
+
+// Shortest hex digest accepted, long enough to never be a port number.
+#define MIN_DIGEST_HEX 32
+
+// Determine whether a token is a content digest of the form
+// algorithm:hex e.g. sha256:9f86d0... rather than a url.
+static int is_digest(const char *token, const char *end)
+{
+    const char *colon = memchr(token, ':', end - token);
+
+    if (colon == NULL || colon == token || end - (colon + 1) < MIN_DIGEST_HEX)
+    {
+        return 0;
+    }
+    for (const char *p = token; p < colon; ++p)
+    {
+        if (!isalnum((unsigned char)*p))
+        {
+            return 0;
+        }
+    }
+    for (const char *p = colon + 1; p < end; ++p)
+    {
+        if (!isxdigit((unsigned char)*p))
+        {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+// Parse a "priority=CLASS" or "deadline=SECONDS" token into the set being
+// built. Returns 0 if the token is not one of them.
+static int parse_option(const char *token, const char *end, int *priority, double *deadline)
+{
+    static const char *classes[SCHED_NUM_CLASSES] = {"high", "normal", "bulk"};
+    size_t length = end - token;
+    char value[32];
+
+    if (length > 9 && strncmp(token, "priority=", 9) == 0)
+    {
+        for (int i = 0; i < SCHED_NUM_CLASSES; ++i)
+        {
+            if (length - 9 == strlen(classes[i]) && strncmp(token + 9, classes[i], length - 9) == 0)
+            {
+                *priority = i;
+                return 1;
+            }
+        }
+        fprintf(stderr, "unknown priority, expected high, normal or bulk: %.*s\n", (int)length, token);
+        return 1;
+    }
+
+    if (length > 9 && length - 9 < sizeof(value) && strncmp(token, "deadline=", 9) == 0)
+    {
+        char *rest;
+
+        memcpy(value, token + 9, length - 9);
+        value[length - 9] = '\0';
+        *deadline = strtod(value, &rest);
+        if (*rest != '\0' || *deadline < 0)
+        {
+            fprintf(stderr, "invalid deadline, expected seconds: %.*s\n", (int)length, token);
+            *deadline = 0;
+        }
+        return 1;
+    }
+
+    return 0;
+}
+
+// Parse a single line into a mirror set allocated from the slice's arena.
+static MirrorSet *parse_line(Slice *slice, const char *p, const char *end)
+{
+    const char *urls[MAX_MIRRORS], *hosts[MAX_MIRRORS], *digest = NULL;
+    int count = 0, priority = SCHED_NORMAL;
+    double deadline = 0;
+    MirrorSet *set;
+
+    while (p < end && count < MAX_MIRRORS)
+    {
+        const char *url;
+        Url parsed;
+
+        while (p < end && isspace((unsigned char)*p))
+        {
+            ++p;
+        }
+
+        url = p;
+        while (p < end && !isspace((unsigned char)*p))
+        {
+            ++p;
+        }
+        if (p == url)
+        {
+            break;
+        }
+
+        if (is_digest(url, p))
+        {
+            digest = intern(slice->strings, url, p - url);
+            continue;
+        }
+        if (parse_option(url, p, &priority, &deadline))
+        {
+            continue;
+        }
+
+        if (url_parse(url, p - url, &parsed) != 0)
+        {
+            fprintf(stderr, "skipping malformed url: %.*s\n", (int)(p - url), url);
+            continue;
+        }
+
+        // Mirror statistics are kept per host and port, which the
+        // authority leaves out when it is the scheme's default.
+        char host[HOST_KEY_SIZE];
+        int length = snprintf(host, sizeof(host), "%.*s:%d", (int)parsed.host_length, parsed.host, parsed.port);
+
+        if (length < 0 || length >= (int)sizeof(host))
+        {
+            fprintf(stderr, "skipping url with a host that is too long: %.*s\n", (int)(p - url), url);
+            continue;
+        }
+        urls[count] = intern(slice->strings, url, p - url);
+        hosts[count++] = intern(slice->strings, host, length);
+    }
+
+    if (count == 0)
+    {
+        return NULL;
+    }
+
+    set = arena_push(slice->arena, sizeof(MirrorSet));
+    set->urls = arena_push(slice->arena, sizeof(char *) * count);
+    set->hosts = arena_push(slice->arena, sizeof(char *) * count);
+    set->count = count;
+    set->digest = digest;
+    set->priority = priority;
+    set->deadline = deadline;
+    memcpy(set->urls, urls, sizeof(char *) * count);
+    memcpy(set->hosts, hosts, sizeof(char *) * count);
+
+    return set;
+}
+
+static void *parse_slice(void *arg)
+{
+    Slice *slice = (Slice *)arg;
+    const char *p = slice->start;
+
+    while (p < slice->end)
+    {
+        const char *eol = memchr(p, '\n', slice->end - p);
+        MirrorSet *set;
+
+        if (eol == NULL)
+        {
+            eol = slice->end;
+        }
+
+        if ((set = parse_line(slice, p, eol)) != NULL)
+        {
+            if (slice->count == slice->capacity)
+            {
+                slice->capacity = slice->capacity ? slice->capacity * 2 : 1024;
+                slice->entries = realloc(slice->entries, sizeof(MirrorSet *) * slice->capacity);
+            }
+            slice->entries[slice->count++] = set;
+        }
+
+        p = eol + 1;
+    }
+
+    return NULL;
+}
+
+// Parse a buffer of url_file lines into list, slicing it across threads.
+static void parse_buffer(UrlList *list, const char *map, size_t size, int threads)
+{
+    Slice *slices;
+    pthread_t *parsers;
+    size_t offset = 0;
+    const char *p;
+
+    if (threads <= 0)
+    {
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (threads > size / MIN_SLICE_BYTES + 1)
+    {
+        threads = size / MIN_SLICE_BYTES + 1;
+    }
+
+    slices = calloc(threads, sizeof(Slice));
+    parsers = malloc(sizeof(pthread_t) * threads);
+    list->arenas = malloc(sizeof(Arena *) * threads);
+    list->num_arenas = threads;
+
+    // Cut the buffer into roughly equal slices, moving each cut forward to
+    // the next line break so no line is split between two parsers.
+    p = map;
+    for (int i = 0; i < threads; ++i)
+    {
+        const char *end = map + size * (i + 1) / threads;
+
+        if (end < p)
+        {
+            end = p;
+        }
+        while (end < map + size && end > map && end[-1] != '\n')
+        {
+            ++end;
+        }
+
+        slices[i].start = p;
+        slices[i].end = end;
+        slices[i].strings = list->strings;
+        slices[i].arena = list->arenas[i] = arena_alloc(SET_CHUNK_BYTES);
+        p = end;
+
+        if (pthread_create(&parsers[i], NULL, parse_slice, &slices[i]) != 0)
+        {
+            perror("ERROR pthread_create");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    for (int i = 0; i < threads; ++i)
+    {
+        pthread_join(parsers[i], NULL);
+        list->count += slices[i].count;
+    }
+
+    // Stitch the slices back together in file order.
+    list->entries = malloc(sizeof(MirrorSet *) * (list->count ? list->count : 1));
+    for (int i = 0; i < threads; ++i)
+    {
+        memcpy(list->entries + offset, slices[i].entries, sizeof(MirrorSet *) * slices[i].count);
+        for (size_t j = 0; j < slices[i].count; ++j)
+        {
+            slices[i].entries[j]->index = offset + j;
+        }
+        offset += slices[i].count;
+        free(slices[i].entries);
+    }
+
+    free(parsers);
+    free(slices);
+}
+
+/**
+ * Read a url_file by memory-mapping it and parsing slices of it in
+ * parallel. Each non-empty line lists one or more whitespace separated
+ * mirrors of the same file, optionally with the file's content digest,
+ * priority=high|normal|bulk and deadline=SECONDS.
+ * @param path - Path of the url_file
+ * @param threads - Maximum number of parsing threads, 0 to use every CPU
+ * @return Pointer to the parsed list or NULL if the file could not be read
+ */
+UrlList *ingest_url_file(const char *path, int threads)
+{
+    struct stat st;
+    const char *map;
+    UrlList *list;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0 || fstat(fd, &st) != 0)
+    {
+        perror("ERROR open url_file");
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        return NULL;
+    }
+
+    list = calloc(1, sizeof(UrlList));
+    list->strings = intern_alloc();
+
+    if (st.st_size == 0)
+    {
+        close(fd);
+        return list;
+    }
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        perror("ERROR mmap url_file");
+        ingest_free(list);
+        return NULL;
+    }
+    // The advice values are not flags, each needs its own call. They are
+    // only hints, parsing works without them.
+    if (madvise((void *)map, st.st_size, MADV_SEQUENTIAL) != 0)
+    {
+        perror("ERROR madvise sequential url_file");
+    }
+    if (madvise((void *)map, st.st_size, MADV_WILLNEED) != 0)
+    {
+        perror("ERROR madvise willneed url_file");
+    }
+
+    parse_buffer(list, map, st.st_size, threads);
+
+    // Every string has been copied into the intern table.
+    munmap((void *)map, st.st_size);
+
+    return list;
+}
+
+/**
+ * Parse url_file lines held in memory, e.g. a single url.
+ * @param data - The lines
+ * @param size - Length of data in bytes
+ * @return Pointer to the parsed list
+ */
+UrlList *ingest_urls(const char *data, size_t size)
+{
+    UrlList *list = calloc(1, sizeof(UrlList));
+
+    list->strings = intern_alloc();
+    parse_buffer(list, data, size, 1);
+
+    return list;
+}
+
+/**
+ * Free a url list and every set, url and host it holds.
+ * @param list - The list to free
+ */
+void ingest_free(UrlList *list)
+{
+    for (int i = 0; i < list->num_arenas; ++i)
+    {
+        arena_free(list->arenas[i]);
+    }
+
+    intern_free(list->strings);
+    free(list->arenas);
+    free(list->entries);
+    free(list);
+}
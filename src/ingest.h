@@ -0,0 +1,56 @@
+#ifndef INGEST_H
+#define INGEST_H
+
+#include <stddef.h>
+
+#include "mirror.h"
+#include "intern.h"
+#include "arena.h"
+
+
+/*
+ * UrlList - every file listed in a url_file, in file order. The urls and
+ * hosts are interned and the sets are allocated from per-thread arenas,
+ * all of which live until ingest_free.
+ */
+typedef struct
+{
+    MirrorSet **entries;
+    size_t count;
+
+    InternTable *strings;
+    Arena **arenas;
+    int num_arenas;
+
+} UrlList;
+
+
+/**
+ * Read a url_file by memory-mapping it and parsing slices of it in
+ * parallel. Each non-empty line lists one or more whitespace separated
+ * mirrors of the same file, optionally with the file's content digest,
+ * priority=high|normal|bulk and deadline=SECONDS.
+ * @param path - Path of the url_file
+ * @param threads - Maximum number of parsing threads, 0 to use every CPU
+ * @return Pointer to the parsed list or NULL if the file could not be read
+ */
+UrlList *ingest_url_file(const char *path, int threads);
+
+
+/**
+ * Parse url_file lines held in memory, e.g. a single url.
+ * @param data - The lines
+ * @param size - Length of data in bytes
+ * @return Pointer to the parsed list
+ */
+UrlList *ingest_urls(const char *data, size_t size);
+
+
+/**
+ * Free a url list and every set, url and host it holds.
+ * @param list - The list to free
+ */
+void ingest_free(UrlList *list);
+
+
+#endif
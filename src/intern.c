@@ -0,0 +1,181 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "intern.h"
+#include "arena.h"
+
+// Number of independently locked shards. Threads interning different
+// strings rarely contend for the same shard.
+#define NUM_SHARDS 64
+#define INITIAL_SLOTS 256
+// Size in bytes of the chunks string copies are allocated from (Default = 1MB)
+#define STRING_CHUNK_BYTES 1048576
+
+typedef struct
+{
+    uint64_t hash;
+    const char *string;
+    size_t length;
+} Slot;
+
+typedef struct
+{
+    pthread_mutex_t lock;
+    Arena *strings;
+
+    // Open addressing hash table with linear probing. capacity is always
+    // a power of two and the table is kept at most half full.
+    Slot *slots;
+    size_t capacity;
+    size_t count;
+} Shard;
+
+struct InternTableStruct
+{
+    Shard shards[NUM_SHARDS];
+};
+
+// 64 bit FNV-1a.
+static uint64_t hash_string(const char *s, size_t length)
+{
+    uint64_t hash = 14695981039346656037ULL;
+
+    for (size_t i = 0; i < length; ++i)
+    {
+        hash ^= (unsigned char)s[i];
+        hash *= 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+// Double the capacity of a shard and re-insert its strings.
+static void shard_grow(Shard *shard)
+{
+    size_t capacity = shard->capacity * 2;
+    Slot *slots = calloc(capacity, sizeof(Slot));
+
+    for (size_t i = 0; i < shard->capacity; ++i)
+    {
+        if (shard->slots[i].string)
+        {
+            size_t index = shard->slots[i].hash & (capacity - 1);
+            while (slots[index].string)
+            {
+                index = (index + 1) & (capacity - 1);
+            }
+            slots[index] = shard->slots[i];
+        }
+    }
+
+    free(shard->slots);
+    shard->slots = slots;
+    shard->capacity = capacity;
+}
+
+/**
+ * Allocate an empty intern table.
+ * @return table - Pointer to the allocated table
+ */
+InternTable *intern_alloc(void)
+{
+    InternTable *table = malloc(sizeof(InternTable));
+
+    for (int i = 0; i < NUM_SHARDS; ++i)
+    {
+        Shard *shard = &table->shards[i];
+
+        pthread_mutex_init(&shard->lock, NULL);
+        shard->strings = arena_alloc(STRING_CHUNK_BYTES);
+        shard->slots = calloc(INITIAL_SLOTS, sizeof(Slot));
+        shard->capacity = INITIAL_SLOTS;
+        shard->count = 0;
+    }
+
+    return table;
+}
+
+/**
+ * Get the canonical copy of a string, adding it to the table if it has not
+ * been seen before. Safe to call from several threads at once.
+ * @param table - The table to intern into
+ * @param s - The string, need not be NUL terminated
+ * @param length - Number of characters in s
+ * @return Pointer to the NUL terminated canonical copy, valid until the
+ *         table is freed
+ */
+const char *intern(InternTable *table, const char *s, size_t length)
+{
+    uint64_t hash = hash_string(s, length);
+    // The low bits pick the slot, so use the high bits to pick the shard.
+    Shard *shard = &table->shards[hash >> 58 & (NUM_SHARDS - 1)];
+    const char *string;
+    size_t index;
+
+    pthread_mutex_lock(&shard->lock);
+
+    index = hash & (shard->capacity - 1);
+    while (shard->slots[index].string)
+    {
+        Slot *slot = &shard->slots[index];
+        if (slot->hash == hash && slot->length == length && memcmp(slot->string, s, length) == 0)
+        {
+            // Read the slot before unlocking, another thread may grow the
+            // shard and free the slots as soon as the lock is released.
+            string = slot->string;
+            pthread_mutex_unlock(&shard->lock);
+            return string;
+        }
+        index = (index + 1) & (shard->capacity - 1);
+    }
+
+    // Not seen before, store a copy in the empty slot the probe ended on.
+    string = arena_strndup(shard->strings, s, length);
+    shard->slots[index] = (Slot){.hash = hash, .string = string, .length = length};
+
+    if (++shard->count * 2 > shard->capacity)
+    {
+        shard_grow(shard);
+    }
+
+    pthread_mutex_unlock(&shard->lock);
+    return string;
+}
+
+/**
+ * Get the number of distinct strings held by a table.
+ * @param table - The table to query
+ * @return The number of strings
+ */
+size_t intern_count(InternTable *table)
+{
+    size_t count = 0;
+
+    for (int i = 0; i < NUM_SHARDS; ++i)
+    {
+        pthread_mutex_lock(&table->shards[i].lock);
+        count += table->shards[i].count;
+        pthread_mutex_unlock(&table->shards[i].lock);
+    }
+
+    return count;
+}
+
+/**
+ * Free a table and every string it holds.
+ * @param table - The table to free
+ */
+void intern_free(InternTable *table)
+{
+    for (int i = 0; i < NUM_SHARDS; ++i)
+    {
+        pthread_mutex_destroy(&table->shards[i].lock);
+        arena_free(table->shards[i].strings);
+        free(table->shards[i].slots);
+    }
+
+    free(table);
+}
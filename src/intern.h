@@ -0,0 +1,49 @@
+#ifndef INTERN_H
+#define INTERN_H
+
+#include <stddef.h>
+
+
+/*
+ * InternTable - a concurrent set of strings. Interning a string returns a
+ * single canonical copy, so equal strings can be compared by pointer and
+ * are only stored once however often they occur.
+ */
+typedef struct InternTableStruct InternTable;
+
+
+/**
+ * Allocate an empty intern table.
+ * @return table - Pointer to the allocated table
+ */
+InternTable *intern_alloc(void);
+
+
+/**
+ * Get the canonical copy of a string, adding it to the table if it has not
+ * been seen before. Safe to call from several threads at once.
+ * @param table - The table to intern into
+ * @param s - The string, need not be NUL terminated
+ * @param length - Number of characters in s
+ * @return Pointer to the NUL terminated canonical copy, valid until the
+ *         table is freed
+ */
+const char *intern(InternTable *table, const char *s, size_t length);
+
+
+/**
+ * Get the number of distinct strings held by a table.
+ * @param table - The table to query
+ * @return The number of strings
+ */
+size_t intern_count(InternTable *table);
+
+
+/**
+ * Free a table and every string it holds.
+ * @param table - The table to free
+ */
+void intern_free(InternTable *table);
+
+
+#endif
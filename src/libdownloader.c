@@ -0,0 +1,1686 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <math.h>
+#include <stddef.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "http.h"
+#include "scheduler.h"
+#include "admission.h"
+#include "writer.h"
+#include "metrics.h"
+#include "mirror.h"
+#include "ingest.h"
+#include "arena.h"
+#include "output.h"
+#include "cache.h"
+#include "dedup.h"
+#include "decode.h"
+#include "libdownloader.h"
+
+// The initial size in bytes of each worker's receive buffer (Default = 1MB)
+#define RECV_BUFFER_BYTES 1048576
+// Size in bytes of the chunks tasks are carved from (Default = 64KB)
+#define TASK_CHUNK_BYTES 65536
+// Number of write-behind threads writing downloaded ranges (Default = 2)
+#define WRITER_THREADS 2
+// Name of the index of previously downloaded urls within the cache directory
+#define CACHE_INDEX_NAME ".downloader-index"
+// Smallest unfinished tail of a range worth hedging (Default = 64KB)
+#define HEDGE_MIN_BYTES 65536
+// How many times longer than a fresh connection a range must be expected
+// to take to finish before its tail is hedged (Default = 2)
+#define HEDGE_SLOWDOWN 2
+
+// The files of one job and where they are written. A batch is freed once
+// every file has finished, by whichever thread finishes the last.
+typedef struct Batch
+{
+    int id;
+    UrlList *urls;
+    size_t files;
+    int compress;
+    int verbose;
+    int sync;
+    int hedge;
+    int cancelled;
+
+    // When the job was submitted, the time file deadlines count from.
+    double submitted;
+
+    // Where files are written, and the content cache they are linked into
+    // when it is a separate directory (NULL otherwise).
+    OutputDir *output;
+    OutputDir *cache;
+    CacheIndex *index;
+    DedupTable *dedup;
+    RedirectCache *redirects;
+
+    // Files not yet finished, plus one while the batch is being submitted.
+    int pending;
+    int outcomes[DOWNLOAD_NUM_OUTCOMES];
+
+    DownloadCallbacks callbacks;
+
+    // Batches in progress, and batches waiting to be submitted.
+    struct Batch *next;
+    struct Batch *next_submitted;
+} Batch;
+
+// State shared by every range task of one file. Whichever task finishes
+// last records the outcome of the whole file.
+typedef struct Task Task;
+
+typedef struct
+{
+    // The batch the file belongs to and every origin it can be fetched from.
+    Batch *batch;
+    MirrorSet *mirrors;
+
+    int pending; // Range tasks not yet finished, updated atomically
+    int failed;  // Set when any range task fails
+
+    // Size and validators to record in the cache index once complete.
+    CacheEntry metadata;
+
+    // Identity of the object in the dedup table, NULL when not deduplicated.
+    char *dedup_key;
+
+    // The server compresses the file, so it is fetched whole by a single
+    // task and decoded as it arrives.
+    int decode;
+
+    // When the file should be complete by, 0 for no deadline.
+    double deadline;
+
+    // Where the probed mirror redirected to, NULL if it did not. Its range
+    // tasks go straight to the new location.
+    int located;
+    const char *location;
+
+    // The output file shared by every range task, moved into place once
+    // every range is present.
+    OutputFile *output;
+
+    // Hedging of slow ranges, guarded by lock. Ranges being downloaded are
+    // listed in running and hedged signals whenever a hedge finishes.
+    pthread_mutex_t lock;
+    pthread_cond_t hedged;
+    Task *running;
+    int unstarted;      // Range tasks not yet taken by a worker
+    size_t budget;      // Bytes that may still be requested again by hedges
+    size_t done_bytes;  // Size of the ranges downloaded so far
+    double done_time;   // Seconds spent downloading them
+    int done_ranges;
+} FileJob;
+
+// What has become of a hedge of a range's tail.
+enum
+{
+    HEDGE_NONE,
+    HEDGE_RUNNING,
+    HEDGE_FINISHED,
+};
+
+// A duplicate request for the unfinished tail of a slow range, made by
+// another worker on a fresh connection. Whichever of it and the original
+// request finishes first provides the tail.
+typedef struct
+{
+    int state;
+    int beaten;    // The original request finished first
+    size_t from;   // Offset within the range the tail starts at
+    Transfer transfer;
+
+    // The tail once the hedge has won, NULL otherwise.
+    Buffer *result;
+    char *data;
+    size_t length;
+} Hedge;
+
+struct Task
+{
+    // The file this range belongs to, and the mirror the planner assigned
+    // the range to.
+    FileJob *job;
+    int mirror;
+
+    int min_range;
+    int max_range;
+
+    // The downloaded range, handed to the writers together with the buffer
+    // holding it.
+    WriteRequest write;
+    Buffer *result;
+
+    // Identifies the task in the log as file-part.
+    int file;
+    int part;
+
+    // Which of the host's addresses to connect to first, so the ranges of
+    // one file are spread across every address the host resolved to.
+    int addr_hint;
+
+    // When the task was queued, to measure how long it waited for a worker.
+    double queued;
+
+    // The download in progress, watched by the other workers of the file
+    // so they can hedge it if it falls behind. Guarded by the job's lock.
+    double started;
+    size_t expected;
+    Transfer transfer;
+    Hedge hedge;
+    Task *next_running;
+
+    // Next task in the pool's free list while the task is not in use.
+    Task *next;
+};
+
+// Tasks are recycled through a free list and new ones are carved from an
+// arena, so once the pool is warm creating a task never calls malloc.
+// Receive buffers handed to the writers come back to the pool as spares.
+typedef struct
+{
+    pthread_mutex_t lock;
+    Arena *arena;
+    Task *free;
+
+    Buffer **spares;
+    int num_spares;
+    int max_spares;
+} TaskPool;
+
+typedef struct DownloaderStruct Context;
+
+typedef struct
+{
+    Context *context;
+    int index;
+    int cpu;
+
+    // Receive buffer reused for every task. Allocated by the worker itself
+    // after it has been placed so the pages are local to its NUMA node.
+    Buffer *recv;
+} Worker;
+
+struct DownloaderStruct
+{
+    Scheduler *todo;
+    Admission *admission;
+    Writer *writer;
+    TaskPool tasks;
+
+    // Batches in progress, finished is signalled whenever one finishes.
+    pthread_mutex_t lock;
+    pthread_cond_t finished;
+    Batch *batches;
+
+    // Batches waiting for the planner thread to probe and queue them.
+    pthread_cond_t submitted;
+    Batch *queued;
+    Batch **queued_tail;
+    pthread_t planner;
+    int stopping;
+
+    pthread_t *threads;
+    Worker *workers;
+    int num_workers;
+};
+
+// Free a batch once all of its files have finished, saving its cache index
+// for the next run.
+static void close_batch(Context *context, Batch *batch)
+{
+    Batch **link;
+
+    if (batch->dedup)
+    {
+        dedup_free(batch->dedup);
+    }
+    http_redirects_free(batch->redirects);
+    if (batch->index)
+    {
+        cache_save(batch->index);
+        cache_free(batch->index);
+    }
+    if (batch->cache)
+    {
+        output_dir_close(batch->cache);
+    }
+    output_dir_close(batch->output);
+    ingest_free(batch->urls);
+
+    if (batch->callbacks.done)
+    {
+        batch->callbacks.done(batch->callbacks.arg, batch->id, batch->outcomes);
+    }
+
+    // The batch is only forgotten once it is completely done, so waiters
+    // never return before the last callback.
+    pthread_mutex_lock(&context->lock);
+    for (link = &context->batches; *link != batch; link = &(*link)->next)
+    {
+    }
+    *link = batch->next;
+    pthread_cond_broadcast(&context->finished);
+    pthread_mutex_unlock(&context->lock);
+
+    free(batch);
+}
+
+// Drop one of a batch's pending references, closing it with the last.
+static void release_batch(Context *context, Batch *batch)
+{
+    if (__atomic_sub_fetch(&batch->pending, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        close_batch(context, batch);
+    }
+}
+
+// Record how a file of a batch finished. The batch and its urls may be
+// freed once this returns.
+static void finish_file(Context *context, Batch *batch, const char *url, int outcome)
+{
+    __atomic_add_fetch(&batch->outcomes[outcome], 1, __ATOMIC_RELAXED);
+    if (batch->callbacks.complete)
+    {
+        batch->callbacks.complete(batch->callbacks.arg, batch->id, url, outcome);
+    }
+    release_batch(context, batch);
+}
+
+// Record a file that is complete in the download directory in the cache
+// index so the next run can skip it if it is unchanged.
+static void record_file(FileJob *job)
+{
+    Batch *batch = job->batch;
+    const char *url = job->mirrors->urls[0];
+
+    metrics_add(files_completed, 1);
+    if (job->deadline > 0)
+    {
+        if (scheduler_now() <= job->deadline)
+        {
+            metrics_add(deadlines_met, 1);
+        }
+        else
+        {
+            metrics_add(deadlines_missed, 1);
+        }
+    }
+    if (batch->index)
+    {
+        cache_update(batch->index, url, &job->metadata);
+    }
+    if (batch->cache)
+    {
+        output_link(batch->output, batch->cache, url);
+    }
+}
+
+// Materialize a duplicate file from the completed download of the same
+// object instead of downloading it again.
+static void materialize_file(Context *context, const char *primary, FileJob *job)
+{
+    const char *url = job->mirrors->urls[0];
+
+    switch (output_clone(job->batch->output, primary, url))
+    {
+    case OUTPUT_REFLINK:
+        metrics_add(dedup_reflinks, 1);
+        break;
+    case OUTPUT_HARDLINK:
+        metrics_add(dedup_hardlinks, 1);
+        break;
+    case OUTPUT_COPY:
+        metrics_add(dedup_copies, 1);
+        break;
+    default:
+        fprintf(stderr, "ERROR | could not materialize %s from %s\n", url, primary);
+        metrics_add(files_failed, 1);
+        finish_file(context, job->batch, url, DOWNLOAD_FAILED);
+        return;
+    }
+
+    if (job->batch->verbose)
+    {
+        printf("duplicate: %s of %s\n", url, primary);
+    }
+    metrics_add(bytes_deduplicated, job->metadata.size);
+    record_file(job);
+    finish_file(context, job->batch, url, DOWNLOAD_DUPLICATE);
+}
+
+static void free_job(FileJob *job)
+{
+    pthread_mutex_destroy(&job->lock);
+    pthread_cond_destroy(&job->hedged);
+    free(job);
+}
+
+// Record the outcome of a file once all of its range tasks have finished,
+// then materialize any duplicates that were waiting on it.
+static void complete_file(Context *context, FileJob *job)
+{
+    const char *url = job->mirrors->urls[0];
+    int failure = job->batch->cancelled ? DOWNLOAD_CANCELLED : DOWNLOAD_FAILED;
+    void **aliases = NULL;
+    int num_aliases = 0, reported = 0;
+
+    // Every range task has finished, so the file can be flushed and moved
+    // into place before it is recorded or linked anywhere. A file with
+    // ranges missing is never moved into place, even if no task reported
+    // an error.
+    if (job->output)
+    {
+        int holes;
+        long long missing = output_missing(job->output, &holes);
+
+        if (!job->failed && job->batch->sync == DOWNLOAD_SYNC_FILE && fsync(output_file_fd(job->output)) != 0)
+        {
+            perror("ERROR fsync");
+            job->failed = 1;
+        }
+
+        if (!job->failed && output_commit(job->output) == 0)
+        {
+            job->output = NULL;
+        }
+        else
+        {
+            // Unwritten ranges are holes in the partial file, which is kept
+            // so what was downloaded can be inspected.
+            if (missing > 0 && failure == DOWNLOAD_FAILED)
+            {
+                fprintf(stderr, "ERROR | %s is missing %lld bytes in %d ranges, partial download kept as %s.part\n",
+                        url, missing, holes, url);
+                metrics_add(files_incomplete, 1);
+                metrics_add(bytes_missing, missing);
+                reported = 1;
+            }
+            output_abandon(job->output, missing > 0 && failure == DOWNLOAD_FAILED);
+            job->failed = 1;
+        }
+    }
+
+    if (job->failed && failure == DOWNLOAD_FAILED)
+    {
+        if (!reported)
+        {
+            fprintf(stderr, "ERROR | incomplete download: %s\n", url);
+        }
+        metrics_add(files_failed, 1);
+    }
+    else if (!job->failed)
+    {
+        record_file(job);
+    }
+
+    if (job->dedup_key)
+    {
+        num_aliases = dedup_finish(job->batch->dedup, job->dedup_key, !job->failed, &aliases);
+        free(job->dedup_key);
+    }
+    for (int i = 0; i < num_aliases; ++i)
+    {
+        FileJob *alias = (FileJob *)aliases[i];
+
+        if (job->failed)
+        {
+            if (failure == DOWNLOAD_FAILED)
+            {
+                fprintf(stderr, "ERROR | incomplete download: %s (duplicate of %s)\n", alias->mirrors->urls[0], url);
+                metrics_add(files_failed, 1);
+            }
+            finish_file(context, alias->batch, alias->mirrors->urls[0], failure);
+        }
+        else
+        {
+            materialize_file(context, url, alias);
+        }
+        free_job(alias);
+    }
+    free(aliases);
+
+    // The file is finished last as it may free the batch.
+    finish_file(context, job->batch, url, job->failed ? failure : DOWNLOAD_OK);
+    free_job(job);
+}
+
+// Take a spare receive buffer, allocating one if there are none.
+static Buffer *take_buffer(Context *context)
+{
+    Buffer *buffer = NULL;
+
+    pthread_mutex_lock(&context->tasks.lock);
+    if (context->tasks.num_spares > 0)
+    {
+        buffer = context->tasks.spares[--context->tasks.num_spares];
+    }
+    pthread_mutex_unlock(&context->tasks.lock);
+
+    if (buffer == NULL && (buffer = buffer_alloc(RECV_BUFFER_BYTES)) == NULL)
+    {
+        fprintf(stderr, "could not allocate receive buffer\n");
+        exit(EXIT_FAILURE);
+    }
+
+    return buffer;
+}
+
+// Keep a buffer the writers are done with for the next worker that needs
+// one, freeing it if there are already enough spares.
+static void return_buffer(Context *context, Buffer *buffer)
+{
+    pthread_mutex_lock(&context->tasks.lock);
+    if (context->tasks.num_spares < context->tasks.max_spares)
+    {
+        context->tasks.spares[context->tasks.num_spares++] = buffer;
+        buffer = NULL;
+    }
+    pthread_mutex_unlock(&context->tasks.lock);
+
+    if (buffer)
+    {
+        buffer_free(buffer);
+    }
+}
+
+static void free_task(Context *context, Task *task, int ok)
+{
+    FileJob *job = task->job;
+
+    if (task->result)
+    {
+        return_buffer(context, task->result);
+        task->result = NULL;
+    }
+
+    if (!ok)
+    {
+        __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+    }
+    if (__atomic_sub_fetch(&job->pending, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        complete_file(context, job);
+    }
+
+    // Make room for the planner to queue more work.
+    admission_release(context->admission, 1, task->max_range - task->min_range);
+
+    // Return the task to the pool for reuse.
+    pthread_mutex_lock(&context->tasks.lock);
+    task->next = context->tasks.free;
+    context->tasks.free = task;
+    pthread_mutex_unlock(&context->tasks.lock);
+}
+
+// Get the url to fetch a file's ranges from a mirror.
+static const char *mirror_url(const FileJob *job, int mirror)
+{
+    return job->location && mirror == job->located ? job->location : job->mirrors->urls[mirror];
+}
+
+// Check that a range response holds the version of the file that was
+// probed, so a stale mirror cannot splice another version's bytes into it.
+// A 206 must start at the requested offset and report the probed size, and
+// a strong ETag must match the probed one.
+static int same_version(const FileJob *job, const char *response, size_t start)
+{
+    unsigned long long first, total;
+    char value[sizeof(job->metadata.etag)];
+
+    if (http_status(response) == 206)
+    {
+        int fields;
+
+        if (http_header(response, "Content-Range", value, sizeof(value)) != 0)
+        {
+            return 0;
+        }
+        // The total may be given as * when the server does not know it.
+        fields = sscanf(value, "bytes %llu-%*u/%llu", &first, &total);
+        if (fields < 1 || first != start || (fields == 2 && job->metadata.size > 0 && total != job->metadata.size))
+        {
+            return 0;
+        }
+    }
+
+    if (job->metadata.etag[0] && strncmp(job->metadata.etag, "W/", 2) != 0 &&
+        http_header(response, "ETag", value, sizeof(value)) == 0 && strcmp(value, job->metadata.etag) != 0)
+    {
+        return 0;
+    }
+
+    return 1;
+}
+
+// Fetch a whole compressed file, decoding it into the output file through
+// the worker's receive buffer. Each mirror is tried in turn.
+static int fetch_decoded(Worker *worker, Task *task)
+{
+    MirrorSet *mirrors = task->job->mirrors;
+    Batch *batch = task->job->batch;
+
+    for (int attempt = 0; attempt < mirrors->count; ++attempt)
+    {
+        int current = (task->mirror + attempt) % mirrors->count;
+        const char *url = mirror_url(task->job, current);
+        struct timespec start, end;
+        size_t received;
+        ssize_t decoded;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        decoded = http_url_decode(url, output_file_fd(task->job->output), worker->recv, task->addr_hint, &received);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        metrics_add(bytes_downloaded, received);
+
+        if (decoded >= 0)
+        {
+            mirror_record(mirrors->hosts[current], received, (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+            if (batch->verbose)
+            {
+                printf("[%03d-%03d] downloaded %zu bytes from %s, decoded to %zd bytes\n", task->file, task->part, received, url, decoded);
+            }
+            if (batch->callbacks.progress)
+            {
+                batch->callbacks.progress(batch->callbacks.arg, batch->id, mirrors->urls[0], decoded);
+            }
+
+            // The decoded size is only known now, record it for the cache.
+            task->job->metadata.size = decoded;
+            metrics_add(files_decoded, 1);
+            metrics_add(bytes_decoded, decoded);
+            metrics_add(tasks_completed, 1);
+            return 1;
+        }
+
+        fprintf(stderr, "ERROR | downloading: %s\n", url);
+        mirror_record_failure(mirrors->hosts[current]);
+    }
+
+    metrics_add(tasks_failed, 1);
+    return 0;
+}
+
+// Start downloading a range. When hedging, the range is listed so the
+// file's other workers can watch how far it has got.
+static void begin_range(Task *task)
+{
+    FileJob *job = task->job;
+
+    task->started = scheduler_now();
+    task->transfer = (Transfer){.fd = -1};
+    task->hedge.state = HEDGE_NONE;
+    task->hedge.beaten = 0;
+    task->hedge.result = NULL;
+
+    if (job->batch->hedge)
+    {
+        pthread_mutex_lock(&job->lock);
+        job->unstarted--;
+        task->next_running = job->running;
+        job->running = task;
+        pthread_mutex_unlock(&job->lock);
+    }
+}
+
+// Stop listing a range, adding it to the file's throughput if it was
+// downloaded.
+static void end_range(Task *task, int ok)
+{
+    FileJob *job = task->job;
+    Task **link;
+
+    if (job->batch->hedge)
+    {
+        pthread_mutex_lock(&job->lock);
+        for (link = &job->running; *link != task; link = &(*link)->next_running)
+        {
+        }
+        *link = task->next_running;
+        if (ok)
+        {
+            job->done_bytes += task->expected;
+            job->done_time += scheduler_now() - task->started;
+            job->done_ranges++;
+        }
+        pthread_mutex_unlock(&job->lock);
+    }
+}
+
+// Once every range of a file has started, find the one furthest behind and
+// claim it for a hedge of its unfinished tail. A fresh connection is
+// expected to deliver at the pace of the ranges already downloaded, and a
+// range is only behind once it has taken longer than they did on average.
+// Returns NULL if no range is slow enough to be worth the extra bytes.
+static Task *claim_straggler(FileJob *job)
+{
+    double now = scheduler_now(), worst = 0;
+    Task *straggler = NULL;
+    size_t from = 0;
+
+    pthread_mutex_lock(&job->lock);
+    if (job->unstarted == 0 && job->done_ranges > 0 && job->done_time > 0)
+    {
+        double rate = job->done_bytes / job->done_time, typical = job->done_time / job->done_ranges;
+
+        for (Task *task = job->running; task != NULL; task = task->next_running)
+        {
+            size_t body = __atomic_load_n(&task->transfer.body, __ATOMIC_RELAXED), remaining;
+            double elapsed = now - task->started, left;
+
+            if (task->hedge.state != HEDGE_NONE || elapsed < typical || body >= task->expected)
+            {
+                continue;
+            }
+            remaining = task->expected - body;
+            if (remaining < HEDGE_MIN_BYTES || remaining > job->budget)
+            {
+                continue;
+            }
+
+            // Time left at the range's own pace, against a fresh connection.
+            left = body > 0 ? remaining * elapsed / body : INFINITY;
+            if (left > HEDGE_SLOWDOWN * remaining / rate && left > worst)
+            {
+                worst = left;
+                straggler = task;
+                from = body;
+            }
+        }
+    }
+
+    if (straggler)
+    {
+        straggler->hedge.state = HEDGE_RUNNING;
+        straggler->hedge.from = from;
+        straggler->hedge.transfer = (Transfer){.fd = -1};
+        job->budget -= straggler->expected - from;
+    }
+    pthread_mutex_unlock(&job->lock);
+
+    return straggler;
+}
+
+// Download the unfinished tail of a straggling range on a fresh connection,
+// from the fastest mirror and another of its addresses. If the tail arrives
+// before the original request finishes, the original is cancelled and the
+// tail handed to the range's task.
+static void run_hedge(Context *context, Worker *worker, Task *task)
+{
+    FileJob *job = task->job;
+    Hedge *hedge = &task->hedge;
+    const char *url = mirror_url(job, mirror_select(job->mirrors, task->mirror));
+    size_t tail = task->expected - hedge->from;
+    char range[64], *data = NULL;
+    int won = 0;
+
+    snprintf(range, sizeof(range), "%zu-%d", task->min_range + hedge->from, task->max_range - 1);
+    metrics_add(hedges_sent, 1);
+    metrics_add(bytes_hedged, tail);
+
+    if (http_url_transfer(worker->recv, url, range, task->addr_hint + 1, &hedge->transfer) == 0 &&
+        http_status(worker->recv->data) == 206 && same_version(job, worker->recv->data, task->min_range + hedge->from))
+    {
+        data = http_get_content(worker->recv);
+        if (worker->recv->length - (data - worker->recv->data) < tail)
+        {
+            data = NULL;
+        }
+    }
+
+    pthread_mutex_lock(&job->lock);
+    if (data && !hedge->beaten)
+    {
+        hedge->result = worker->recv;
+        hedge->data = data;
+        hedge->length = tail;
+        http_cancel(&task->transfer);
+        won = 1;
+    }
+    hedge->state = HEDGE_FINISHED;
+    pthread_cond_broadcast(&job->hedged);
+    pthread_mutex_unlock(&job->lock);
+
+    // The task may be finished and reused from here on.
+    if (won)
+    {
+        worker->recv = take_buffer(context);
+    }
+}
+
+// Resolve a hedge of the task's tail once the original request for the
+// range has finished, with the range's data or NULL if it failed. Waits
+// for the hedge to finish, then joins its tail to the head of the range
+// the original received if it won. Returns the range's data, or NULL if
+// neither request provided it.
+static char *settle_hedge(Context *context, Worker *worker, Task *task, char *data)
+{
+    FileJob *job = task->job;
+    Hedge *hedge = &task->hedge;
+    Buffer *recv = worker->recv, *tail;
+    size_t offset, size;
+
+    pthread_mutex_lock(&job->lock);
+    if (hedge->state == HEDGE_RUNNING && data)
+    {
+        hedge->beaten = 1;
+        http_cancel(&hedge->transfer);
+    }
+    while (hedge->state == HEDGE_RUNNING)
+    {
+        pthread_cond_wait(&job->hedged, &job->lock);
+    }
+    tail = hedge->result;
+    hedge->result = NULL;
+
+    // Any further attempt at the range starts a fresh transfer.
+    task->transfer = (Transfer){.fd = -1};
+    pthread_mutex_unlock(&job->lock);
+
+    if (tail == NULL)
+    {
+        return data;
+    }
+    if (data)
+    {
+        // Both finished, the original's range is complete already.
+        return_buffer(context, tail);
+        return data;
+    }
+    metrics_add(hedges_won, 1);
+
+    if (hedge->from == 0)
+    {
+        // Nothing of the range had arrived, the tail is all of it.
+        return_buffer(context, recv);
+        worker->recv = tail;
+        return hedge->data;
+    }
+
+    // The head is still in the receive buffer, as a cancelled request keeps
+    // what it received.
+    offset = http_get_content(recv) - recv->data;
+    size = offset + hedge->from + hedge->length;
+    if (size + 1 > recv->capacity)
+    {
+        char *grown = realloc(recv->data, size + 1);
+
+        if (grown == NULL)
+        {
+            fprintf(stderr, "realloc() did not return a pointer! Likely out of memory.\n");
+            return_buffer(context, tail);
+            return NULL;
+        }
+        recv->data = grown;
+        recv->capacity = size + 1;
+    }
+    memcpy(recv->data + offset + hedge->from, hedge->data, hedge->length);
+    recv->length = size;
+    recv->data[size] = '\0';
+    return_buffer(context, tail);
+
+    return recv->data + offset;
+}
+
+// Wait for the next task to work on, recording how long it was queued.
+static Task *next_task(Context *context)
+{
+    Task *task = (Task *)scheduler_get(context->todo);
+
+    if (task)
+    {
+        unsigned long waited = (scheduler_now() - task->queued) * 1e6;
+
+        metrics_add(queue_waits, 1);
+        metrics_add(queue_wait_us, waited);
+        metrics_max(queue_wait_max_us, waited);
+    }
+
+    return task;
+}
+
+static void *worker_thread(void *arg)
+{
+    Worker *worker = (Worker *)arg;
+    Context *context = worker->context;
+
+    if ((worker->recv = buffer_alloc(RECV_BUFFER_BYTES)) == NULL)
+    {
+        fprintf(stderr, "could not allocate receive buffer for worker %d\n", worker->index);
+        exit(EXIT_FAILURE);
+    }
+
+    Task *task = next_task(context);
+    char *range = (char *)malloc(1024);
+
+    while (task)
+    {
+        MirrorSet *mirrors = task->job->mirrors;
+        Batch *batch = task->job->batch;
+        int mirror = mirror_select(mirrors, task->mirror), ok = 0;
+        const char *url = NULL;
+        char *data = NULL;
+
+        // Ranges of a cancelled job are dropped without being downloaded.
+        if (__atomic_load_n(&batch->cancelled, __ATOMIC_RELAXED))
+        {
+            free_task(context, task, 0);
+            task = next_task(context);
+            continue;
+        }
+
+        if (task->job->decode)
+        {
+            ok = fetch_decoded(worker, task);
+            free_task(context, task, ok);
+            task = next_task(context);
+            continue;
+        }
+
+        // Byte ranges are inclusive, the task covers [min_range, max_range).
+        // The last range may run past the end of the file.
+        snprintf(range, 1024, "%d-%d", task->min_range, task->max_range - 1);
+        size_t expected = task->max_range - task->min_range;
+        if (task->job->metadata.size > 0 && task->max_range > task->job->metadata.size)
+        {
+            expected = task->job->metadata.size - task->min_range;
+        }
+        task->expected = expected;
+        begin_range(task);
+
+        if (mirror != task->mirror)
+        {
+            // The planned mirror has proven too slow, fetch from a faster one.
+            metrics_add(ranges_migrated, 1);
+        }
+
+        // Try each mirror in turn, starting with the selected one, until
+        // one of them provides the range.
+        for (int attempt = 0; attempt < mirrors->count && data == NULL; ++attempt)
+        {
+            struct timespec start, end;
+            int current = (mirror + attempt) % mirrors->count;
+
+            url = mirror_url(task->job, current);
+            clock_gettime(CLOCK_MONOTONIC, &start);
+
+            if (http_url_transfer(worker->recv, url, range, task->addr_hint, batch->hedge ? &task->transfer : NULL) == 0)
+            {
+                clock_gettime(CLOCK_MONOTONIC, &end);
+                mirror_record(mirrors->hosts[current], worker->recv->length, (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+
+                // Strip the header information from the Buffer.
+                data = http_get_content(worker->recv);
+                int status = http_status(worker->recv->data);
+
+                // Only the requested range may be written. A server that
+                // ignores Range sends the whole file instead, which is only
+                // the range when this task covers all of the file.
+                if (status != 206 && !(status == 200 && task->min_range == 0 && expected == task->job->metadata.size))
+                {
+                    fprintf(stderr, "ERROR | unexpected status %d for %s bytes %s\n", status, url, range);
+                    mirror_record_failure(mirrors->hosts[current]);
+                    data = NULL;
+                }
+                // Only the probed mirror was checked for the version of the
+                // file, any other may be serving a stale one.
+                else if (!same_version(task->job, worker->recv->data, task->min_range))
+                {
+                    fprintf(stderr, "ERROR | %s serves another version of the file, bytes %s\n", url, range);
+                    mirror_record_failure(mirrors->hosts[current]);
+                    data = NULL;
+                }
+                // A connection that closed early leaves the range short, which
+                // is a failure of this mirror rather than the end of the file.
+                else if (worker->recv->length - (data - worker->recv->data) < expected)
+                {
+                    fprintf(stderr, "ERROR | short response for %s bytes %s\n", url, range);
+                    mirror_record_failure(mirrors->hosts[current]);
+                    data = NULL;
+                }
+            }
+            else if (!__atomic_load_n(&task->transfer.cancelled, __ATOMIC_RELAXED))
+            {
+                fprintf(stderr, "ERROR | downloading: %s\n", url);
+                mirror_record_failure(mirrors->hosts[current]);
+            }
+
+            // A hedge of the range's tail may have finished it instead.
+            if (batch->hedge)
+            {
+                data = settle_hedge(context, worker, task, data);
+            }
+        }
+        end_range(task, data != NULL);
+
+        if (data)
+        {
+            // Anything the server sent past the end of the range belongs to
+            // other ranges and is not written.
+            size_t length = expected;
+            if (batch->verbose)
+            {
+                printf("[%03d-%03d] downloaded %zu bytes from %s\n", task->file, task->part, length, url);
+            }
+            metrics_add(bytes_downloaded, length);
+            metrics_add(tasks_completed, 1);
+
+            // Hand the range to the writers along with the buffer holding it
+            // and carry on with a spare, so a slow disk does not hold up the
+            // network. The task is finished once the range is written.
+            task->result = worker->recv;
+            task->write.fd = output_file_fd(task->job->output);
+            task->write.offset = task->min_range;
+            task->write.data = data;
+            task->write.length = length;
+            task->write.sync = batch->sync == DOWNLOAD_SYNC_RANGE;
+            worker->recv = take_buffer(context);
+
+            // Rather than move on, hedge a range of the same file that is
+            // holding it up. The claimed range keeps the file from being
+            // finished, so it is claimed before this range is submitted.
+            Task *straggler = batch->hedge ? claim_straggler(task->job) : NULL;
+
+            writer_submit(context->writer, &task->write);
+            if (straggler)
+            {
+                run_hedge(context, worker, straggler);
+            }
+        }
+        else
+        {
+            metrics_add(tasks_failed, 1);
+            free_task(context, task, 0);
+        }
+
+        task = next_task(context);
+    }
+
+    free(range);
+    buffer_free(worker->recv);
+    return NULL;
+}
+
+// Finish a task once the writers have written its range.
+static void write_done(void *arg, WriteRequest *request, ssize_t written)
+{
+    Context *context = (Context *)arg;
+    Task *task = (Task *)((char *)request - offsetof(Task, write));
+    Batch *batch = task->job->batch;
+    int ok = written == (ssize_t)request->length;
+
+    if (!ok)
+    {
+        // Whatever part of the range reached the file is not trusted.
+        fprintf(stderr, "[%03d-%03d] ERROR | could not write bytes to file for: %s\n", task->file, task->part, task->job->mirrors->urls[0]);
+        output_punch(task->job->output, request->offset, request->length);
+    }
+    else
+    {
+        output_written(task->job->output, request->offset, request->length);
+        if (batch->callbacks.progress)
+        {
+            batch->callbacks.progress(batch->callbacks.arg, batch->id, task->job->mirrors->urls[0], request->length);
+        }
+    }
+
+    free_task(context, task, ok);
+}
+
+static Context *spawn_workers(int num_workers, const AffinityPlan *plan)
+{
+    Context *context = malloc(sizeof(Context));
+
+    context->todo = scheduler_alloc();
+    context->admission = admission_alloc(DOWNLOAD_INFLIGHT_TASKS, DOWNLOAD_INFLIGHT_BYTES);
+    pthread_mutex_init(&context->tasks.lock, NULL);
+    context->tasks.arena = arena_alloc(TASK_CHUNK_BYTES);
+    context->tasks.free = NULL;
+    context->tasks.num_spares = 0;
+    context->tasks.max_spares = num_workers * 2;
+    context->tasks.spares = malloc(sizeof(Buffer *) * context->tasks.max_spares);
+    context->writer = writer_alloc(WRITER_THREADS, num_workers, write_done, context);
+    pthread_mutex_init(&context->lock, NULL);
+    pthread_cond_init(&context->finished, NULL);
+    pthread_cond_init(&context->submitted, NULL);
+    context->batches = NULL;
+    context->queued = NULL;
+    context->queued_tail = &context->queued;
+    context->stopping = 0;
+    context->num_workers = num_workers;
+    context->threads = (pthread_t *)malloc(sizeof(pthread_t) * num_workers);
+    context->workers = (Worker *)calloc(num_workers, sizeof(Worker));
+
+    for (int i = 0; i < num_workers; ++i)
+    {
+        pthread_attr_t attr;
+        Worker *worker = &context->workers[i];
+
+        worker->context = context;
+        worker->index = i;
+        worker->cpu = affinity_worker_cpu(plan, i);
+
+        pthread_attr_init(&attr);
+
+        // Pin the worker before it starts so that everything it allocates,
+        // including its receive buffer, is first touched on its own node.
+        if (worker->cpu >= 0)
+        {
+            cpu_set_t cpus;
+
+            CPU_ZERO(&cpus);
+            CPU_SET(worker->cpu, &cpus);
+            if (pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), &cpus) != 0)
+            {
+                perror("ERROR pthread_attr_setaffinity_np");
+                exit(EXIT_FAILURE);
+            }
+            printf("worker %d pinned to cpu %d (node %d)\n", i, worker->cpu, affinity_cpu_node(worker->cpu));
+        }
+
+        if (pthread_create(&context->threads[i], &attr, worker_thread, worker) != 0)
+        {
+            perror("ERROR pthread_create");
+            exit(EXIT_FAILURE);
+        }
+        pthread_attr_destroy(&attr);
+    }
+
+    return context;
+}
+
+static void free_workers(Context *context)
+{
+    scheduler_close(context->todo);
+
+    for (int i = 0; i < context->num_workers; ++i)
+    {
+        if (pthread_join(context->threads[i], NULL) != 0)
+        {
+            perror("ERROR pthread_join");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // Every job has finished so nothing is left for the writers.
+    writer_free(context->writer);
+    for (int i = 0; i < context->tasks.num_spares; ++i)
+    {
+        buffer_free(context->tasks.spares[i]);
+    }
+    free(context->tasks.spares);
+    scheduler_free(context->todo);
+    admission_free(context->admission);
+    arena_free(context->tasks.arena);
+    pthread_mutex_destroy(&context->tasks.lock);
+    pthread_mutex_destroy(&context->lock);
+    pthread_cond_destroy(&context->finished);
+    pthread_cond_destroy(&context->submitted);
+
+    free(context->workers);
+    free(context->threads);
+    free(context);
+}
+
+static Task *new_task(Context *context, FileJob *job, int mirror, int min_range, int max_range, int file, int part)
+{
+    Task *task;
+
+    // Reuse a finished task if there is one, otherwise carve a new one
+    // from the arena. Only this thread allocates from the arena.
+    pthread_mutex_lock(&context->tasks.lock);
+    if ((task = context->tasks.free) != NULL)
+    {
+        context->tasks.free = task->next;
+    }
+    pthread_mutex_unlock(&context->tasks.lock);
+
+    if (task == NULL)
+    {
+        task = arena_push(context->tasks.arena, sizeof(Task));
+    }
+
+    task->result = NULL;
+
+    task->job = job;
+    task->mirror = mirror;
+
+    task->file = file;
+    task->part = part;
+
+    task->min_range = min_range;
+    task->max_range = max_range;
+
+    task->addr_hint = part;
+
+    return task;
+}
+
+// Open the download directory and cache index for a parsed list of urls.
+// The batch takes ownership of the list, which is freed on failure.
+static Batch *open_batch(UrlList *urls, const char *download_dir, const DownloadOptions *options, const DownloadCallbacks *callbacks)
+{
+    static const DownloadOptions defaults = {.use_cache = 1};
+    static int next_id = 1;
+    Batch *batch = calloc(1, sizeof(Batch));
+
+    if (options == NULL)
+    {
+        options = &defaults;
+    }
+
+    batch->urls = urls;
+    batch->files = urls->count;
+    batch->submitted = scheduler_now();
+    batch->compress = options->compress;
+    batch->verbose = options->verbose;
+    batch->sync = options->sync;
+    batch->hedge = options->hedge;
+    if (callbacks)
+    {
+        batch->callbacks = *callbacks;
+    }
+
+    if ((batch->output = output_dir_open(download_dir)) == NULL)
+    {
+        goto fail;
+    }
+
+    // Files from previous runs are validated against the index kept in the
+    // cache directory, which defaults to the download directory itself.
+    if (options->use_cache)
+    {
+        char index_path[4096];
+
+        if (options->cache_dir != NULL && (batch->cache = output_dir_open(options->cache_dir)) == NULL)
+        {
+            goto fail;
+        }
+        snprintf(index_path, sizeof(index_path), "%s/%s", options->cache_dir ? options->cache_dir : download_dir, CACHE_INDEX_NAME);
+        if ((batch->index = cache_load(index_path)) == NULL)
+        {
+            goto fail;
+        }
+    }
+
+    batch->id = __atomic_fetch_add(&next_id, 1, __ATOMIC_RELAXED);
+    batch->dedup = options->dedup ? dedup_alloc() : NULL;
+    batch->redirects = http_redirects_alloc();
+    batch->pending = urls->count + 1;
+
+    return batch;
+
+fail:
+    if (batch->cache)
+    {
+        output_dir_close(batch->cache);
+    }
+    if (batch->output)
+    {
+        output_dir_close(batch->output);
+    }
+    ingest_free(urls);
+    free(batch);
+    return NULL;
+}
+
+// Order files by priority class, then deadline with files that have none
+// last, then their position in the url_file.
+static int compare_files(const void *a, const void *b)
+{
+    const MirrorSet *x = *(const MirrorSet **)a, *y = *(const MirrorSet **)b;
+    double x_deadline = x->deadline > 0 ? x->deadline : INFINITY;
+    double y_deadline = y->deadline > 0 ? y->deadline : INFINITY;
+
+    if (x->priority != y->priority)
+    {
+        return x->priority - y->priority;
+    }
+    if (x_deadline != y_deadline)
+    {
+        return x_deadline < y_deadline ? -1 : 1;
+    }
+    return x->index < y->index ? -1 : x->index > y->index;
+}
+
+// Probe every file of a batch and queue its range tasks. Returns once the
+// last task has been queued, the batch is freed when they have finished.
+static void submit_batch(Context *context, Batch *batch)
+{
+    OutputDir *cache_root = batch->cache ? batch->cache : batch->output;
+    int *assignment = NULL, assignment_size = 0;
+
+    // Probe the most urgent files first so their tasks are queued before
+    // those of bulk files further down the url_file.
+    qsort(batch->urls->entries, batch->urls->count, sizeof(MirrorSet *), compare_files);
+
+    // Foreach file listed within the url_file.
+    for (size_t x = 0; x < batch->urls->count; ++x)
+    {
+        int bytes, num_tasks = 0, probed = -1, source = 0;
+        CacheEntry cached = {0};
+        Probe probe;
+
+        // Each line lists one or more mirrors of the same file. The first
+        // url also names the output file.
+        MirrorSet *mirrors = batch->urls->entries[x];
+
+        if (__atomic_load_n(&batch->cancelled, __ATOMIC_RELAXED))
+        {
+            finish_file(context, batch, mirrors->urls[0], DOWNLOAD_CANCELLED);
+            continue;
+        }
+
+        // Only ask the server to validate a previous download if the file it
+        // produced is still present and complete.
+        int have_cached = batch->index && cache_lookup(batch->index, mirrors->urls[0], &cached) == 0 &&
+                          output_size(cache_root, mirrors->urls[0]) == (long long)cached.size;
+
+        // Probe the mirrors in turn until one responds, sending the cached
+        // validators so an unchanged file is answered with 304.
+        for (int i = 0; i < mirrors->count && probed != 0; ++i)
+        {
+            probed = http_probe(mirrors->urls[i], have_cached ? cached.etag : NULL,
+                                have_cached ? cached.last_modified : NULL, batch->compress, batch->redirects, &probe);
+            source = i;
+        }
+
+        if (probed == 0 && probe.status == 304)
+        {
+            // Nothing has changed since the last run. A separate cache only
+            // needs the file linked back into the download directory.
+            if (batch->cache == NULL || output_link(batch->cache, batch->output, mirrors->urls[0]) == 0)
+            {
+                if (batch->verbose)
+                {
+                    printf("unchanged: %s\n", mirrors->urls[0]);
+                }
+                metrics_add(files_unchanged, 1);
+                metrics_add(bytes_skipped, cached.size);
+                finish_file(context, batch, mirrors->urls[0], DOWNLOAD_UNCHANGED);
+                continue;
+            }
+            // The link failed, fall back to downloading the file again.
+            probed = -1;
+            for (int i = 0; i < mirrors->count && probed != 0; ++i)
+            {
+                probed = http_probe(mirrors->urls[i], NULL, NULL, batch->compress, batch->redirects, &probe);
+                source = i;
+            }
+        }
+
+        // Determine the number of downloads required to completely retrieve the
+        // specified file. Validates the returned value. Files with several mirrors
+        // are split into a worker's worth of ranges per mirror so the planner can
+        // weight them and slow mirrors only hold up small ranges.
+        // A compressed body can not be split into ranges of the file, so
+        // files the server would compress are fetched whole and decoded.
+        int decode = batch->compress && probed == 0 && probe.content_encoding[0] && decoder_supports(probe.content_encoding);
+        if (decode && probe.status == 200)
+        {
+            num_tasks = 1;
+        }
+        else if (probed == 0)
+        {
+            num_tasks = http_plan_tasks(&probe, context->num_workers * mirrors->count);
+        }
+        if (num_tasks < 1)
+        {
+            // The number of required downloads could not be determined.
+            fprintf(stderr, "could not determine the number of downloads for : %s\n", mirrors->urls[0]);
+            metrics_add(files_failed, 1);
+            finish_file(context, batch, mirrors->urls[0], DOWNLOAD_FAILED);
+            continue;
+        }
+        // As the above call must of returned a valid number of downloads, get
+        // the determined chunk size.
+        bytes = get_max_chunk_size();
+
+        // The job is freed by whichever of its tasks finishes last.
+        FileJob *job = calloc(1, sizeof(FileJob));
+        job->batch = batch;
+        job->mirrors = mirrors;
+        job->pending = num_tasks;
+        job->unstarted = num_tasks;
+        job->budget = batch->hedge > 0 ? probe.content_length / 100 * batch->hedge : 0;
+        pthread_mutex_init(&job->lock, NULL);
+        pthread_cond_init(&job->hedged, NULL);
+        job->decode = decode;
+        job->deadline = mirrors->deadline > 0 ? batch->submitted + mirrors->deadline : 0;
+        if (probe.location[0])
+        {
+            job->located = source;
+            job->location = intern(batch->urls->strings, probe.location, strlen(probe.location));
+        }
+        job->metadata.size = probe.content_length;
+        strcpy(job->metadata.etag, probe.etag);
+        strcpy(job->metadata.last_modified, probe.last_modified);
+
+        // Identical objects are only downloaded once. A digest from the
+        // url_file identifies the content wherever it is hosted. An ETag
+        // only identifies a version of one resource, so the size and a
+        // strong ETag are scoped to the url the object was probed at: urls
+        // share them only when they redirect to the same place.
+        if (batch->dedup && (mirrors->digest || (probe.etag[0] && strncmp(probe.etag, "W/", 2) != 0)))
+        {
+            char key[sizeof(probe.etag) + HTTP_URL_SIZE + 32];
+            const char *primary, *resource = mirror_url(job, source);
+
+            // Urls without a scheme are http, so compare them without it.
+            if (strncasecmp(resource, "http://", 7) == 0)
+            {
+                resource += 7;
+            }
+
+            if (mirrors->digest)
+            {
+                snprintf(key, sizeof(key), "%s", mirrors->digest);
+            }
+            else
+            {
+                snprintf(key, sizeof(key), "%zu %s %s", probe.content_length, probe.etag, resource);
+            }
+
+            switch (dedup_claim(batch->dedup, key, mirrors->urls[0], job, &primary))
+            {
+            case DEDUP_UNIQUE:
+                job->dedup_key = strdup(key);
+                break;
+            case DEDUP_DONE:
+                materialize_file(context, primary, job);
+                free_job(job);
+                continue;
+            case DEDUP_PENDING:
+                // Materialized once the download of the object completes.
+                continue;
+            }
+        }
+
+        // Create the file for the given url where the downloaded bytes can be
+        // written. Every range task writes through it. A decoded file's size
+        // is only known once it has been decoded.
+        if ((job->output = output_create(batch->output, mirrors->urls[0], decode ? -1 : (long long)probe.content_length)) == NULL)
+        {
+            // The file descriptor was never created/assigned.
+            fprintf(stderr, "Failed to open output file for writing\n");
+            job->failed = 1;
+            complete_file(context, job);
+            continue;
+        }
+
+        // Spread the ranges across the mirrors in proportion to the throughput
+        // each has delivered so far.
+        if (num_tasks > assignment_size)
+        {
+            assignment_size = num_tasks;
+            assignment = realloc(assignment, sizeof(int) * assignment_size);
+        }
+        mirror_plan(mirrors, num_tasks, assignment);
+
+        // Wait for room within the in-flight budget, so planning runs only
+        // so far ahead of the workers.
+        admission_acquire(context->admission, num_tasks, (size_t)num_tasks * bytes);
+
+        // For each download required for a given url, create a new task with the required
+        // byte range. The job may be freed as soon as its last task is queued.
+        for (int i = 0; i < num_tasks; i++)
+        {
+            Task *task = new_task(context, job, assignment[i], i * bytes, (i + 1) * bytes, x, i);
+
+            task->queued = scheduler_now();
+            scheduler_put(context->todo, task, mirrors->priority, job->deadline);
+        }
+    }
+
+    free(assignment);
+    release_batch(context, batch);
+}
+
+// Probe and queue submitted batches in order until the downloader stops.
+static void *planner_thread(void *arg)
+{
+    Context *context = (Context *)arg;
+
+    pthread_mutex_lock(&context->lock);
+    while (1)
+    {
+        Batch *batch;
+
+        while (context->queued == NULL && !context->stopping)
+        {
+            pthread_cond_wait(&context->submitted, &context->lock);
+        }
+        if ((batch = context->queued) == NULL)
+        {
+            break;
+        }
+        if ((context->queued = batch->next_submitted) == NULL)
+        {
+            context->queued_tail = &context->queued;
+        }
+
+        pthread_mutex_unlock(&context->lock);
+        submit_batch(context, batch);
+        pthread_mutex_lock(&context->lock);
+    }
+    pthread_mutex_unlock(&context->lock);
+
+    return NULL;
+}
+
+// Hand a batch to the planner thread.
+static int enqueue_batch(Context *context, Batch *batch)
+{
+    int id;
+
+    if (batch == NULL)
+    {
+        return -1;
+    }
+
+    // The batch may be finished and freed as soon as the lock is released.
+    pthread_mutex_lock(&context->lock);
+    id = batch->id;
+    batch->next = context->batches;
+    context->batches = batch;
+    *context->queued_tail = batch;
+    context->queued_tail = &batch->next_submitted;
+    pthread_cond_signal(&context->submitted);
+    pthread_mutex_unlock(&context->lock);
+
+    return id;
+}
+
+/**
+ * Start a downloader and its worker threads.
+ * @param num_workers - Number of worker threads
+ * @param plan - CPUs to pin the workers to, NULL to leave placement to the kernel
+ * @return downloader - Pointer to the downloader or NULL on failure
+ */
+Downloader *downloader_create(int num_workers, const AffinityPlan *plan)
+{
+    Context *context;
+
+    if (num_workers < 1)
+    {
+        fprintf(stderr, "at least one worker is required\n");
+        return NULL;
+    }
+
+    context = spawn_workers(num_workers, plan);
+    if (pthread_create(&context->planner, NULL, planner_thread, context) != 0)
+    {
+        perror("ERROR pthread_create");
+        exit(EXIT_FAILURE);
+    }
+
+    return context;
+}
+
+/**
+ * Bound the work planned ahead of the workers. Probing and planning run
+ * ahead of the downloads until either limit is reached.
+ * @param downloader - The downloader
+ * @param max_tasks - Most range tasks in flight, 0 for no limit
+ * @param max_bytes - Most bytes of ranges in flight, 0 for no limit
+ */
+void downloader_limit(Downloader *downloader, size_t max_tasks, size_t max_bytes)
+{
+    admission_limit(downloader->admission, max_tasks, max_bytes);
+}
+
+/**
+ * Queue every file listed in a url_file for download.
+ * @param downloader - The downloader
+ * @param url_file - Path of the url_file, read before this returns
+ * @param download_dir - Directory to write the files to
+ * @param options - Settings of the job, NULL for the defaults
+ * @param callbacks - Callbacks reporting the job's progress, or NULL
+ * @return The job id, or -1 if the url_file or directories could not be opened
+ */
+int downloader_submit_file(Downloader *downloader, const char *url_file, const char *download_dir,
+                           const DownloadOptions *options, const DownloadCallbacks *callbacks)
+{
+    UrlList *urls = ingest_url_file(url_file, 0);
+
+    if (urls == NULL)
+    {
+        return -1;
+    }
+
+    return enqueue_batch(downloader, open_batch(urls, download_dir, options, callbacks));
+}
+
+/**
+ * Queue a single file for download.
+ * @param downloader - The downloader
+ * @param url - Url of the file, optionally followed by whitespace separated
+ *              mirrors and digest as on a url_file line
+ * @param download_dir - Directory to write the file to
+ * @param options - Settings of the job, NULL for the defaults
+ * @param callbacks - Callbacks reporting the job's progress, or NULL
+ * @return The job id, or -1 if the directories could not be opened
+ */
+int downloader_submit(Downloader *downloader, const char *url, const char *download_dir,
+                      const DownloadOptions *options, const DownloadCallbacks *callbacks)
+{
+    return enqueue_batch(downloader, open_batch(ingest_urls(url, strlen(url)), download_dir, options, callbacks));
+}
+
+/**
+ * Cancel a job. Files not yet started finish as DOWNLOAD_CANCELLED and
+ * ranges already being downloaded are allowed to complete.
+ * @param downloader - The downloader
+ * @param job - The job id
+ * @return 0 if the job was found, -1 if it has already finished
+ */
+int downloader_cancel(Downloader *downloader, int job)
+{
+    int rc = -1;
+
+    pthread_mutex_lock(&downloader->lock);
+    for (Batch *batch = downloader->batches; batch; batch = batch->next)
+    {
+        if (batch->id == job)
+        {
+            __atomic_store_n(&batch->cancelled, 1, __ATOMIC_RELAXED);
+            rc = 0;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&downloader->lock);
+
+    return rc;
+}
+
+/**
+ * List the jobs in progress.
+ * @param downloader - The downloader
+ * @param status - Output array for up to max jobs
+ * @param max - Size of the status array
+ * @return The number of jobs in progress, which may exceed max
+ */
+int downloader_jobs(Downloader *downloader, DownloadStatus *status, int max)
+{
+    int count = 0;
+
+    pthread_mutex_lock(&downloader->lock);
+    for (Batch *batch = downloader->batches; batch; batch = batch->next, ++count)
+    {
+        if (count < max)
+        {
+            status[count].job = batch->id;
+            status[count].files = batch->files;
+            status[count].pending = batch->files;
+            for (int i = 0; i < DOWNLOAD_NUM_OUTCOMES; ++i)
+            {
+                status[count].pending -= __atomic_load_n(&batch->outcomes[i], __ATOMIC_RELAXED);
+            }
+        }
+    }
+    pthread_mutex_unlock(&downloader->lock);
+
+    return count;
+}
+
+// Determine whether a job is still in progress. Must be called with the
+// lock held.
+static int has_job(Downloader *downloader, int job)
+{
+    for (Batch *batch = downloader->batches; batch; batch = batch->next)
+    {
+        if (job == 0 || batch->id == job)
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Wait for a job to finish.
+ * @param downloader - The downloader
+ * @param job - The job id, or 0 to wait for every job
+ */
+void downloader_wait(Downloader *downloader, int job)
+{
+    pthread_mutex_lock(&downloader->lock);
+    while (has_job(downloader, job))
+    {
+        pthread_cond_wait(&downloader->finished, &downloader->lock);
+    }
+    pthread_mutex_unlock(&downloader->lock);
+}
+
+/**
+ * Wait for every job to finish then stop the worker threads and free the
+ * downloader.
+ * @param downloader - The downloader to free
+ */
+void downloader_destroy(Downloader *downloader)
+{
+    downloader_wait(downloader, 0);
+
+    pthread_mutex_lock(&downloader->lock);
+    downloader->stopping = 1;
+    pthread_cond_signal(&downloader->submitted);
+    pthread_mutex_unlock(&downloader->lock);
+    pthread_join(downloader->planner, NULL);
+
+    free_workers(downloader);
+}
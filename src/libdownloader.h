@@ -0,0 +1,167 @@
+#ifndef LIBDOWNLOADER_H
+#define LIBDOWNLOADER_H
+
+#include <stddef.h>
+
+#include "affinity.h"
+
+
+/*
+ * Downloader - a pool of worker threads that downloads submitted jobs in
+ * the background. A job is one url_file, or a single url, together with
+ * the directory its files are written to. Submitting never blocks on the
+ * network: probing and planning run on the downloader's own thread.
+ *
+ * Callbacks are made from the downloader's threads and must not block for
+ * long, or call downloader_wait or downloader_destroy.
+ */
+typedef struct DownloaderStruct Downloader;
+
+// Most range tasks planned ahead of the workers (Default = 256)
+#define DOWNLOAD_INFLIGHT_TASKS 256
+// Most bytes of ranges planned ahead of the workers (Default = 1GB)
+#define DOWNLOAD_INFLIGHT_BYTES 1073741824UL
+
+// How each file of a job was finished.
+enum
+{
+    DOWNLOAD_OK,
+    DOWNLOAD_FAILED,
+    DOWNLOAD_UNCHANGED, // Unchanged since a previous download, see use_cache
+    DOWNLOAD_DUPLICATE, // Materialized from an identical file, see dedup
+    DOWNLOAD_CANCELLED,
+    DOWNLOAD_NUM_OUTCOMES,
+};
+
+// When downloaded files are flushed to disk, see DownloadOptions.
+enum
+{
+    DOWNLOAD_SYNC_NONE,  // Left to the kernel
+    DOWNLOAD_SYNC_FILE,  // fsync each file once complete
+    DOWNLOAD_SYNC_RANGE, // fdatasync after every write
+};
+
+// Settings of a job.
+typedef struct
+{
+    const char *cache_dir; // Separate content cache, NULL to use the download directory
+    int use_cache;         // Skip files unchanged since a previous download
+    int dedup;             // Download identical files once
+    int compress;          // Accept compressed content codings for whole files
+    int verbose;           // Log each downloaded range to stdout
+    int sync;              // One of the DOWNLOAD_SYNC_ policies
+    int hedge;             // Bytes a file may request again to hedge its slowest ranges,
+                           // as a percentage of its size, 0 to never hedge
+
+} DownloadOptions;
+
+// Callbacks reporting the progress of a job, any of which may be NULL.
+typedef struct
+{
+    // A range of bytes of a file has been written.
+    void (*progress)(void *arg, int job, const char *url, size_t bytes);
+
+    // A file has finished with one of the DOWNLOAD_ outcomes.
+    void (*complete)(void *arg, int job, const char *url, int outcome);
+
+    // Every file of the job has finished. counts holds the number of
+    // files finished with each outcome. This is the last callback.
+    void (*done)(void *arg, int job, const int *counts);
+
+    void *arg;
+
+} DownloadCallbacks;
+
+// A job in progress, see downloader_jobs.
+typedef struct
+{
+    int job;
+    size_t files;   // Files in the job
+    size_t pending; // Files not yet finished
+
+} DownloadStatus;
+
+
+/**
+ * Start a downloader and its worker threads.
+ * @param num_workers - Number of worker threads
+ * @param plan - CPUs to pin the workers to, NULL to leave placement to the kernel
+ * @return downloader - Pointer to the downloader or NULL on failure
+ */
+Downloader *downloader_create(int num_workers, const AffinityPlan *plan);
+
+
+/**
+ * Bound the work planned ahead of the workers. Probing and planning run
+ * ahead of the downloads until either limit is reached.
+ * @param downloader - The downloader
+ * @param max_tasks - Most range tasks in flight, 0 for no limit
+ * @param max_bytes - Most bytes of ranges in flight, 0 for no limit
+ */
+void downloader_limit(Downloader *downloader, size_t max_tasks, size_t max_bytes);
+
+
+/**
+ * Queue every file listed in a url_file for download.
+ * @param downloader - The downloader
+ * @param url_file - Path of the url_file, read before this returns
+ * @param download_dir - Directory to write the files to
+ * @param options - Settings of the job, NULL for the defaults
+ * @param callbacks - Callbacks reporting the job's progress, or NULL
+ * @return The job id, or -1 if the url_file or directories could not be opened
+ */
+int downloader_submit_file(Downloader *downloader, const char *url_file, const char *download_dir,
+                           const DownloadOptions *options, const DownloadCallbacks *callbacks);
+
+
+/**
+ * Queue a single file for download.
+ * @param downloader - The downloader
+ * @param url - Url of the file, optionally followed by whitespace separated
+ *              mirrors and digest as on a url_file line
+ * @param download_dir - Directory to write the file to
+ * @param options - Settings of the job, NULL for the defaults
+ * @param callbacks - Callbacks reporting the job's progress, or NULL
+ * @return The job id, or -1 if the directories could not be opened
+ */
+int downloader_submit(Downloader *downloader, const char *url, const char *download_dir,
+                      const DownloadOptions *options, const DownloadCallbacks *callbacks);
+
+
+/**
+ * Cancel a job. Files not yet started finish as DOWNLOAD_CANCELLED and
+ * ranges already being downloaded are allowed to complete.
+ * @param downloader - The downloader
+ * @param job - The job id
+ * @return 0 if the job was found, -1 if it has already finished
+ */
+int downloader_cancel(Downloader *downloader, int job);
+
+
+/**
+ * List the jobs in progress.
+ * @param downloader - The downloader
+ * @param status - Output array for up to max jobs
+ * @param max - Size of the status array
+ * @return The number of jobs in progress, which may exceed max
+ */
+int downloader_jobs(Downloader *downloader, DownloadStatus *status, int max);
+
+
+/**
+ * Wait for a job to finish.
+ * @param downloader - The downloader
+ * @param job - The job id, or 0 to wait for every job
+ */
+void downloader_wait(Downloader *downloader, int job);
+
+
+/**
+ * Wait for every job to finish then stop the worker threads and free the
+ * downloader.
+ * @param downloader - The downloader to free
+ */
+void downloader_destroy(Downloader *downloader);
+
+
+#endif
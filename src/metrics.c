@@ -0,0 +1,92 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "metrics.h"
+#include "http.h"
+
+Metrics metrics;
+
+/**
+ * Reset the counters and record the start time of the run.
+ */
+void metrics_start(void)
+{
+    memset(&metrics, 0, sizeof(Metrics));
+    clock_gettime(CLOCK_MONOTONIC, &metrics.start);
+}
+
+/**
+ * Print a summary of the run, including the socket profile in use.
+ * @param out - Stream to write the summary to
+ */
+void metrics_report(FILE *out)
+{
+    const SocketProfile *profile = http_get_socket_profile();
+    struct timespec now;
+    double elapsed;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    elapsed = (now.tv_sec - metrics.start.tv_sec) + (now.tv_nsec - metrics.start.tv_nsec) / 1e9;
+
+    fprintf(out, "--- metrics ---\n");
+    fprintf(out, "elapsed:          %.3f s\n", elapsed);
+    fprintf(out, "downloaded:       %lu bytes (%.2f MB/s)\n", metrics.bytes_downloaded,
+            elapsed > 0 ? metrics.bytes_downloaded / elapsed / 1048576 : 0.0);
+    fprintf(out, "files:            %lu completed, %lu failed, %lu unchanged (%lu bytes not downloaded)\n",
+            metrics.files_completed, metrics.files_failed, metrics.files_unchanged, metrics.bytes_skipped);
+    if (metrics.files_incomplete)
+    {
+        fprintf(out, "incomplete:       %lu files missing %lu bytes, kept as .part files\n", metrics.files_incomplete, metrics.bytes_missing);
+    }
+    if (metrics.bytes_deduplicated)
+    {
+        fprintf(out, "duplicates:       %lu reflinked, %lu hard linked, %lu copied (%lu bytes not downloaded)\n",
+                metrics.dedup_reflinks, metrics.dedup_hardlinks, metrics.dedup_copies, metrics.bytes_deduplicated);
+    }
+    if (metrics.files_decoded)
+    {
+        fprintf(out, "decompressed:     %lu files to %lu bytes\n", metrics.files_decoded, metrics.bytes_decoded);
+    }
+    if (metrics.deadlines_met || metrics.deadlines_missed)
+    {
+        fprintf(out, "deadlines:        %lu met, %lu missed\n", metrics.deadlines_met, metrics.deadlines_missed);
+    }
+    fprintf(out, "tasks:            %lu completed, %lu failed, %lu moved to another mirror\n",
+            metrics.tasks_completed, metrics.tasks_failed, metrics.ranges_migrated);
+    if (metrics.hedges_sent)
+    {
+        fprintf(out, "hedges:           %lu sent for %lu bytes, %lu finished a range before the original request\n",
+                metrics.hedges_sent, metrics.bytes_hedged, metrics.hedges_won);
+    }
+    fprintf(out, "planning:         %lu waits for the in-flight budget (%.3f s), peak %lu tasks / %lu bytes in flight\n",
+            metrics.admission_waits, metrics.admission_wait_us / 1e6, metrics.peak_tasks, metrics.peak_bytes);
+    fprintf(out, "queue wait:       %.3f ms mean, %.3f ms max\n",
+            metrics.queue_waits ? metrics.queue_wait_us / 1e3 / metrics.queue_waits : 0.0, metrics.queue_wait_max_us / 1e3);
+    fprintf(out, "writes:           %lu ranges in %lu pwritev calls, workers stalled %lu times on the writers\n",
+            metrics.write_ranges, metrics.write_calls, metrics.write_stalls);
+    fprintf(out, "connections:      %lu opened, %lu failed, %lu timed out\n",
+            metrics.connections, metrics.connect_failures, metrics.timeouts);
+    fprintf(out, "                  %lu won by a fallback address\n", metrics.connect_fallbacks);
+    if (metrics.redirects_followed || metrics.redirects_cached)
+    {
+        fprintf(out, "redirects:        %lu followed, %lu probes sent straight to a remembered location\n",
+                metrics.redirects_followed, metrics.redirects_cached);
+    }
+    if (metrics.tls_handshakes)
+    {
+        fprintf(out, "tls:              %lu handshakes, %lu resumed from a session ticket, %lu offloaded to kernel TLS\n",
+                metrics.tls_handshakes, metrics.tls_resumed, metrics.tls_kernel);
+    }
+    fprintf(out, "socket profile:   rcvbuf=%d (effective %d) read_size=%d nodelay=%d quickack=%d\n",
+            profile->rcvbuf, metrics.effective_rcvbuf, profile->read_size, profile->nodelay, profile->quickack);
+    fprintf(out, "                  connect_timeout=%dms read_timeout=%dms congestion=%s (effective %s)\n",
+            profile->connect_timeout_ms, profile->read_timeout_ms,
+            profile->congestion[0] ? profile->congestion : "default",
+            metrics.effective_congestion[0] ? metrics.effective_congestion : "unknown");
+    if (metrics.sockopt_failures)
+    {
+        fprintf(out, "                  %lu socket options were rejected by the kernel\n", metrics.sockopt_failures);
+    }
+}
@@ -0,0 +1,105 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdio.h>
+#include <time.h>
+
+
+/*
+ * Metrics - process wide counters describing a run. Counters are updated
+ * concurrently by the workers using the metrics_add macro.
+ */
+typedef struct
+{
+    struct timespec start;
+
+    unsigned long bytes_downloaded;
+    unsigned long tasks_completed;
+    unsigned long tasks_failed;
+    unsigned long ranges_migrated;
+
+    unsigned long files_completed;
+    unsigned long files_failed;
+    unsigned long files_unchanged;
+    unsigned long bytes_skipped;
+    unsigned long files_incomplete;
+    unsigned long bytes_missing;
+
+    unsigned long dedup_reflinks;
+    unsigned long dedup_hardlinks;
+    unsigned long dedup_copies;
+    unsigned long bytes_deduplicated;
+
+    unsigned long files_decoded;
+    unsigned long bytes_decoded;
+
+    unsigned long deadlines_met;
+    unsigned long deadlines_missed;
+
+    unsigned long admission_waits;
+    unsigned long admission_wait_us;
+    unsigned long peak_tasks;
+    unsigned long peak_bytes;
+    unsigned long queue_waits;
+    unsigned long queue_wait_us;
+    unsigned long queue_wait_max_us;
+
+    unsigned long write_ranges;
+    unsigned long write_calls;
+    unsigned long write_stalls;
+
+    unsigned long connections;
+    unsigned long connect_failures;
+    unsigned long connect_fallbacks;
+    unsigned long timeouts;
+    unsigned long sockopt_failures;
+
+    unsigned long hedges_sent;
+    unsigned long hedges_won;
+    unsigned long bytes_hedged;
+
+    unsigned long redirects_followed;
+    unsigned long redirects_cached;
+
+    unsigned long tls_handshakes;
+    unsigned long tls_resumed;
+    unsigned long tls_kernel;
+
+    // Socket settings the kernel actually applied, sampled from the first
+    // connection as they may differ from what was requested.
+    int effective_rcvbuf;
+    char effective_congestion[16];
+
+} Metrics;
+
+extern Metrics metrics;
+
+// Atomically add n to one of the counters in metrics.
+#define metrics_add(field, n) __atomic_add_fetch(&metrics.field, (n), __ATOMIC_RELAXED)
+
+// Atomically raise one of the counters in metrics to n if it is lower.
+#define metrics_max(field, n)                                                                                          \
+    do                                                                                                                 \
+    {                                                                                                                  \
+        unsigned long value_ = (n), current_ = __atomic_load_n(&metrics.field, __ATOMIC_RELAXED);                      \
+        while (value_ > current_ &&                                                                                    \
+               !__atomic_compare_exchange_n(&metrics.field, &current_, value_, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) \
+        {                                                                                                              \
+        }                                                                                                              \
+    } while (0)
+
+
+/**
+ * Reset the counters and record the start time of the run.
+ */
+void metrics_start(void);
+
+
+/**
+ * Print a summary of the run, including the socket profile in use.
+ * @param out - Stream to write the summary to
+ */
+void metrics_report(FILE *out);
+
+
+#endif
@@ -0,0 +1,212 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "mirror.h"
+
+// Weight given to the newest sample in the throughput moving average.
+#define THROUGHPUT_ALPHA 0.3
+// A planned mirror slower than this fraction of the best mirror loses its
+// remaining ranges to the best mirror.
+#define MIGRATE_RATIO 0.5
+
+// Throughput statistics for one origin host:port. The key is a copy as
+// the hosts of a url_file are freed with it, while the statistics carry
+// over to later jobs.
+typedef struct HostStats
+{
+    char *host;
+    double throughput; // Bytes per second, exponentially weighted
+    int samples;
+
+    struct HostStats *next;
+} HostStats;
+
+static HostStats *stats = NULL;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Find the statistics for a host:port, creating them if required.
+// Must be called with stats_lock held.
+static HostStats *find_stats(const char *host)
+{
+    HostStats *entry;
+
+    for (entry = stats; entry != NULL; entry = entry->next)
+    {
+        if (strcmp(entry->host, host) == 0)
+        {
+            return entry;
+        }
+    }
+
+    entry = calloc(1, sizeof(HostStats));
+    entry->host = strdup(host);
+    entry->next = stats;
+    stats = entry;
+
+    return entry;
+}
+
+// Fill weights with the throughput of each mirror. Unmeasured mirrors get
+// the average of the measured ones, or 1 if none have been measured.
+// Must be called with stats_lock held.
+static void mirror_weights(const MirrorSet *set, double *weights)
+{
+    double total = 0;
+    int measured = 0;
+
+    for (int i = 0; i < set->count; ++i)
+    {
+        HostStats *entry = find_stats(set->hosts[i]);
+        weights[i] = entry->samples ? entry->throughput : -1;
+        if (entry->samples)
+        {
+            total += entry->throughput;
+            ++measured;
+        }
+    }
+
+    for (int i = 0; i < set->count; ++i)
+    {
+        if (weights[i] < 0)
+        {
+            weights[i] = measured ? total / measured : 1;
+        }
+    }
+}
+
+/**
+ * Assign each of a file's range tasks to a mirror, weighted by the
+ * throughput observed from each mirror so far. Mirrors that have not been
+ * measured yet are given the average weight so they get tried.
+ * @param set - The mirrors of the file
+ * @param num_tasks - Number of range tasks to assign
+ * @param assignment - Output array of num_tasks mirror indexes
+ */
+void mirror_plan(const MirrorSet *set, int num_tasks, int *assignment)
+{
+    double weights[set->count], current[set->count], total = 0;
+
+    pthread_mutex_lock(&stats_lock);
+    mirror_weights(set, weights);
+    pthread_mutex_unlock(&stats_lock);
+
+    for (int i = 0; i < set->count; ++i)
+    {
+        current[i] = 0;
+        total += weights[i];
+    }
+
+    // Smooth weighted round robin: every mirror accrues its weight each
+    // round and the richest is chosen and pays the total. Ranges are
+    // assigned in proportion to the weights while staying interleaved.
+    for (int task = 0; task < num_tasks; ++task)
+    {
+        int best = 0;
+
+        for (int i = 0; i < set->count; ++i)
+        {
+            current[i] += weights[i];
+            if (current[i] > current[best])
+            {
+                best = i;
+            }
+        }
+
+        current[best] -= total;
+        assignment[task] = best;
+    }
+}
+
+/**
+ * Choose the mirror to fetch a range from when a worker starts on it.
+ * Returns the planned mirror unless it has since proven to be much slower
+ * than the best mirror, in which case the range migrates to the best.
+ * @param set - The mirrors of the file
+ * @param planned - The mirror the range was planned for
+ * @return Index of the mirror to use
+ */
+int mirror_select(const MirrorSet *set, int planned)
+{
+    double weights[set->count];
+    int best = planned;
+
+    if (set->count == 1)
+    {
+        return 0;
+    }
+
+    pthread_mutex_lock(&stats_lock);
+    mirror_weights(set, weights);
+    pthread_mutex_unlock(&stats_lock);
+
+    for (int i = 0; i < set->count; ++i)
+    {
+        if (weights[i] > weights[best])
+        {
+            best = i;
+        }
+    }
+
+    return weights[planned] < MIGRATE_RATIO * weights[best] ? best : planned;
+}
+
+/**
+ * Record a completed transfer from a mirror, updating its throughput.
+ * @param host - The host:port the bytes were fetched from
+ * @param bytes - Number of bytes transferred
+ * @param seconds - Time taken for the transfer
+ */
+void mirror_record(const char *host, size_t bytes, double seconds)
+{
+    double sample = bytes / (seconds > 1e-6 ? seconds : 1e-6);
+    HostStats *entry;
+
+    pthread_mutex_lock(&stats_lock);
+    entry = find_stats(host);
+    entry->throughput = entry->samples ? THROUGHPUT_ALPHA * sample + (1 - THROUGHPUT_ALPHA) * entry->throughput : sample;
+    entry->samples++;
+    pthread_mutex_unlock(&stats_lock);
+}
+
+/**
+ * Record a failed transfer from a mirror, halving its throughput estimate
+ * so further ranges favour the other mirrors.
+ * @param host - The host:port that failed
+ */
+void mirror_record_failure(const char *host)
+{
+    HostStats *entry;
+
+    pthread_mutex_lock(&stats_lock);
+    entry = find_stats(host);
+    if (entry->samples)
+    {
+        entry->throughput /= 2;
+    }
+    else
+    {
+        // No throughput has been seen yet, record a token sample so the
+        // mirror ranks below the unmeasured ones.
+        entry->throughput = 1;
+        entry->samples = 1;
+    }
+    pthread_mutex_unlock(&stats_lock);
+}
+
+/**
+ * Free the throughput statistics of every mirror.
+ */
+void mirror_cleanup(void)
+{
+    pthread_mutex_lock(&stats_lock);
+    while (stats)
+    {
+        HostStats *next = stats->next;
+        free(stats->host);
+        free(stats);
+        stats = next;
+    }
+    pthread_mutex_unlock(&stats_lock);
+}
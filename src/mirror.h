@@ -0,0 +1,77 @@
+#ifndef MIRROR_H
+#define MIRROR_H
+
+#include <stddef.h>
+
+
+/*
+ * MirrorSet - the urls of every origin a single file can be fetched
+ * from, shared by all range tasks of the file. urls[0] names the output
+ * file. The urls and hosts are interned (see intern.h) and only live as
+ * long as the url_file's UrlList. hosts are host:port e.g.
+ * "cdn.example.com:443", statistics are kept for each for the lifetime of
+ * the process. digest is the file's content digest when the
+ * url_file lists one, e.g. "sha256:9f86d0...", NULL otherwise.
+ * priority is the file's SCHED_ class (see scheduler.h) and deadline the
+ * seconds after submission it should be complete by, 0 for none. index
+ * is the set's position in its url_file.
+ */
+typedef struct
+{
+    const char **urls;
+    const char **hosts;
+    int count;
+    const char *digest;
+    int priority;
+    double deadline;
+    size_t index;
+
+} MirrorSet;
+
+
+/**
+ * Assign each of a file's range tasks to a mirror, weighted by the
+ * throughput observed from each mirror so far. Mirrors that have not been
+ * measured yet are given the average weight so they get tried.
+ * @param set - The mirrors of the file
+ * @param num_tasks - Number of range tasks to assign
+ * @param assignment - Output array of num_tasks mirror indexes
+ */
+void mirror_plan(const MirrorSet *set, int num_tasks, int *assignment);
+
+
+/**
+ * Choose the mirror to fetch a range from when a worker starts on it.
+ * Returns the planned mirror unless it has since proven to be much slower
+ * than the best mirror, in which case the range migrates to the best.
+ * @param set - The mirrors of the file
+ * @param planned - The mirror the range was planned for
+ * @return Index of the mirror to use
+ */
+int mirror_select(const MirrorSet *set, int planned);
+
+
+/**
+ * Record a completed transfer from a mirror, updating its throughput.
+ * @param host - The host:port the bytes were fetched from
+ * @param bytes - Number of bytes transferred
+ * @param seconds - Time taken for the transfer
+ */
+void mirror_record(const char *host, size_t bytes, double seconds);
+
+
+/**
+ * Record a failed transfer from a mirror, halving its throughput estimate
+ * so further ranges favour the other mirrors.
+ * @param host - The host:port that failed
+ */
+void mirror_record_failure(const char *host);
+
+
+/**
+ * Free the throughput statistics of every mirror.
+ */
+void mirror_cleanup(void);
+
+
+#endif
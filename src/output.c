@@ -0,0 +1,684 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+
+#include "output.h"
+
+#define INITIAL_SLOTS 256
+#define INITIAL_RANGES 8
+// Appended to the name of a file while it is being downloaded.
+#define PARTIAL_SUFFIX ".part"
+
+struct OutputDirStruct
+{
+    int fd;
+
+    // Set of directory paths, relative to fd, known to exist. Open
+    // addressing with linear probing, kept at most half full.
+    pthread_mutex_t lock;
+    char **created;
+    size_t capacity;
+    size_t count;
+};
+
+// A range of bytes [start, end) present in a file.
+typedef struct
+{
+    long long start;
+    long long end;
+} Extent;
+
+struct OutputFileStruct
+{
+    OutputDir *dir;
+    int fd;
+    long long size;
+
+    // Name of the file and of the partial file written until it completes,
+    // both relative to dir. partial is emptied once renamed.
+    char *relative;
+    char *partial;
+
+    // Ranges written so far, sorted and merged.
+    pthread_mutex_t lock;
+    Extent *ranges;
+    int num_ranges;
+    int capacity;
+};
+
+// 64 bit FNV-1a.
+static uint64_t hash_path(const char *path, size_t length)
+{
+    uint64_t hash = 14695981039346656037ULL;
+
+    for (size_t i = 0; i < length; ++i)
+    {
+        hash ^= (unsigned char)path[i];
+        hash *= 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+// Find the slot a directory path occupies or would occupy.
+// Must be called with the lock held.
+static size_t find_slot(OutputDir *dir, const char *path, size_t length)
+{
+    size_t index = hash_path(path, length) & (dir->capacity - 1);
+
+    while (dir->created[index])
+    {
+        if (strncmp(dir->created[index], path, length) == 0 && dir->created[index][length] == '\0')
+        {
+            break;
+        }
+        index = (index + 1) & (dir->capacity - 1);
+    }
+
+    return index;
+}
+
+// Determine whether the first length characters of path are a directory
+// that is known to exist.
+static int is_created(OutputDir *dir, const char *path, size_t length)
+{
+    int found;
+
+    pthread_mutex_lock(&dir->lock);
+    found = dir->created[find_slot(dir, path, length)] != NULL;
+    pthread_mutex_unlock(&dir->lock);
+
+    return found;
+}
+
+// Remember that the first length characters of path are a directory.
+static void mark_created(OutputDir *dir, const char *path, size_t length)
+{
+    size_t index;
+
+    pthread_mutex_lock(&dir->lock);
+
+    index = find_slot(dir, path, length);
+    if (dir->created[index] == NULL)
+    {
+        dir->created[index] = strndup(path, length);
+
+        // Grow the set once it is half full.
+        if (++dir->count * 2 > dir->capacity)
+        {
+            char **old = dir->created;
+            size_t old_capacity = dir->capacity;
+
+            dir->capacity *= 2;
+            dir->created = calloc(dir->capacity, sizeof(char *));
+            for (size_t i = 0; i < old_capacity; ++i)
+            {
+                if (old[i])
+                {
+                    dir->created[find_slot(dir, old[i], strlen(old[i]))] = old[i];
+                }
+            }
+            free(old);
+        }
+    }
+
+    pthread_mutex_unlock(&dir->lock);
+}
+
+/**
+ * Open the download directory, creating it and its parents if required.
+ * @param path - Path of the download directory
+ * @return dir - Pointer to the opened directory or NULL on failure
+ */
+OutputDir *output_dir_open(const char *path)
+{
+    char partial[PATH_MAX];
+    OutputDir *dir;
+    int fd;
+
+    if (strlen(path) >= PATH_MAX)
+    {
+        fprintf(stderr, "download directory path is too long: %s\n", path);
+        return NULL;
+    }
+
+    // Create each level of the download directory. This only happens once
+    // so is done relative to the working directory, like mkdir -p.
+    strcpy(partial, path);
+    for (char *p = partial + 1; *p; ++p)
+    {
+        if (*p == '/')
+        {
+            *p = '\0';
+            if (mkdir(partial, 0700) != 0 && errno != EEXIST)
+            {
+                perror("ERROR mkdir");
+                return NULL;
+            }
+            *p = '/';
+        }
+    }
+    if (mkdir(partial, 0700) != 0 && errno != EEXIST)
+    {
+        perror("ERROR mkdir");
+        return NULL;
+    }
+
+    if ((fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+    {
+        perror("ERROR open download directory");
+        return NULL;
+    }
+
+    dir = malloc(sizeof(OutputDir));
+    dir->fd = fd;
+    pthread_mutex_init(&dir->lock, NULL);
+    dir->created = calloc(INITIAL_SLOTS, sizeof(char *));
+    dir->capacity = INITIAL_SLOTS;
+    dir->count = 0;
+
+    return dir;
+}
+
+// Append a url's query to the file name ending relative, escaping '/' and
+// '%' so it stays within the name. A query too long for a file name is
+// replaced by its hash.
+static int append_query(char *relative, size_t *length, size_t name, const char *query, size_t query_length)
+{
+    char escaped[NAME_MAX + 1];
+    size_t count = 0;
+
+    escaped[count++] = '?';
+    for (size_t i = 0; i < query_length && count + 3 <= NAME_MAX; ++i)
+    {
+        if (query[i] == '/' || query[i] == '%')
+        {
+            count += sprintf(escaped + count, "%%%02X", (unsigned char)query[i]);
+        }
+        else
+        {
+            escaped[count++] = query[i];
+        }
+    }
+
+    if (count + 3 > NAME_MAX || *length - name + count > NAME_MAX)
+    {
+        // 64 bit FNV-1a.
+        uint64_t hash = 14695981039346656037ULL;
+
+        for (size_t i = 0; i < query_length; ++i)
+        {
+            hash ^= (unsigned char)query[i];
+            hash *= 1099511628211ULL;
+        }
+        count = sprintf(escaped, "?%016llx", (unsigned long long)hash);
+    }
+
+    if (*length + count + 1 > PATH_MAX)
+    {
+        return -1;
+    }
+    memcpy(relative + *length, escaped, count);
+    *length += count;
+    relative[*length] = '\0';
+
+    return 0;
+}
+
+// Copy a path relative to the download directory into relative, dropping
+// empty components so "a//b" and "/a/b" both become "a/b". Parent
+// references could escape the download directory so they are refused.
+// A url's query stays part of the file name, as different queries of
+// one path are different files, while its fragment is dropped.
+static int normalize_path(const char *path, char *relative)
+{
+    const char *scheme = strstr(path, "://"), *s;
+    size_t length = 0, name = 0;
+
+    // The scheme is dropped so the http and https urls of a file share a path.
+    if (scheme && (size_t)(scheme - path) < strcspn(path, "/"))
+    {
+        path = scheme + 3;
+    }
+
+    for (s = path; *s && *s != '?' && *s != '#';)
+    {
+        size_t component;
+
+        while (*s == '/')
+        {
+            ++s;
+        }
+        if ((component = strcspn(s, "/?#")) == 0)
+        {
+            break;
+        }
+        if ((component == 2 && strncmp(s, "..", 2) == 0) || (component == 1 && *s == '.'))
+        {
+            fprintf(stderr, "refusing output path with relative components: %s\n", path);
+            return -1;
+        }
+        if (length + component + 2 > PATH_MAX)
+        {
+            fprintf(stderr, "output path is too long: %s\n", path);
+            return -1;
+        }
+
+        if (length > 0)
+        {
+            relative[length++] = '/';
+        }
+        name = length;
+        memcpy(relative + length, s, component);
+        length += component;
+        s += component;
+    }
+    relative[length] = '\0';
+
+    if (length == 0)
+    {
+        fprintf(stderr, "output path is empty: %s\n", path);
+        return -1;
+    }
+
+    s += strcspn(s, "?#");
+    if (*s == '?' && s[1] != '\0' && s[1] != '#' &&
+        append_query(relative, &length, name, s + 1, strcspn(s + 1, "#")) != 0)
+    {
+        fprintf(stderr, "output path is too long: %s\n", path);
+        return -1;
+    }
+
+    return 0;
+}
+
+// Create the directories between the download directory and a normalized
+// relative file path. When the file's parent is already known, as it is
+// for every file after the first in a directory, nothing needs creating.
+static int make_parents(OutputDir *dir, char *relative)
+{
+    char *end = strrchr(relative, '/'), *p;
+
+    if (end == NULL || is_created(dir, relative, end - relative))
+    {
+        return 0;
+    }
+
+    // Walk down the path creating each level that is not yet known.
+    for (p = strchr(relative, '/'); p != NULL; p = strchr(p + 1, '/'))
+    {
+        if (is_created(dir, relative, p - relative))
+        {
+            continue;
+        }
+
+        *p = '\0';
+        if (mkdirat(dir->fd, relative, 0700) != 0 && errno != EEXIST)
+        {
+            perror("ERROR mkdirat");
+            *p = '/';
+            return -1;
+        }
+        *p = '/';
+
+        mark_created(dir, relative, p - relative);
+    }
+
+    return 0;
+}
+
+/**
+ * Create a file for writing within the download directory, creating any
+ * missing directories on its path. The data is written to a temporary
+ * "path.part" file that only replaces path once every byte is present,
+ * see output_commit. Safe to call from several threads at once.
+ * @param dir - The download directory
+ * @param path - Path of the file relative to the download directory,
+ *               e.g. a url such as www.example.com/a/b.html
+ * @param size - Size of the complete file in bytes, or -1 if unknown. A
+ *               known size is allocated as a hole for the ranges to fill
+ * @return file - Pointer to the file or NULL on failure
+ */
+OutputFile *output_create(OutputDir *dir, const char *path, long long size)
+{
+    char relative[PATH_MAX], partial[PATH_MAX + 8];
+    OutputFile *file;
+    int fd;
+
+    if (normalize_path(path, relative) != 0 || make_parents(dir, relative) != 0)
+    {
+        return NULL;
+    }
+    snprintf(partial, sizeof(partial), "%s%s", relative, PARTIAL_SUFFIX);
+
+    // Open a file descriptor to the desired file.
+    if ((fd = openat(dir->fd, partial, O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR)) < 0)
+    {
+        perror("ERROR creat output file");
+        return NULL;
+    }
+
+    // Extending the empty file leaves it one hole, so ranges that are
+    // never written read back as holes rather than as data.
+    if (size > 0 && ftruncate(fd, size) != 0)
+    {
+        perror("ERROR ftruncate output file");
+        close(fd);
+        unlinkat(dir->fd, partial, 0);
+        return NULL;
+    }
+
+    file = calloc(1, sizeof(OutputFile));
+    file->dir = dir;
+    file->fd = fd;
+    file->size = size;
+    file->relative = strdup(relative);
+    file->partial = strdup(partial);
+    pthread_mutex_init(&file->lock, NULL);
+
+    return file;
+}
+
+/**
+ * Get the descriptor ranges of a file are written through.
+ * @param file - The file
+ * @return The file descriptor
+ */
+int output_file_fd(const OutputFile *file)
+{
+    return file->fd;
+}
+
+/**
+ * Record that a range of a file has been written. Safe to call from
+ * several threads at once.
+ * @param file - The file
+ * @param offset - Offset of the range in bytes
+ * @param length - Length of the range in bytes
+ */
+void output_written(OutputFile *file, long long offset, long long length)
+{
+    long long start = offset, end = offset + length;
+    int first, last;
+
+    if (length <= 0)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&file->lock);
+
+    // Find the present ranges the new one touches and merge them into it.
+    for (first = 0; first < file->num_ranges && file->ranges[first].end < start; ++first)
+    {
+    }
+    for (last = first; last < file->num_ranges && file->ranges[last].start <= end; ++last)
+    {
+        start = file->ranges[last].start < start ? file->ranges[last].start : start;
+        end = file->ranges[last].end > end ? file->ranges[last].end : end;
+    }
+
+    if (first == last && file->num_ranges == file->capacity)
+    {
+        file->capacity = file->capacity ? file->capacity * 2 : INITIAL_RANGES;
+        file->ranges = realloc(file->ranges, sizeof(Extent) * file->capacity);
+    }
+    // Replace ranges first..last-1 with the merged range.
+    memmove(file->ranges + first + 1, file->ranges + last, sizeof(Extent) * (file->num_ranges - last));
+    file->num_ranges += 1 - (last - first);
+    file->ranges[first].start = start;
+    file->ranges[first].end = end;
+
+    pthread_mutex_unlock(&file->lock);
+}
+
+/**
+ * Turn a range of a file back into a hole, e.g. after a write of it
+ * failed part way, so it can not be mistaken for downloaded data.
+ * @param file - The file
+ * @param offset - Offset of the range in bytes
+ * @param length - Length of the range in bytes
+ */
+void output_punch(OutputFile *file, long long offset, long long length)
+{
+    if (length > 0 && fallocate(file->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, length) != 0)
+    {
+        perror("ERROR fallocate punch hole");
+    }
+}
+
+/**
+ * Count the bytes of a file not yet written.
+ * @param file - The file
+ * @param holes - Output for the number of separate missing ranges, or NULL
+ * @return The number of missing bytes, 0 if the size is unknown
+ */
+long long output_missing(OutputFile *file, int *holes)
+{
+    long long missing = 0, at = 0;
+    int count = 0;
+
+    pthread_mutex_lock(&file->lock);
+    for (int i = 0; i <= file->num_ranges && file->size >= 0; ++i)
+    {
+        long long next = i < file->num_ranges ? file->ranges[i].start : file->size;
+
+        if (next > at)
+        {
+            missing += next - at;
+            ++count;
+        }
+        if (i < file->num_ranges)
+        {
+            at = file->ranges[i].end;
+        }
+    }
+    pthread_mutex_unlock(&file->lock);
+
+    if (holes)
+    {
+        *holes = count;
+    }
+    return missing;
+}
+
+/**
+ * Move a complete file into place under its real name, replacing any file
+ * already there, then close and free it.
+ * @param file - The file
+ * @return 0 on success, or -1 if bytes are still missing or the rename
+ *         failed, in which case the file is left for output_abandon
+ */
+int output_commit(OutputFile *file)
+{
+    if (output_missing(file, NULL) > 0)
+    {
+        return -1;
+    }
+
+    if (renameat(file->dir->fd, file->partial, file->dir->fd, file->relative) != 0)
+    {
+        perror("ERROR rename output file");
+        return -1;
+    }
+
+    file->partial[0] = '\0';
+    output_abandon(file, 0);
+    return 0;
+}
+
+/**
+ * Close and free a file that will not be completed.
+ * @param file - The file
+ * @param keep - Keep the partial file, holes and all, otherwise remove it
+ */
+void output_abandon(OutputFile *file, int keep)
+{
+    close(file->fd);
+    if (!keep && file->partial[0])
+    {
+        unlinkat(file->dir->fd, file->partial, 0);
+    }
+
+    pthread_mutex_destroy(&file->lock);
+    free(file->ranges);
+    free(file->relative);
+    free(file->partial);
+    free(file);
+}
+
+/**
+ * Get the size of a file within the download directory.
+ * @param dir - The download directory
+ * @param path - Path of the file relative to the download directory
+ * @return The size in bytes or -1 if the file does not exist
+ */
+long long output_size(OutputDir *dir, const char *path)
+{
+    char relative[PATH_MAX];
+    struct stat st;
+
+    if (normalize_path(path, relative) != 0 || fstatat(dir->fd, relative, &st, 0) != 0 || !S_ISREG(st.st_mode))
+    {
+        return -1;
+    }
+
+    return st.st_size;
+}
+
+/**
+ * Hard link a file from one directory into the same relative path of
+ * another, replacing any file already there. Used to materialize files
+ * from the content cache without copying them.
+ * @param from - The directory holding the file
+ * @param to - The directory to link the file into
+ * @param path - Path of the file relative to both directories
+ * @return 0 on success, -1 on failure
+ */
+int output_link(OutputDir *from, OutputDir *to, const char *path)
+{
+    char relative[PATH_MAX];
+
+    if (normalize_path(path, relative) != 0 || make_parents(to, relative) != 0)
+    {
+        return -1;
+    }
+
+    unlinkat(to->fd, relative, 0);
+    if (linkat(from->fd, relative, to->fd, relative, 0) != 0)
+    {
+        perror("ERROR linkat");
+        return -1;
+    }
+
+    return 0;
+}
+
+// Copy the whole of one file into another in the kernel.
+static int copy_contents(int src, int dst)
+{
+    ssize_t copied;
+
+    while ((copied = copy_file_range(src, NULL, dst, NULL, SSIZE_MAX, 0)) > 0)
+    {
+    }
+
+    return copied == 0 ? 0 : -1;
+}
+
+/**
+ * Materialize a copy of one file within the download directory as
+ * another, replacing any file already there. The cheapest method the
+ * filesystem supports is used: a reflink sharing the original's extents,
+ * then a hard link, then an in-kernel copy.
+ * @param dir - The download directory
+ * @param from - Path of the existing file relative to the download directory
+ * @param to - Path of the copy relative to the download directory
+ * @return The OUTPUT_ method used, or -1 on failure
+ */
+int output_clone(OutputDir *dir, const char *from, const char *to)
+{
+    char source[PATH_MAX], relative[PATH_MAX];
+    int src, dst, rc = -1;
+
+    if (normalize_path(from, source) != 0 || normalize_path(to, relative) != 0 || make_parents(dir, relative) != 0)
+    {
+        return -1;
+    }
+
+    if ((src = openat(dir->fd, source, O_RDONLY | O_CLOEXEC)) < 0)
+    {
+        perror("ERROR open clone source");
+        return -1;
+    }
+
+    unlinkat(dir->fd, relative, 0);
+    if ((dst = openat(dir->fd, relative, O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR)) < 0)
+    {
+        perror("ERROR creat output file");
+        close(src);
+        return -1;
+    }
+
+    if (ioctl(dst, FICLONE, src) == 0)
+    {
+        rc = OUTPUT_REFLINK;
+    }
+    else
+    {
+        // Reflinks are not supported here, link the original instead.
+        close(dst);
+        unlinkat(dir->fd, relative, 0);
+        if (linkat(dir->fd, source, dir->fd, relative, 0) == 0)
+        {
+            close(src);
+            return OUTPUT_HARDLINK;
+        }
+
+        if ((dst = openat(dir->fd, relative, O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR)) < 0)
+        {
+            perror("ERROR creat output file");
+            close(src);
+            return -1;
+        }
+        if (copy_contents(src, dst) == 0)
+        {
+            rc = OUTPUT_COPY;
+        }
+        else
+        {
+            perror("ERROR copy_file_range");
+        }
+    }
+
+    close(dst);
+    close(src);
+    return rc;
+}
+
+/**
+ * Close the download directory and forget the directories created.
+ * @param dir - The directory to close
+ */
+void output_dir_close(OutputDir *dir)
+{
+    for (size_t i = 0; i < dir->capacity; ++i)
+    {
+        free(dir->created[i]);
+    }
+
+    pthread_mutex_destroy(&dir->lock);
+    free(dir->created);
+    close(dir->fd);
+    free(dir);
+}
@@ -0,0 +1,149 @@
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+
+/*
+ * OutputDir - the download directory that output files are created in.
+ * Holds a descriptor to the directory so files are created relative to it
+ * with mkdirat()/openat() rather than by changing the working directory,
+ * and remembers which subdirectories already exist.
+ */
+typedef struct OutputDirStruct OutputDir;
+
+/*
+ * OutputFile - a file being downloaded into an OutputDir. Tracks which
+ * ranges have been written so the file only appears under its real name
+ * once complete.
+ */
+typedef struct OutputFileStruct OutputFile;
+
+
+/**
+ * Open the download directory, creating it and its parents if required.
+ * @param path - Path of the download directory
+ * @return dir - Pointer to the opened directory or NULL on failure
+ */
+OutputDir *output_dir_open(const char *path);
+
+
+/**
+ * Create a file for writing within the download directory, creating any
+ * missing directories on its path. The data is written to a temporary
+ * "path.part" file that only replaces path once every byte is present,
+ * see output_commit. Safe to call from several threads at once.
+ * @param dir - The download directory
+ * @param path - Path of the file relative to the download directory,
+ *               e.g. a url such as www.example.com/a/b.html
+ * @param size - Size of the complete file in bytes, or -1 if unknown. A
+ *               known size is allocated as a hole for the ranges to fill
+ * @return file - Pointer to the file or NULL on failure
+ */
+OutputFile *output_create(OutputDir *dir, const char *path, long long size);
+
+
+/**
+ * Get the descriptor ranges of a file are written through.
+ * @param file - The file
+ * @return The file descriptor
+ */
+int output_file_fd(const OutputFile *file);
+
+
+/**
+ * Record that a range of a file has been written. Safe to call from
+ * several threads at once.
+ * @param file - The file
+ * @param offset - Offset of the range in bytes
+ * @param length - Length of the range in bytes
+ */
+void output_written(OutputFile *file, long long offset, long long length);
+
+
+/**
+ * Turn a range of a file back into a hole, e.g. after a write of it
+ * failed part way, so it can not be mistaken for downloaded data.
+ * @param file - The file
+ * @param offset - Offset of the range in bytes
+ * @param length - Length of the range in bytes
+ */
+void output_punch(OutputFile *file, long long offset, long long length);
+
+
+/**
+ * Count the bytes of a file not yet written.
+ * @param file - The file
+ * @param holes - Output for the number of separate missing ranges, or NULL
+ * @return The number of missing bytes, 0 if the size is unknown
+ */
+long long output_missing(OutputFile *file, int *holes);
+
+
+/**
+ * Move a complete file into place under its real name, replacing any file
+ * already there, then close and free it.
+ * @param file - The file
+ * @return 0 on success, or -1 if bytes are still missing or the rename
+ *         failed, in which case the file is left for output_abandon
+ */
+int output_commit(OutputFile *file);
+
+
+/**
+ * Close and free a file that will not be completed.
+ * @param file - The file
+ * @param keep - Keep the partial file, holes and all, otherwise remove it
+ */
+void output_abandon(OutputFile *file, int keep);
+
+
+/**
+ * Get the size of a file within the download directory.
+ * @param dir - The download directory
+ * @param path - Path of the file relative to the download directory
+ * @return The size in bytes or -1 if the file does not exist
+ */
+long long output_size(OutputDir *dir, const char *path);
+
+
+/**
+ * Hard link a file from one directory into the same relative path of
+ * another, replacing any file already there. Used to materialize files
+ * from the content cache without copying them.
+ * @param from - The directory holding the file
+ * @param to - The directory to link the file into
+ * @param path - Path of the file relative to both directories
+ * @return 0 on success, -1 on failure
+ */
+int output_link(OutputDir *from, OutputDir *to, const char *path);
+
+
+// Methods output_clone may use to materialize a file.
+enum
+{
+    OUTPUT_REFLINK = 1,
+    OUTPUT_HARDLINK,
+    OUTPUT_COPY,
+};
+
+
+/**
+ * Materialize a copy of one file within the download directory as
+ * another, replacing any file already there. The cheapest method the
+ * filesystem supports is used: a reflink sharing the original's extents,
+ * then a hard link, then an in-kernel copy.
+ * @param dir - The download directory
+ * @param from - Path of the existing file relative to the download directory
+ * @param to - Path of the copy relative to the download directory
+ * @return The OUTPUT_ method used, or -1 on failure
+ */
+int output_clone(OutputDir *dir, const char *from, const char *to);
+
+
+/**
+ * Close the download directory and forget the directories created.
+ * @param dir - The directory to close
+ */
+void output_dir_close(OutputDir *dir);
+
+
+#endif
@@ -0,0 +1,264 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "scheduler.h"
+
+// Tasks due within this many seconds are served ahead of every class (Default = 1s)
+#define URGENT_SECONDS 1.0
+// Initial number of tasks each class has room for, grown as needed (Default = 64)
+#define INITIAL_CAPACITY 64
+// Share of the workers each class receives while every class has tasks,
+// high:normal:bulk. Any non-zero bulk weight bounds how long it waits.
+static const int weights[SCHED_NUM_CLASSES] = {8, 4, 1};
+// Pass advanced per served task is STRIDE / weight (stride scheduling).
+#define STRIDE 840UL
+
+typedef struct
+{
+    void *item;
+    double deadline;    // INFINITY when the item has none
+    unsigned long seq;  // Order the item was put in, breaks ties
+} Entry;
+
+// One priority class, a binary min-heap ordered by deadline then seq.
+typedef struct
+{
+    Entry *heap;
+    int count;
+    int capacity;
+
+    // Virtual time of the class, the class with the lowest is served next.
+    unsigned long pass;
+} Class;
+
+typedef struct SchedulerStruct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t available;
+
+    Class classes[SCHED_NUM_CLASSES];
+    unsigned long seq;
+    unsigned long pass; // Pass of the class served last
+    int count;
+    int closed;
+} Scheduler;
+
+static int entry_before(const Entry *a, const Entry *b)
+{
+    return a->deadline < b->deadline || (a->deadline == b->deadline && a->seq < b->seq);
+}
+
+static void heap_push(Class *class, Entry entry)
+{
+    int i = class->count++;
+
+    if (class->count > class->capacity)
+    {
+        class->capacity = class->capacity ? class->capacity * 2 : INITIAL_CAPACITY;
+        class->heap = realloc(class->heap, sizeof(Entry) * class->capacity);
+        if (class->heap == NULL)
+        {
+            fprintf(stderr, "realloc() did not return a pointer! Likely out of memory.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // Sift up.
+    while (i > 0 && entry_before(&entry, &class->heap[(i - 1) / 2]))
+    {
+        class->heap[i] = class->heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    class->heap[i] = entry;
+}
+
+static void *heap_pop(Class *class)
+{
+    void *item = class->heap[0].item;
+    Entry last = class->heap[--class->count];
+    int i = 0;
+
+    // Sift the last entry down from the root.
+    while (2 * i + 1 < class->count)
+    {
+        int child = 2 * i + 1;
+
+        if (child + 1 < class->count && entry_before(&class->heap[child + 1], &class->heap[child]))
+        {
+            ++child;
+        }
+        if (!entry_before(&class->heap[child], &last))
+        {
+            break;
+        }
+        class->heap[i] = class->heap[child];
+        i = child;
+    }
+    if (class->count > 0)
+    {
+        class->heap[i] = last;
+    }
+
+    return item;
+}
+
+// Choose the class to serve next. Must be called with the lock held and
+// at least one item queued.
+static int choose_class(Scheduler *scheduler)
+{
+    double earliest = INFINITY;
+    int chosen = -1, urgent = -1;
+
+    for (int i = 0; i < SCHED_NUM_CLASSES; ++i)
+    {
+        Class *class = &scheduler->classes[i];
+
+        if (class->count == 0)
+        {
+            continue;
+        }
+        if (class->heap[0].deadline < earliest)
+        {
+            earliest = class->heap[0].deadline;
+            urgent = i;
+        }
+        if (chosen < 0 || class->pass < scheduler->classes[chosen].pass)
+        {
+            chosen = i;
+        }
+    }
+
+    // A task about to miss its deadline goes first whatever its class.
+    if (urgent >= 0 && earliest - scheduler_now() <= URGENT_SECONDS)
+    {
+        chosen = urgent;
+    }
+
+    return chosen;
+}
+
+/**
+ * Allocate an empty scheduler.
+ * @return scheduler - Pointer to the allocated scheduler
+ */
+Scheduler *scheduler_alloc(void)
+{
+    Scheduler *scheduler = calloc(1, sizeof(Scheduler));
+
+    pthread_mutex_init(&scheduler->lock, NULL);
+    pthread_cond_init(&scheduler->available, NULL);
+
+    return scheduler;
+}
+
+/**
+ * Free a scheduler. Don't call this function while the scheduler is still
+ * in use.
+ * @param scheduler - Pointer to the scheduler to free
+ */
+void scheduler_free(Scheduler *scheduler)
+{
+    for (int i = 0; i < SCHED_NUM_CLASSES; ++i)
+    {
+        free(scheduler->classes[i].heap);
+    }
+
+    pthread_mutex_destroy(&scheduler->lock);
+    pthread_cond_destroy(&scheduler->available);
+    free(scheduler);
+}
+
+/**
+ * Place an item into the scheduler. Never blocks.
+ * @param scheduler - Pointer to the scheduler
+ * @param item - The item to schedule, must not be NULL
+ * @param priority - One of the SCHED_ classes
+ * @param deadline - CLOCK_MONOTONIC time in seconds the item should be
+ *                   served by, 0 for none
+ */
+void scheduler_put(Scheduler *scheduler, void *item, int priority, double deadline)
+{
+    Entry entry = {item, deadline > 0 ? deadline : INFINITY, 0};
+    Class *class;
+
+    if (priority < 0 || priority >= SCHED_NUM_CLASSES)
+    {
+        priority = SCHED_NORMAL;
+    }
+    class = &scheduler->classes[priority];
+
+    pthread_mutex_lock(&scheduler->lock);
+    entry.seq = scheduler->seq++;
+
+    // A class that was idle rejoins at the current virtual time rather
+    // than with the credit it would have banked while idle.
+    if (class->count == 0 && class->pass < scheduler->pass)
+    {
+        class->pass = scheduler->pass;
+    }
+    heap_push(class, entry);
+    ++scheduler->count;
+
+    pthread_cond_signal(&scheduler->available);
+    pthread_mutex_unlock(&scheduler->lock);
+}
+
+/**
+ * Get the next item to serve, blocking until one is available.
+ * @param scheduler - Pointer to the scheduler
+ * @return item - The item, or NULL once the scheduler is closed and empty
+ */
+void *scheduler_get(Scheduler *scheduler)
+{
+    void *item = NULL;
+
+    pthread_mutex_lock(&scheduler->lock);
+    while (scheduler->count == 0 && !scheduler->closed)
+    {
+        pthread_cond_wait(&scheduler->available, &scheduler->lock);
+    }
+
+    if (scheduler->count > 0)
+    {
+        int chosen = choose_class(scheduler);
+        Class *class = &scheduler->classes[chosen];
+
+        item = heap_pop(class);
+        --scheduler->count;
+
+        scheduler->pass = class->pass;
+        class->pass += STRIDE / weights[chosen];
+    }
+    pthread_mutex_unlock(&scheduler->lock);
+
+    return item;
+}
+
+/**
+ * Close the scheduler, waking every getter once the remaining items have
+ * been served.
+ * @param scheduler - Pointer to the scheduler
+ */
+void scheduler_close(Scheduler *scheduler)
+{
+    pthread_mutex_lock(&scheduler->lock);
+    scheduler->closed = 1;
+    pthread_cond_broadcast(&scheduler->available);
+    pthread_mutex_unlock(&scheduler->lock);
+}
+
+/**
+ * Get the current CLOCK_MONOTONIC time in seconds, the clock deadlines
+ * are measured against.
+ * @return The time in seconds
+ */
+double scheduler_now(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
@@ -0,0 +1,74 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+
+/*
+ * Scheduler - a concurrent multi-level queue of download tasks. Each
+ * priority class is ordered by deadline, earliest first, with tasks that
+ * have no deadline served in the order they were put. Classes share the
+ * workers by weight so bulk tasks are never starved, except that a task
+ * whose deadline is close is served ahead of every class.
+ */
+typedef struct SchedulerStruct Scheduler;
+
+// Priority classes, most urgent first.
+enum
+{
+    SCHED_HIGH,
+    SCHED_NORMAL,
+    SCHED_BULK,
+    SCHED_NUM_CLASSES,
+};
+
+
+/**
+ * Allocate an empty scheduler.
+ * @return scheduler - Pointer to the allocated scheduler
+ */
+Scheduler *scheduler_alloc(void);
+
+
+/**
+ * Free a scheduler. Don't call this function while the scheduler is still
+ * in use.
+ * @param scheduler - Pointer to the scheduler to free
+ */
+void scheduler_free(Scheduler *scheduler);
+
+
+/**
+ * Place an item into the scheduler. Never blocks.
+ * @param scheduler - Pointer to the scheduler
+ * @param item - The item to schedule, must not be NULL
+ * @param priority - One of the SCHED_ classes
+ * @param deadline - CLOCK_MONOTONIC time in seconds the item should be
+ *                   served by, 0 for none
+ */
+void scheduler_put(Scheduler *scheduler, void *item, int priority, double deadline);
+
+
+/**
+ * Get the next item to serve, blocking until one is available.
+ * @param scheduler - Pointer to the scheduler
+ * @return item - The item, or NULL once the scheduler is closed and empty
+ */
+void *scheduler_get(Scheduler *scheduler);
+
+
+/**
+ * Close the scheduler, waking every getter once the remaining items have
+ * been served.
+ * @param scheduler - Pointer to the scheduler
+ */
+void scheduler_close(Scheduler *scheduler);
+
+
+/**
+ * Get the current CLOCK_MONOTONIC time in seconds, the clock deadlines
+ * are measured against.
+ * @return The time in seconds
+ */
+double scheduler_now(void);
+
+
+#endif
@@ -0,0 +1,344 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/x509v3.h>
+
+#include "tls.h"
+#include "metrics.h"
+
+#define KEY_SIZE 1100
+
+struct TlsStruct
+{
+    SSL *ssl;
+    char key[KEY_SIZE]; // host:port the session is cached under
+    int finished;       // The server finished sending, the session is reusable
+};
+
+// The last session ticket received from each host:port.
+typedef struct CachedSession
+{
+    char *key;
+    SSL_SESSION *session;
+
+    struct CachedSession *next;
+} CachedSession;
+
+static TlsSettings tls_settings = {NULL, 0, 0};
+static SSL_CTX *context = NULL;
+static pthread_mutex_t context_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static CachedSession *sessions = NULL;
+static pthread_mutex_t sessions_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Print the most recent OpenSSL error after a message.
+static void print_error(const char *message, const char *host)
+{
+    char reason[256];
+
+    ERR_error_string_n(ERR_get_error(), reason, sizeof(reason));
+    fprintf(stderr, "ERROR | %s %s: %s\n", message, host, reason);
+    ERR_clear_error();
+}
+
+// Keep a new session ticket for the next connection to the same host.
+// Called by OpenSSL during the handshake, or for TLS 1.3 once the ticket
+// arrives after it. Returning 1 takes ownership of the session.
+static int keep_session(SSL *ssl, SSL_SESSION *session)
+{
+    Tls *tls = SSL_get_app_data(ssl);
+    CachedSession *entry;
+
+    pthread_mutex_lock(&sessions_lock);
+    for (entry = sessions; entry != NULL; entry = entry->next)
+    {
+        if (strcmp(entry->key, tls->key) == 0)
+        {
+            break;
+        }
+    }
+    if (entry == NULL)
+    {
+        entry = calloc(1, sizeof(CachedSession));
+        entry->key = strdup(tls->key);
+        entry->next = sessions;
+        sessions = entry;
+    }
+    else
+    {
+        SSL_SESSION_free(entry->session);
+    }
+    entry->session = session;
+    pthread_mutex_unlock(&sessions_lock);
+
+    return 1;
+}
+
+// Create the context shared by every connection from the current settings.
+static SSL_CTX *create_context(void)
+{
+    SSL_CTX *ctx = SSL_CTX_new(TLS_client_method());
+
+    if (ctx == NULL)
+    {
+        print_error("could not create TLS context", "");
+        return NULL;
+    }
+
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+
+    // HTTP/1.0 responses end with the connection, which servers commonly
+    // close without a close_notify. Truncated ranges are still caught by
+    // their length.
+    SSL_CTX_set_options(ctx, SSL_OP_IGNORE_UNEXPECTED_EOF);
+    if (tls_settings.ktls)
+    {
+        SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+    }
+
+    if (!tls_settings.insecure)
+    {
+        if (tls_settings.ca_file ? SSL_CTX_load_verify_locations(ctx, tls_settings.ca_file, NULL) != 1
+                             : SSL_CTX_set_default_verify_paths(ctx) != 1)
+        {
+            print_error("could not load trusted certificates from", tls_settings.ca_file ? tls_settings.ca_file : "the system store");
+            SSL_CTX_free(ctx);
+            return NULL;
+        }
+        SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+    }
+
+    // Sessions are cached here by host rather than in OpenSSL's internal
+    // cache, which is keyed by session id and meant for servers.
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(ctx, keep_session);
+
+    return ctx;
+}
+
+/**
+ * Replace the settings used for all subsequent connections.
+ * Not thread-safe, call before spawning workers.
+ * @param settings - The settings to copy, ca_file must outlive every connection
+ * @return 0 on success, -1 if the ca_file could not be loaded
+ */
+int tls_configure(const TlsSettings *settings)
+{
+    tls_settings = *settings;
+
+    SSL_CTX_free(context);
+    context = create_context();
+
+    return context ? 0 : -1;
+}
+
+/**
+ * Perform the TLS handshake over a connected socket, resuming the last
+ * session with the same host and port when one is held.
+ * @param sockfd - The connected socket, still owned by the caller
+ * @param host - The host name, sent as SNI and verified against the certificate
+ * @param port - The port the socket is connected to
+ * @return tls - Pointer to the session or NULL on failure
+ */
+Tls *tls_connect(int sockfd, const char *host, int port)
+{
+    unsigned char address[sizeof(struct in6_addr)];
+    char name[KEY_SIZE];
+    size_t length = strlen(host);
+    Tls *tls;
+
+    // Connections made without tls_configure use the defaults.
+    pthread_mutex_lock(&context_lock);
+    if (context == NULL)
+    {
+        context = create_context();
+    }
+    pthread_mutex_unlock(&context_lock);
+
+    if (context == NULL || length + 1 > sizeof(name) || (tls = calloc(1, sizeof(Tls))) == NULL)
+    {
+        return NULL;
+    }
+    snprintf(tls->key, KEY_SIZE, "%s:%d", host, port);
+
+    // IPv6 literals are written in brackets e.g. [::1]
+    if (length > 1 && host[0] == '[' && host[length - 1] == ']')
+    {
+        memcpy(name, host + 1, length - 2);
+        name[length - 2] = '\0';
+    }
+    else
+    {
+        memcpy(name, host, length + 1);
+    }
+
+    if ((tls->ssl = SSL_new(context)) == NULL || SSL_set_fd(tls->ssl, sockfd) != 1)
+    {
+        print_error("could not start TLS with", host);
+        tls_close(tls);
+        return NULL;
+    }
+    SSL_set_app_data(tls->ssl, tls);
+
+    // Addresses are verified against the certificate's IP entries and are
+    // not sent as SNI, which only carries host names.
+    if (inet_pton(AF_INET, name, address) == 1 || inet_pton(AF_INET6, name, address) == 1)
+    {
+        X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(tls->ssl), name);
+    }
+    else
+    {
+        SSL_set_tlsext_host_name(tls->ssl, name);
+        SSL_set1_host(tls->ssl, name);
+    }
+
+    // Offer the last ticket from this host.
+    pthread_mutex_lock(&sessions_lock);
+    for (CachedSession *entry = sessions; entry != NULL; entry = entry->next)
+    {
+        if (strcmp(entry->key, tls->key) == 0)
+        {
+            SSL_set_session(tls->ssl, entry->session);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&sessions_lock);
+
+    if (SSL_connect(tls->ssl) != 1)
+    {
+        long result = SSL_get_verify_result(tls->ssl);
+
+        if (result != X509_V_OK)
+        {
+            fprintf(stderr, "ERROR | TLS certificate of %s: %s\n", host, X509_verify_cert_error_string(result));
+            ERR_clear_error();
+        }
+        else
+        {
+            print_error("TLS handshake with", host);
+        }
+        tls_close(tls);
+        return NULL;
+    }
+
+    metrics_add(tls_handshakes, 1);
+    if (SSL_session_reused(tls->ssl))
+    {
+        metrics_add(tls_resumed, 1);
+    }
+    if (BIO_get_ktls_recv(SSL_get_rbio(tls->ssl)))
+    {
+        metrics_add(tls_kernel, 1);
+    }
+
+    return tls;
+}
+
+/**
+ * Read decrypted bytes from a session.
+ * @param tls - The session
+ * @param data - Output buffer
+ * @param size - Most bytes to read
+ * @return The number of bytes read, 0 once the server has finished
+ *         sending, or -1 on failure
+ */
+ssize_t tls_read(Tls *tls, char *data, size_t size)
+{
+    int bytes_read = SSL_read(tls->ssl, data, size > INT_MAX ? INT_MAX : (int)size);
+
+    if (bytes_read > 0)
+    {
+        return bytes_read;
+    }
+
+    switch (SSL_get_error(tls->ssl, bytes_read))
+    {
+    case SSL_ERROR_ZERO_RETURN:
+        tls->finished = 1;
+        return 0;
+    case SSL_ERROR_WANT_READ:
+    case SSL_ERROR_WANT_WRITE:
+        // The socket's receive timeout expired, OpenSSL reports the EAGAIN
+        // as wanting to read. Report it as the timeout it is.
+        errno = EAGAIN;
+        return -1;
+    case SSL_ERROR_SYSCALL:
+        // errno is left as set by the failed read.
+        ERR_clear_error();
+        return -1;
+    default:
+        print_error("TLS read from", tls->key);
+        errno = EPROTO;
+        return -1;
+    }
+}
+
+/**
+ * Write all of the given bytes to a session.
+ * @param tls - The session
+ * @param data - Bytes to send
+ * @param length - Number of bytes to send
+ * @return 0 on success, -1 on failure
+ */
+int tls_write(Tls *tls, const char *data, size_t length)
+{
+    size_t written;
+
+    if (length == 0)
+    {
+        return 0;
+    }
+    if (SSL_write_ex(tls->ssl, data, length, &written) != 1)
+    {
+        print_error("TLS write to", tls->key);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Free a session. The socket is not closed.
+ * @param tls - The session to free
+ */
+void tls_close(Tls *tls)
+{
+    if (tls->ssl)
+    {
+        // A session freed part way through an exchange is marked not
+        // resumable. One that read to the end is fine to resume, so it
+        // is closed as if close_notify had been exchanged.
+        if (tls->finished)
+        {
+            SSL_set_shutdown(tls->ssl, SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
+        }
+        SSL_free(tls->ssl);
+    }
+    free(tls);
+}
+
+/**
+ * Free the shared context and the cached sessions.
+ */
+void tls_cleanup(void)
+{
+    pthread_mutex_lock(&sessions_lock);
+    while (sessions)
+    {
+        CachedSession *next = sessions->next;
+        SSL_SESSION_free(sessions->session);
+        free(sessions->key);
+        free(sessions);
+        sessions = next;
+    }
+    pthread_mutex_unlock(&sessions_lock);
+
+    SSL_CTX_free(context);
+    context = NULL;
+}
@@ -0,0 +1,80 @@
+#ifndef TLS_H
+#define TLS_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+
+/*
+ * Tls - a TLS client session over a connected socket, used for https
+ * urls. The session ticket from each host is kept and offered by the next
+ * connection to the same host, so the many connections opened for the
+ * ranges of one file resume rather than repeat the full handshake.
+ */
+typedef struct TlsStruct Tls;
+
+// Settings shared by every TLS connection.
+typedef struct
+{
+    const char *ca_file; // PEM file of trusted certificates, NULL for the system store
+    int insecure;        // Skip verifying the server's certificate
+    int ktls;            // Offload record encryption to the kernel when it supports it
+
+} TlsSettings;
+
+
+/**
+ * Replace the settings used for all subsequent connections.
+ * Not thread-safe, call before spawning workers.
+ * @param settings - The settings to copy, ca_file must outlive every connection
+ * @return 0 on success, -1 if the ca_file could not be loaded
+ */
+int tls_configure(const TlsSettings *settings);
+
+
+/**
+ * Perform the TLS handshake over a connected socket, resuming the last
+ * session with the same host and port when one is held.
+ * @param sockfd - The connected socket, still owned by the caller
+ * @param host - The host name, sent as SNI and verified against the certificate
+ * @param port - The port the socket is connected to
+ * @return tls - Pointer to the session or NULL on failure
+ */
+Tls *tls_connect(int sockfd, const char *host, int port);
+
+
+/**
+ * Read decrypted bytes from a session.
+ * @param tls - The session
+ * @param data - Output buffer
+ * @param size - Most bytes to read
+ * @return The number of bytes read, 0 once the server has finished
+ *         sending, or -1 on failure
+ */
+ssize_t tls_read(Tls *tls, char *data, size_t size);
+
+
+/**
+ * Write all of the given bytes to a session.
+ * @param tls - The session
+ * @param data - Bytes to send
+ * @param length - Number of bytes to send
+ * @return 0 on success, -1 on failure
+ */
+int tls_write(Tls *tls, const char *data, size_t length);
+
+
+/**
+ * Free a session. The socket is not closed.
+ * @param tls - The session to free
+ */
+void tls_close(Tls *tls);
+
+
+/**
+ * Free the shared context and the cached sessions.
+ */
+void tls_cleanup(void);
+
+
+#endif
@@ -0,0 +1,104 @@
+#include <string.h>
+#include <strings.h>
+
+#include "url.h"
+
+// Characters that end the host of a url.
+static const unsigned char ends_host[256] = {[':'] = 1, ['/'] = 1, ['?'] = 1, ['#'] = 1};
+
+/**
+ * Split a url into its parts. Urls without a scheme are http.
+ * @param url - The url, need not be NUL terminated
+ * @param length - Number of characters in url
+ * @param parsed - Output for the parts, views into url
+ * @return 0 on success, -1 if the url is malformed or its scheme is not http(s)
+ */
+int url_parse(const char *url, size_t length, Url *parsed)
+{
+    const char *p = url, *end = url + length, *s, *host_end, *page_end, *query;
+
+    memset(parsed, 0, sizeof(Url));
+    parsed->port = URL_HTTP_PORT;
+
+    // Any other scheme is rejected below, as what follows its colon is
+    // not a port.
+    if (length >= 8 && strncasecmp(p, "https://", 8) == 0)
+    {
+        parsed->tls = 1;
+        parsed->port = URL_HTTPS_PORT;
+        p += 8;
+    }
+    else if (length >= 7 && strncasecmp(p, "http://", 7) == 0)
+    {
+        p += 7;
+    }
+
+    // The host ends at the port, or at whichever of the path, query and
+    // fragment comes first. IPv6 literals contain colons so end at the
+    // closing bracket instead.
+    if (p < end && *p == '[')
+    {
+        host_end = memchr(p, ']', end - p);
+        if (host_end == NULL || host_end == p + 1)
+        {
+            return -1;
+        }
+        ++host_end;
+    }
+    else
+    {
+        for (host_end = p; host_end < end && !ends_host[(unsigned char)*host_end]; ++host_end)
+        {
+        }
+    }
+    if (host_end == p)
+    {
+        return -1;
+    }
+    parsed->host = p;
+    parsed->host_length = host_end - p;
+
+    s = host_end;
+    if (s < end && *s == ':')
+    {
+        const char *digits = ++s;
+        long port = 0;
+
+        while (s < end && *s >= '0' && *s <= '9' && port <= 65535)
+        {
+            port = port * 10 + (*s++ - '0');
+        }
+        if (s == digits || port == 0 || port > 65535)
+        {
+            return -1;
+        }
+        parsed->port = port;
+    }
+    if (s < end && *s != '/' && *s != '?' && *s != '#')
+    {
+        return -1;
+    }
+    parsed->authority = p;
+    parsed->authority_length = s - p;
+
+    // The page is requested without its leading '/', and the fragment is
+    // never sent to the server.
+    if (s < end && *s == '/')
+    {
+        ++s;
+    }
+    if ((page_end = memchr(s, '#', end - s)) == NULL)
+    {
+        page_end = end;
+    }
+    parsed->page = s;
+    parsed->page_length = page_end - s;
+
+    if ((query = memchr(s, '?', page_end - s)) != NULL)
+    {
+        parsed->query = query + 1;
+        parsed->query_length = page_end - query - 1;
+    }
+
+    return 0;
+}
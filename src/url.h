@@ -0,0 +1,45 @@
+#ifndef URL_H
+#define URL_H
+
+#include <stddef.h>
+
+
+/*
+ * Url - the parts of a url as views into the original string. Nothing is
+ * copied, so the parts are not NUL terminated and are only valid for as
+ * long as the string is.
+ *
+ * Accepted urls are [http://|https://]HOST[:PORT][/PATH][?QUERY][#FRAGMENT]
+ * where HOST is a name, an IPv4 address or a bracketed IPv6 address.
+ */
+typedef struct
+{
+    const char *authority; // HOST[:PORT] as written, for the Host header
+    size_t authority_length;
+    const char *host;      // Host, IPv6 literals keep their brackets e.g. [::1]
+    size_t host_length;
+    const char *page;      // Path and query without the leading '/', as requested
+    size_t page_length;
+    const char *query;     // Query after the '?' within page, NULL if there is none
+    size_t query_length;
+    int port;              // The explicit port, otherwise the scheme's default
+    int tls;               // The scheme is https
+
+} Url;
+
+// Default ports of the http and https schemes.
+#define URL_HTTP_PORT 80
+#define URL_HTTPS_PORT 443
+
+
+/**
+ * Split a url into its parts. Urls without a scheme are http.
+ * @param url - The url, need not be NUL terminated
+ * @param length - Number of characters in url
+ * @param parsed - Output for the parts, views into url
+ * @return 0 on success, -1 if the url is malformed or its scheme is not http(s)
+ */
+int url_parse(const char *url, size_t length, Url *parsed);
+
+
+#endif
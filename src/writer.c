@@ -0,0 +1,247 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include "writer.h"
+#include "metrics.h"
+
+// Most ranges a writer thread takes at once, and so coalesces (Default = IOV_MAX)
+#define WRITE_BATCH IOV_MAX
+
+typedef struct WriterStruct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t available;
+    pthread_cond_t space;
+
+    // Ranges waiting to be written, in the order they were submitted.
+    WriteRequest *head;
+    WriteRequest **tail;
+    int pending;
+    int max_pending;
+    int closing;
+
+    void (*done)(void *arg, WriteRequest *request, ssize_t written);
+    void *arg;
+
+    pthread_t *threads;
+    int num_threads;
+} Writer;
+
+// Order requests by file then offset so adjacent ranges end up together.
+static int compare_requests(const void *a, const void *b)
+{
+    const WriteRequest *x = *(WriteRequest *const *)a, *y = *(WriteRequest *const *)b;
+
+    if (x->fd != y->fd)
+    {
+        return x->fd < y->fd ? -1 : 1;
+    }
+    return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+// Write a run of adjacent ranges of one file with as few pwritev() calls
+// as the kernel allows. Returns 0 once every byte is written, -1 otherwise.
+static int write_run(WriteRequest **run, int count)
+{
+    struct iovec iov[WRITE_BATCH];
+    off_t offset = run[0]->offset;
+    ssize_t written = 0;
+    int first = 0;
+
+    for (int i = 0; i < count; ++i)
+    {
+        iov[i].iov_base = (void *)run[i]->data;
+        iov[i].iov_len = run[i]->length;
+    }
+
+    // pwritev() may stop short, resume from wherever it got to.
+    while (1)
+    {
+        while (first < count && (size_t)written >= iov[first].iov_len)
+        {
+            written -= iov[first++].iov_len;
+        }
+        if (first == count)
+        {
+            return 0;
+        }
+        iov[first].iov_base = (char *)iov[first].iov_base + written;
+        iov[first].iov_len -= written;
+
+        written = pwritev(run[0]->fd, iov + first, count - first, offset);
+        if (written < 0 && errno == EINTR)
+        {
+            written = 0;
+            continue;
+        }
+        if (written <= 0)
+        {
+            perror("ERROR pwritev");
+            return -1;
+        }
+        metrics_add(write_calls, 1);
+        offset += written;
+    }
+}
+
+static void *writer_thread(void *arg)
+{
+    Writer *writer = (Writer *)arg;
+    WriteRequest *batch[WRITE_BATCH];
+
+    while (1)
+    {
+        int count = 0;
+
+        pthread_mutex_lock(&writer->lock);
+        while (writer->head == NULL && !writer->closing)
+        {
+            pthread_cond_wait(&writer->available, &writer->lock);
+        }
+        if (writer->head == NULL)
+        {
+            pthread_mutex_unlock(&writer->lock);
+            break;
+        }
+
+        // Take everything waiting, up to a batch, so it can be coalesced.
+        while (writer->head && count < WRITE_BATCH)
+        {
+            batch[count++] = writer->head;
+            writer->head = writer->head->next;
+        }
+        if (writer->head == NULL)
+        {
+            writer->tail = &writer->head;
+        }
+        writer->pending -= count;
+        pthread_cond_broadcast(&writer->space);
+        pthread_mutex_unlock(&writer->lock);
+
+        qsort(batch, count, sizeof(WriteRequest *), compare_requests);
+
+        for (int start = 0, end; start < count; start = end)
+        {
+            int rc, sync = batch[start]->sync;
+
+            // Extend the run while the next range starts where this one ends.
+            for (end = start + 1; end < count && batch[end]->fd == batch[start]->fd &&
+                                  batch[end]->offset == batch[end - 1]->offset + (off_t)batch[end - 1]->length;
+                 ++end)
+            {
+                sync |= batch[end]->sync;
+            }
+
+            rc = write_run(batch + start, end - start);
+            if (rc == 0 && sync && fdatasync(batch[start]->fd) != 0)
+            {
+                perror("ERROR fdatasync");
+                rc = -1;
+            }
+            metrics_add(write_ranges, end - start);
+
+            for (int i = start; i < end; ++i)
+            {
+                writer->done(writer->arg, batch[i], rc == 0 ? (ssize_t)batch[i]->length : -1);
+            }
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Start the writer threads.
+ * @param num_threads - Number of writer threads
+ * @param max_pending - Most ranges waiting to be written before
+ *                      writer_submit blocks
+ * @param done - Called from a writer thread once a range has been written,
+ *               with the number of bytes written or -1 on failure
+ * @param arg - Passed to done
+ * @return writer - Pointer to the writer
+ */
+Writer *writer_alloc(int num_threads, int max_pending, void (*done)(void *arg, WriteRequest *request, ssize_t written), void *arg)
+{
+    Writer *writer = calloc(1, sizeof(Writer));
+
+    pthread_mutex_init(&writer->lock, NULL);
+    pthread_cond_init(&writer->available, NULL);
+    pthread_cond_init(&writer->space, NULL);
+    writer->tail = &writer->head;
+    writer->max_pending = max_pending;
+    writer->done = done;
+    writer->arg = arg;
+    writer->num_threads = num_threads;
+    writer->threads = malloc(sizeof(pthread_t) * num_threads);
+
+    for (int i = 0; i < num_threads; ++i)
+    {
+        if (pthread_create(&writer->threads[i], NULL, writer_thread, writer) != 0)
+        {
+            perror("ERROR pthread_create");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    return writer;
+}
+
+/**
+ * Queue a range to be written, blocking while max_pending ranges are
+ * already waiting so a slow disk holds back the workers.
+ * @param writer - Pointer to the writer
+ * @param request - The range to write
+ */
+void writer_submit(Writer *writer, WriteRequest *request)
+{
+    request->next = NULL;
+
+    pthread_mutex_lock(&writer->lock);
+    while (writer->pending >= writer->max_pending)
+    {
+        metrics_add(write_stalls, 1);
+        pthread_cond_wait(&writer->space, &writer->lock);
+    }
+
+    *writer->tail = request;
+    writer->tail = &request->next;
+    ++writer->pending;
+
+    pthread_cond_signal(&writer->available);
+    pthread_mutex_unlock(&writer->lock);
+}
+
+/**
+ * Write every range still waiting then stop the writer threads and free
+ * the writer.
+ * @param writer - Pointer to the writer to free
+ */
+void writer_free(Writer *writer)
+{
+    pthread_mutex_lock(&writer->lock);
+    writer->closing = 1;
+    pthread_cond_broadcast(&writer->available);
+    pthread_mutex_unlock(&writer->lock);
+
+    for (int i = 0; i < writer->num_threads; ++i)
+    {
+        if (pthread_join(writer->threads[i], NULL) != 0)
+        {
+            perror("ERROR pthread_join");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    pthread_mutex_destroy(&writer->lock);
+    pthread_cond_destroy(&writer->available);
+    pthread_cond_destroy(&writer->space);
+    free(writer->threads);
+    free(writer);
+}
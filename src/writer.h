@@ -0,0 +1,63 @@
+#ifndef WRITER_H
+#define WRITER_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+
+/*
+ * WriteRequest - a range of downloaded bytes to write to a file. The
+ * request and its data are owned by the caller until the writer's done
+ * callback is made for it.
+ */
+typedef struct WriteRequest
+{
+    int fd;
+    off_t offset;
+    const char *data;
+    size_t length;
+    int sync; // fdatasync the file once the range has been written
+
+    struct WriteRequest *next;
+
+} WriteRequest;
+
+/*
+ * Writer - a write-behind stage of threads that take ranges off the
+ * workers' hands and write them out. Ranges of the same file that are
+ * waiting together and adjacent are coalesced into one pwritev().
+ */
+typedef struct WriterStruct Writer;
+
+
+/**
+ * Start the writer threads.
+ * @param num_threads - Number of writer threads
+ * @param max_pending - Most ranges waiting to be written before
+ *                      writer_submit blocks
+ * @param done - Called from a writer thread once a range has been written,
+ *               with the number of bytes written or -1 on failure
+ * @param arg - Passed to done
+ * @return writer - Pointer to the writer
+ */
+Writer *writer_alloc(int num_threads, int max_pending, void (*done)(void *arg, WriteRequest *request, ssize_t written), void *arg);
+
+
+/**
+ * Queue a range to be written, blocking while max_pending ranges are
+ * already waiting so a slow disk holds back the workers.
+ * @param writer - Pointer to the writer
+ * @param request - The range to write
+ */
+void writer_submit(Writer *writer, WriteRequest *request);
+
+
+/**
+ * Write every range still waiting then stop the writer threads and free
+ * the writer.
+ * @param writer - Pointer to the writer to free
+ */
+void writer_free(Writer *writer);
+
+
+#endif
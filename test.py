@@ -1,9 +1,30 @@
+import os
 import time
 import csv
 import subprocess
 
 file_sizes = ["0.1", "1", "5", "10", "50", "100"]
 
+# Worker placement policies compared against the kernel's default scheduling.
+# Set BENCH_NODES (e.g. "0,1") and BENCH_NIC (e.g. "eth0") to match the
+# machine being benchmarked. A policy without its setting is skipped, as is
+# an interface the machine does not have.
+placements = [("default", "")]
+if os.environ.get("BENCH_NODES"):
+    placements.append(("nodes", "--nodes " + os.environ["BENCH_NODES"]))
+if os.environ.get("BENCH_NIC"):
+    if os.path.exists(os.path.join("/sys/class/net", os.environ["BENCH_NIC"])):
+        placements.append(("nic", "--nic " + os.environ["BENCH_NIC"]))
+    else:
+        print("Skipping nic placement, no interface {}".format(os.environ["BENCH_NIC"]))
+
+
+def run(url_file, threads, flags=""):
+    start = time.time_ns()
+    subprocess.call("./bin/downloader {} {} {} files".format(flags, url_file, threads), shell=True, stdout=subprocess.DEVNULL)
+    return time.time_ns() - start
+
+
 with open('data3.csv', 'w', newline='') as data_file:
     writer = csv.writer(data_file)
     # Test up to 32 threads. Any higher is pointless.
@@ -37,4 +58,65 @@ with open('data3.csv', 'w', newline='') as data_file:
     #         subprocess.run(["./downloader", "download_urls/{}mb.txt".format(size), "{}".format(i), "files"])
     #         end = time.time_ns()
     #         time_taken = end - start
-    #         writer.writerow([size, i, time_taken])
\ No newline at end of file
+    #         writer.writerow([size, i, time_taken])
+
+# Compare worker placement policies. Use the loopback server to take the
+# WAN out of the measurement:
+#   python3 loopback_server.py --generate 10,100 bench_files download_urls/loopback.txt
+#   sudo python3 loopback_server.py bench_files &
+with open('data_placement.csv', 'w', newline='') as data_file:
+    writer = csv.writer(data_file)
+    print("Testing worker placement")
+    for name, flags in placements:
+        for i in [1, 2, 4, 8, 16, 32]:
+            for x in range(0, 3):
+                print("Run {} for {} threads placed by {}".format(x, i, name))
+                writer.writerow([name, i, run("download_urls/loopback.txt", i, flags)])
+
+# Compare raw range downloads against whole-file gzip downloads decoded on
+# the fly, for compressible payloads. The loopback server compresses text
+# payloads for clients that accept it:
+#   python3 loopback_server.py --generate 10,100 --text bench_files download_urls/loopback_text.txt
+#   sudo python3 loopback_server.py bench_files &
+# The first compressed run includes the server compressing each payload.
+with open('data_compression.csv', 'w', newline='') as data_file:
+    writer = csv.writer(data_file)
+    print("Testing compressed downloads")
+    for name, flags in [("raw", "--no-cache"), ("gzip", "--no-cache --compress")]:
+        for i in [1, 2, 4, 8]:
+            for x in range(0, 3):
+                print("Run {} for {} threads downloading {}".format(x, i, name))
+                writer.writerow([name, i, run("download_urls/loopback_text.txt", i, flags)])
+
+# Compare plain http against https, where each range opens its own
+# connection and so relies on resuming TLS sessions. Serve the same files
+# over both, see loopback_server.py for creating the certificate:
+#   python3 loopback_server.py --generate 10,100 bench_files download_urls/loopback.txt
+#   python3 loopback_server.py --port 443 --certfile cert.pem --keyfile key.pem \
+#       --generate 10,100 bench_files download_urls/loopback_tls.txt
+#   sudo python3 loopback_server.py bench_files &
+#   sudo python3 loopback_server.py --port 443 --certfile cert.pem --keyfile key.pem bench_files &
+with open('data_tls.csv', 'w', newline='') as data_file:
+    writer = csv.writer(data_file)
+    print("Testing https downloads")
+    for name, url_file, flags in [("http", "download_urls/loopback.txt", "--no-cache"),
+                                  ("https", "download_urls/loopback_tls.txt", "--no-cache --ca-file cert.pem"),
+                                  ("https-ktls", "download_urls/loopback_tls.txt", "--no-cache --ca-file cert.pem --ktls")]:
+        for i in [1, 2, 4, 8, 16]:
+            for x in range(0, 3):
+                print("Run {} for {} threads downloading over {}".format(x, i, name))
+                writer.writerow([name, i, run(url_file, i, flags)])
+
+# Compare run times with and without hedging when some range requests are
+# slow, like congested paths. Many runs per budget as the slow requests
+# land at random, compare the tails of the distributions:
+#   python3 loopback_server.py --generate 10,100 bench_files download_urls/loopback.txt
+#   sudo python3 loopback_server.py --slow-rate 0.05 --slow-bps 1048576 bench_files &
+with open('data_hedge.csv', 'w', newline='') as data_file:
+    writer = csv.writer(data_file)
+    print("Testing hedged range requests")
+    for budget in [0, 10, 25]:
+        for i in [4, 8]:
+            for x in range(0, 20):
+                print("Run {} for {} threads hedging up to {}%".format(x, i, budget))
+                writer.writerow([budget, i, run("download_urls/loopback.txt", i, "--no-cache --hedge {}".format(budget))])
@@ -0,0 +1,105 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "http.h"
+#include "url.h"
+
+#define REQUESTS 2000
+#define BUF_SIZE 1024
+#define RANGE "0-1023"
+
+
+static double seconds_since(const struct timespec *start) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+
+// Request a range the way the downloader used to, formatting into a
+// zeroed 1 KB buffer and writing all of it, as the baseline.
+static int padded_query(Buffer *dst, const Url *url, const char *host) {
+    char request[BUF_SIZE];
+    ssize_t bytes_read;
+    int sockfd;
+
+    memset(request, '\0', BUF_SIZE);
+    snprintf(request, BUF_SIZE,
+             "GET /%.*s HTTP/1.0\r\n"
+             "Host: %.*s\r\n"
+             "Range: bytes=%s\r\n"
+             "User-Agent: getter\r\n\r\n",
+             (int)url->page_length, url->page, (int)url->authority_length, url->authority, RANGE);
+
+    if ((sockfd = http_connect(host, url->port, 0)) < 0) {
+        return -1;
+    }
+    if (write(sockfd, request, sizeof(request)) != sizeof(request)) {
+        close(sockfd);
+        return -1;
+    }
+
+    dst->length = 0;
+    while ((bytes_read = read(sockfd, dst->data + dst->length, dst->capacity - dst->length - 1)) > 0) {
+        dst->length += bytes_read;
+    }
+    dst->data[dst->length] = '\0';
+
+    close(sockfd);
+    return bytes_read < 0 ? -1 : 0;
+}
+
+
+int main(int argc, char **argv) {
+
+    if (argc < 2 || argc > 3) {
+        fprintf(stderr, "usage: ./http_bench url [requests]\n");
+        exit(1);
+    }
+
+    const char *url = argv[1];
+    int requests = argc == 3 ? atoi(argv[2]) : REQUESTS;
+    int failures = 0;
+    struct timespec start;
+    double elapsed;
+    char host[BUF_SIZE];
+    Url parsed;
+
+    if (url_parse(url, strlen(url), &parsed) != 0 || parsed.tls || parsed.host_length >= sizeof(host)) {
+        fprintf(stderr, "expected an http url: %s\n", url);
+        exit(1);
+    }
+    memcpy(host, parsed.host, parsed.host_length);
+    host[parsed.host_length] = '\0';
+
+    // Large enough for a 1 KB range and its header.
+    Buffer *response = buffer_alloc(64 * BUF_SIZE);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < requests; ++i) {
+        if (http_url_into(response, url, RANGE, 0) != 0 || http_status(response->data) != 206) {
+            failures++;
+        }
+    }
+    elapsed = seconds_since(&start);
+    printf("gathered: %d requests in %.3f s (%.0f requests/s)\n", requests, elapsed, requests / elapsed);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < requests; ++i) {
+        if (padded_query(response, &parsed, host) != 0 || http_status(response->data) != 206) {
+            failures++;
+        }
+    }
+    elapsed = seconds_since(&start);
+    printf("padded:   %d requests in %.3f s (%.0f requests/s)\n", requests, elapsed, requests / elapsed);
+
+    buffer_free(response);
+    http_cleanup();
+
+    printf("%d requests failed\n", failures);
+    return failures != 0;
+}
@@ -0,0 +1,67 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "intern.h"
+
+#define NUM_THREADS 16
+#define N 100000
+
+InternTable *table;
+const char *canonical[N];
+
+
+void *doIntern(void *arg) {
+    int mismatches = 0;
+    char url[64];
+
+    // Every thread interns the same strings in a different order, so the
+    // first copy of each string is created by an arbitrary thread.
+    for (int i = 0; i < N; ++i) {
+        int n = (i * 7919 + (int)(intptr_t)arg * 104729) % N;
+        int length = snprintf(url, sizeof(url), "mirror%d.example.com/file/%d", n % 10, n);
+
+        const char *s = intern(table, url, length);
+        if (strcmp(s, url) != 0 || s != intern(table, url, length)) {
+            ++mismatches;
+        }
+    }
+
+    pthread_exit((void*)(intptr_t)mismatches);
+}
+
+
+int main(int argc, char **argv) {
+
+    pthread_t thread[NUM_THREADS];
+    intptr_t value;
+    int i, mismatches = 0;
+    char url[64];
+
+    table = intern_alloc();
+
+    for (i = 0; i < NUM_THREADS; ++i) {
+        pthread_create(&thread[i], NULL, doIntern, (void*)(intptr_t)i);
+    }
+
+    for (i = 0; i < NUM_THREADS; ++i) {
+        pthread_join(thread[i], (void**)&value);
+        mismatches += value;
+    }
+
+    // Interning again after the threads finish must return the same copies.
+    for (i = 0; i < N; ++i) {
+        int length = snprintf(url, sizeof(url), "mirror%d.example.com/file/%d", i % 10, i);
+        canonical[i] = intern(table, url, length);
+        if (canonical[i] != intern(table, url, length)) {
+            ++mismatches;
+        }
+    }
+
+    printf("distinct strings: %zu, expected: %d, mismatches: %d\n", intern_count(table), N, mismatches);
+
+    intern_free(table);
+    return 0;
+}
@@ -0,0 +1,75 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "libdownloader.h"
+
+/*
+Downloads a url through the library while a second job for the same url,
+written to download_dir/cancelled, is cancelled, checking every callback
+is made.
+
+./libdownloader_test 127.0.0.1/5mb.bin /tmp/libdownloader_test
+*/
+
+typedef struct {
+    size_t bytes;
+    int files;
+    int done;
+    int counts[DOWNLOAD_NUM_OUTCOMES];
+} Progress;
+
+
+void on_progress(void *arg, int job, const char *url, size_t bytes) {
+    __atomic_add_fetch(&((Progress*)arg)->bytes, bytes, __ATOMIC_RELAXED);
+}
+
+void on_complete(void *arg, int job, const char *url, int outcome) {
+    __atomic_add_fetch(&((Progress*)arg)->files, 1, __ATOMIC_RELAXED);
+}
+
+void on_done(void *arg, int job, const int *counts) {
+    Progress *progress = (Progress*)arg;
+
+    memcpy(progress->counts, counts, sizeof(progress->counts));
+    progress->done = 1;
+}
+
+
+int main(int argc, char **argv) {
+
+    if (argc != 3) {
+        fprintf(stderr, "usage: ./libdownloader_test url download_dir\n");
+        exit(1);
+    }
+
+    DownloadOptions options = {.use_cache = 0};
+    Progress fetched = {0}, cancelled = {0};
+    DownloadCallbacks fetch_callbacks = {on_progress, on_complete, on_done, &fetched};
+    DownloadCallbacks cancel_callbacks = {on_progress, on_complete, on_done, &cancelled};
+
+    char cancel_dir[4096];
+    snprintf(cancel_dir, sizeof(cancel_dir), "%s/cancelled", argv[2]);
+    mkdir(cancel_dir, 0755);
+
+    Downloader *downloader = downloader_create(4, NULL);
+
+    int job = downloader_submit(downloader, argv[1], argv[2], &options, &fetch_callbacks);
+    int other = downloader_submit(downloader, argv[1], cancel_dir, &options, &cancel_callbacks);
+    downloader_cancel(downloader, other);
+
+    downloader_wait(downloader, job);
+    downloader_wait(downloader, other);
+
+    printf("job %d: %zu bytes, %d files, %d ok\n", job, fetched.bytes, fetched.files, fetched.counts[DOWNLOAD_OK]);
+    printf("job %d: %d files, %d cancelled\n", other, cancelled.files, cancelled.counts[DOWNLOAD_CANCELLED]);
+
+    int failed = !fetched.done || fetched.counts[DOWNLOAD_OK] != 1 || fetched.bytes == 0 ||
+                 !cancelled.done || cancelled.files != 1 || downloader_cancel(downloader, job) == 0;
+
+    downloader_destroy(downloader);
+
+    printf("%s\n", failed ? "FAILED" : "OK");
+    return failed;
+}
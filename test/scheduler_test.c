@@ -0,0 +1,141 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "scheduler.h"
+
+#define NUM_THREADS 16
+#define N 1000000
+
+typedef struct {
+    int value;
+    int priority;
+} Task;
+
+
+void *doSum(void *arg) {
+    long sum = 0;
+    Scheduler *scheduler = (Scheduler*)arg;
+
+    Task *task = (Task*)scheduler_get(scheduler);
+    while (task) {
+        sum += task->value;
+        free(task);
+
+        task = (Task*)scheduler_get(scheduler);
+    }
+
+    pthread_exit((void*)(intptr_t)sum);
+}
+
+
+Task *make_task(int value, int priority) {
+    Task *task = (Task*)malloc(sizeof(Task));
+    task->value = value;
+    task->priority = priority;
+    return task;
+}
+
+
+// Serve a mix of classes from one thread and check the order they come out in.
+int check_order() {
+    Scheduler *scheduler = scheduler_alloc();
+    int failures = 0, served[SCHED_NUM_CLASSES] = {0}, longest_wait = 0, wait = 0;
+    double now = scheduler_now();
+    Task *task;
+
+    for (int i = 0; i < 100; ++i) {
+        scheduler_put(scheduler, make_task(i, SCHED_BULK), SCHED_BULK, 0);
+        scheduler_put(scheduler, make_task(i, SCHED_NORMAL), SCHED_NORMAL, 0);
+        scheduler_put(scheduler, make_task(i, SCHED_HIGH), SCHED_HIGH, 0);
+    }
+
+    // High priority is served first and no class is starved while the others have work.
+    for (int i = 0; i < 60; ++i) {
+        task = (Task*)scheduler_get(scheduler);
+        if (i == 0 && task->priority != SCHED_HIGH) {
+            printf("first task was class %d, expected high\n", task->priority);
+            failures++;
+        }
+        wait = task->priority == SCHED_BULK ? 0 : wait + 1;
+        longest_wait = wait > longest_wait ? wait : longest_wait;
+        served[task->priority]++;
+        free(task);
+    }
+    printf("served high: %d, normal: %d, bulk: %d, longest bulk wait: %d\n",
+           served[SCHED_HIGH], served[SCHED_NORMAL], served[SCHED_BULK], longest_wait);
+    if (served[SCHED_HIGH] <= served[SCHED_NORMAL] || served[SCHED_NORMAL] <= served[SCHED_BULK] ||
+        served[SCHED_BULK] == 0 || longest_wait > 13) {
+        failures++;
+    }
+
+    // Within a class the earliest deadline goes first, then tasks without one in order.
+    Scheduler *deadlines = scheduler_alloc();
+    scheduler_put(deadlines, make_task(3, SCHED_NORMAL), SCHED_NORMAL, 0);
+    scheduler_put(deadlines, make_task(2, SCHED_NORMAL), SCHED_NORMAL, now + 200);
+    scheduler_put(deadlines, make_task(1, SCHED_NORMAL), SCHED_NORMAL, now + 100);
+    scheduler_put(deadlines, make_task(4, SCHED_NORMAL), SCHED_NORMAL, 0);
+    for (int expected = 1; expected <= 4; ++expected) {
+        task = (Task*)scheduler_get(deadlines);
+        if (task->value != expected) {
+            printf("deadline order: got %d, expected %d\n", task->value, expected);
+            failures++;
+        }
+        free(task);
+    }
+    scheduler_free(deadlines);
+
+    // A bulk task about to miss its deadline overtakes every high priority task.
+    scheduler_put(scheduler, make_task(-1, SCHED_BULK), SCHED_BULK, now);
+    task = (Task*)scheduler_get(scheduler);
+    if (task->value != -1) {
+        printf("urgent bulk task was not served first\n");
+        failures++;
+    }
+    free(task);
+
+    scheduler_close(scheduler);
+    while ((task = (Task*)scheduler_get(scheduler)) != NULL) {
+        free(task);
+    }
+    scheduler_free(scheduler);
+
+    return failures;
+}
+
+
+int main(int argc, char **argv) {
+
+    int i;
+    long sum, expected = 0;
+
+    int failures = check_order();
+
+    pthread_t thread[NUM_THREADS];
+    Scheduler *scheduler = scheduler_alloc();
+
+    for (i = 0; i < NUM_THREADS; ++i) {
+        pthread_create(&thread[i], NULL, doSum, scheduler);
+    }
+
+    for (i = 0; i < N; ++i) {
+        scheduler_put(scheduler, make_task(i, i % SCHED_NUM_CLASSES), i % SCHED_NUM_CLASSES, 0);
+        expected += i;
+    }
+
+    scheduler_close(scheduler);
+
+    intptr_t value;
+    sum = 0;
+    for (i = 0; i < NUM_THREADS; ++i) {
+        pthread_join(thread[i], (void**)&value);
+        sum += value;
+    }
+
+    scheduler_free(scheduler);
+
+    printf("total sum: %ld, expected sum: %ld\n", sum, expected);
+    printf("%s\n", failures == 0 && sum == expected ? "OK" : "FAILED");
+    return failures != 0 || sum != expected;
+}
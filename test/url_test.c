@@ -0,0 +1,183 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "url.h"
+
+#define N 1000000
+#define BUF_SIZE 1024
+
+typedef struct {
+    const char *url;
+    int ok;
+    const char *authority;
+    const char *host;
+    int port;
+    int tls;
+    const char *page;
+    const char *query; // NULL when the url has none
+} Case;
+
+static const Case cases[] = {
+    {"www.example.com/a/b.html", 1, "www.example.com", "www.example.com", 80, 0, "a/b.html", NULL},
+    {"http://www.example.com/a", 1, "www.example.com", "www.example.com", 80, 0, "a", NULL},
+    {"HTTPS://www.example.com/a", 1, "www.example.com", "www.example.com", 443, 1, "a", NULL},
+    {"cache.local:8080/pkg.tar", 1, "cache.local:8080", "cache.local", 8080, 0, "pkg.tar", NULL},
+    {"https://store.example.com:8443/x?sig=a%2Fb&exp=1#part", 1, "store.example.com:8443", "store.example.com",
+     8443, 1, "x?sig=a%2Fb&exp=1", "sig=a%2Fb&exp=1"},
+    {"[::1]/file", 1, "[::1]", "[::1]", 80, 0, "file", NULL},
+    {"https://[2001:db8::2]:4443/f?a=1", 1, "[2001:db8::2]:4443", "[2001:db8::2]", 4443, 1, "f?a=1", "a=1"},
+    {"example.com", 1, "example.com", "example.com", 80, 0, "", NULL},
+    {"example.com?q", 1, "example.com", "example.com", 80, 0, "?q", "q"},
+    {"127.0.0.1/dir/?", 1, "127.0.0.1", "127.0.0.1", 80, 0, "dir/?", ""},
+    {"ftp://example.com/a", 0},
+    {"example.com:0/a", 0},
+    {"example.com:65536/a", 0},
+    {"example.com:99999999999999999999/a", 0},
+    {"example.com:/a", 0},
+    {"example.com:80x/a", 0},
+    {"[::1/a", 0},
+    {"[]/a", 0},
+    {"[::1]x/a", 0},
+    {"/a", 0},
+    {"https:///a", 0},
+    {"", 0},
+};
+
+
+static int matches(const char *view, size_t length, const char *expected) {
+    if (expected == NULL) {
+        return view == NULL;
+    }
+    return view != NULL && length == strlen(expected) && strncmp(view, expected, length) == 0;
+}
+
+
+static int check_cases() {
+    int failures = 0;
+
+    for (size_t i = 0; i < sizeof(cases) / sizeof(Case); ++i) {
+        const Case *c = &cases[i];
+        Url url;
+        int ok = url_parse(c->url, strlen(c->url), &url) == 0;
+
+        if (ok != c->ok) {
+            printf("%s: expected %s\n", c->url, c->ok ? "success" : "failure");
+            failures++;
+            continue;
+        }
+        if (ok && (!matches(url.authority, url.authority_length, c->authority) ||
+                   !matches(url.host, url.host_length, c->host) || url.port != c->port || url.tls != c->tls ||
+                   !matches(url.page, url.page_length, c->page) || !matches(url.query, url.query_length, c->query))) {
+            printf("%s: parsed as authority '%.*s' host '%.*s' port %d tls %d page '%.*s' query '%.*s'\n",
+                   c->url, (int)url.authority_length, url.authority, (int)url.host_length, url.host, url.port,
+                   url.tls, (int)url.page_length, url.page, (int)url.query_length, url.query ? url.query : "");
+            failures++;
+        }
+    }
+
+    // Parts are views into the original string, which need not be NUL terminated.
+    const char *line = "https://mirror.example.com/file.bin mirror2.example.com/file.bin";
+    Url url;
+    if (url_parse(line, strchr(line, ' ') - line, &url) != 0 || url.host != line + 8 ||
+        !matches(url.page, url.page_length, "file.bin")) {
+        printf("url within a line was not parsed in place\n");
+        failures++;
+    }
+
+    return failures;
+}
+
+
+// Split a url the way the downloader used to, copying it into a fixed
+// size buffer first, as the baseline for the benchmark.
+static int copy_split(const char *url, char **host, char **page) {
+    *host = calloc(BUF_SIZE, 1);
+    strncpy(*host, url, BUF_SIZE - 1);
+
+    if ((*page = strchr(*host, '/')) == NULL) {
+        return -1;
+    }
+    *(*page)++ = '\0';
+    return 0;
+}
+
+
+static double seconds_since(const struct timespec *start) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+
+// Parse a million url list held in memory, as ingestion sees it.
+static int benchmark() {
+    char *list = malloc((size_t)N * 160), *p = list;
+    const char **urls = malloc(sizeof(char*) * N);
+    size_t *lengths = malloc(sizeof(size_t) * N), checksum = 0;
+    struct timespec start;
+    double elapsed;
+    int failures = 0;
+
+    for (int i = 0; i < N; ++i) {
+        urls[i] = p;
+        switch (i % 4) {
+        case 0:
+            lengths[i] = sprintf(p, "mirror%d.example.com/data/part-%07d.bin", i % 10, i);
+            break;
+        case 1:
+            lengths[i] = sprintf(p, "http://cache%d.local:8080/pkg/%d.tar.gz", i % 4, i);
+            break;
+        case 2:
+            lengths[i] = sprintf(p, "https://store.example.com/obj/%d?X-Signature=%08x%08x&X-Expires=%d", i,
+                                 i * 2654435761u, i ^ 0x5bd1e995, 3600 + i % 7);
+            break;
+        default:
+            lengths[i] = sprintf(p, "https://[2001:db8::%x]:8443/blob/%d", i % 4096, i);
+        }
+        p += lengths[i] + 1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < N; ++i) {
+        Url url;
+        if (url_parse(urls[i], lengths[i], &url) != 0) {
+            failures++;
+            continue;
+        }
+        checksum += url.host_length + url.page_length + url.port;
+    }
+    elapsed = seconds_since(&start);
+    printf("url_parse:  %d urls in %.3f s (%.1f M urls/s)\n", N, elapsed, N / elapsed / 1e6);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < N; ++i) {
+        char *host, *page;
+        if (copy_split(urls[i], &host, &page) == 0) {
+            checksum += strlen(host) + strlen(page);
+        }
+        free(host);
+    }
+    elapsed = seconds_since(&start);
+    printf("copy split: %d urls in %.3f s (%.1f M urls/s)\n", N, elapsed, N / elapsed / 1e6);
+
+    printf("%d generated urls failed to parse (checksum %zu)\n", failures, checksum);
+
+    free(list);
+    free(urls);
+    free(lengths);
+    return failures;
+}
+
+
+int main(int argc, char **argv) {
+
+    int failures = check_cases();
+
+    failures += benchmark();
+
+    printf("%s\n", failures == 0 ? "OK" : "FAILED");
+    return failures != 0;
+}